@@ -12,7 +12,12 @@ class DtextPreviewsController < ApplicationController
   private
 
   def options
-    opts = {}
+    opts = {
+      max_output_bytes: FemboyFans.config.dtext_preview_max_output_bytes,
+      max_dstack_depth: FemboyFans.config.dtext_preview_max_dstack_depth,
+      timeout:          FemboyFans.config.dtext_preview_timeout,
+      cache_blocks:     true,
+    }
     opts[:inline] = params[:inline].truthy? if params[:inline].present?
     opts[:allow_color] = params[:allow_color].truthy? if params[:allow_color].present?
     opts[:qtags] = params[:qtags].truthy? if params[:qtags].present?
@@ -168,7 +168,7 @@ module PostIndex
       rating:                   rating,
       file_ext:                 file_ext,
       source:                   source_array.map(&:downcase),
-      description:              description.presence,
+      description:              DText.to_plain_text(description, spoilers: true).presence,
 
       deleted:                  is_deleted,
       has_children:             has_children,
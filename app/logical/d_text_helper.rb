@@ -3,11 +3,13 @@
 module DTextHelper
   module_function
 
+  # The creator names are taken from the parse itself, so that they're only collected under the same limits (see
+  # DText.parse's max_output_bytes and timeout) as the rendering, rather than by a second, unlimited pass.
   def parse(text, **)
     return nil if text.nil?
-    *data = preprocess([text])
     hash = DText.parse(text, **)
-    hash[:dtext] = postprocess(hash[:dtext], *data)
+    names = hash[:creators].map { |name| Creator.normalize_name(name) }.uniq
+    hash[:dtext] = postprocess(hash[:dtext], *preprocess(names))
     hash
   end
 
@@ -15,8 +17,7 @@ module DTextHelper
     parse(text, **).fetch(:dtext)
   end
 
-  def preprocess(dtext_messages)
-    names = dtext_messages.map { |message| parse_creator_names(message) }.flatten.uniq
+  def preprocess(names)
     creators = Creator.where(title: names)
     tags = Tag.where(name: names)
     [creators, tags]
@@ -57,29 +58,21 @@ module DTextHelper
 
   def parse_creator_names(text)
     return [] if text.blank?
-    DText.parse(text) => { dtext: html }
-    fragment = parse_html(html)
 
-    titles = fragment.css("a.dtext-creator-link").map do |node|
-      if node["href"].include?("show_or_new")
-        title = node["href"][%r{\A/creators/show_or_new\?name=(.*)\z}i, 1]
-      else
-        title = node["href"][%r{\A/creators/(.*)\z}i, 1]
-      end
-      title = CGI.unescape(title)
-      title = Creator.normalize_title(title)
-      title
+    names = DText.each_event(text).filter_map do |type, kind, name|
+      Creator.normalize_name(name) if type == :link && kind == :creator
     end
 
-    titles.uniq
+    names.uniq
   end
 
   def parse_external_links(text)
     return [] if text.blank?
-    DText.parse(text) => { dtext: html }
-    fragment = parse_html(html)
 
-    links = fragment.css("a.dtext-external-link").pluck("href")
+    links = DText.each_event(text).filter_map do |type, kind, url|
+      url if type == :link && kind == :external
+    end
+
     links.uniq
   end
 
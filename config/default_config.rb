@@ -142,6 +142,37 @@ module FemboyFans
       500
     end
 
+    # Resource limits for rendering DText previews, which anyone can request. Going over one renders an empty preview.
+    def dtext_preview_max_output_bytes
+      5.megabytes
+    end
+
+    def dtext_preview_max_dstack_depth
+      100
+    end
+
+    # In seconds.
+    def dtext_preview_timeout
+      0.5
+    end
+
+    # Memory used to cache the rendered output of short DText strings that are rendered over and over (like common mod
+    # action texts), per process. 0 disables the cache.
+    def dtext_render_cache_max_bytes
+      32.megabytes
+    end
+
+    # A file to cache the rendered output of short DText strings in, shared by all the workers on a host (e.g.
+    # "/dev/shm/femboyfans-dtext.cache"). nil disables the shared cache.
+    def dtext_shared_render_cache_path
+      nil
+    end
+
+    # The size of the shared DText render cache file.
+    def dtext_shared_render_cache_max_bytes
+      64.megabytes
+    end
+
     def move_related_thumbnails?
       false
     end
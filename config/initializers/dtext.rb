@@ -0,0 +1,7 @@
+# frozen_string_literal: true
+
+DText.render_cache_max_bytes = FemboyFans.config.dtext_render_cache_max_bytes
+
+if FemboyFans.config.dtext_shared_render_cache_path.present?
+  DText.open_shared_render_cache(FemboyFans.config.dtext_shared_render_cache_path, max_bytes: FemboyFans.config.dtext_shared_render_cache_max_bytes)
+end
@@ -0,0 +1,710 @@
+// cdtext: a command-line frontend to the parser, for rendering DText in batches and for benchmarking and profiling the
+// parser without Ruby. Built with `bin/rake compile` (see the Rakefile); run `bin/cdtext.exe --help` for usage.
+
+#include "dtext.h"
+#include "libdtext.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <cinttypes>
+#include <cmath>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <iterator>
+#include <malloc.h>
+#include <new>
+#include <string>
+#include <string_view>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <thread>
+#include <tuple>
+#include <unistd.h>
+#include <vector>
+
+static const char* USAGE = R"(Usage: cdtext [OPTIONS] [FILE...]
+
+Render each FILE as a DText document and write the HTML to stdout. With no FILE, or with --ndjson, read documents from
+stdin instead.
+
+Input and output:
+  --ndjson                 Read one document per line from stdin, either as a JSON string or as a JSON object with a
+                           "dtext" key (and optionally an "id", which is copied to the output). Write one JSON object
+                           per line, with "html", "creators", "post_ids", "qtags" and "truncated" (or "error").
+  --metadata               Write the creators, post IDs and qtags of each document as JSON instead of the HTML.
+  --bench[=PASSES]         Parse every document PASSES times (by default, as many times as fit in --bench-time) and
+                           report the throughput, the latency percentiles per document, the allocations per
+                           document and the peak memory used, instead of writing the output.
+  --bench-time=SECONDS     How long --bench runs for without PASSES (default: 1).
+  --bench-threads=N        Run --bench on N threads at once, each parsing every document with its own parser, and
+                           report the combined throughput (used by `bin/rake bench:threads`).
+  --json                   Write the --bench results as JSON, including the median and the median absolute deviation
+                           of the latency (in seconds; used by `bin/rake bench:record`) and the memory used.
+  --profile                Print the hits, bytes and cycles of each scanner rule to stderr at the end (needs a build
+                           with DTEXT_PROFILE=1, or DTEXT_PROFILE=cycles for the cycles).
+
+Parser options (as in DText.parse):
+  --inline                 --allow-color               --qtags
+  --base-url=URL           --domain=DOMAIN             --internal-domain=DOMAIN (repeatable)
+  --max-output-bytes=N     --max-dstack-depth=N        --timeout=SECONDS
+  --max-visible-chars=N    --threads=N
+)";
+
+// Allocations made by the parser, counted by the replaced global operator new and delete. They're counted per thread,
+// so that counting them doesn't add contention between the threads of --bench-threads. `live_bytes` is the memory
+// allocated by this thread and not yet freed, and `peak_live_bytes` its high-water mark (both only approximate with
+// --threads, since memory allocated by one thread is then freed by another).
+static thread_local size_t allocations = 0;
+static thread_local size_t allocated_bytes = 0;
+static thread_local size_t live_bytes = 0;
+static thread_local size_t peak_live_bytes = 0;
+
+void* operator new(size_t size) {
+  void* ptr = malloc(size ? size : 1);
+
+  if (!ptr) {
+    throw std::bad_alloc();
+  }
+
+  allocations++;
+  allocated_bytes += size;
+  live_bytes += malloc_usable_size(ptr);
+  peak_live_bytes = std::max(peak_live_bytes, live_bytes);
+  return ptr;
+}
+
+// Not inlined, so that GCC doesn't mistake the free() for a mismatched deallocation of memory from operator new.
+[[gnu::noinline]] void operator delete(void* ptr) noexcept {
+  if (ptr) {
+    live_bytes -= std::min(live_bytes, malloc_usable_size(ptr));
+    free(ptr);
+  }
+}
+
+[[gnu::noinline]] void operator delete(void* ptr, size_t) noexcept {
+  operator delete(ptr);
+}
+
+struct Document {
+  std::string name;     // The file name, or the line number for NDJSON input.
+  std::string id;       // The raw JSON of the "id" of an NDJSON document, if it had one.
+  std::string_view dtext;
+  std::string storage;  // The text of a document that isn't mmapped.
+  std::string error;    // Why the document couldn't be read.
+};
+
+struct Config {
+  DTextOptions options;
+  unsigned int threads = 1;
+  bool ndjson = false;
+  bool metadata = false;
+  bool bench = false;
+  bool json = false;
+  bool profile = false;
+  size_t passes = 0;
+  double bench_time = 1;
+  unsigned int bench_threads = 1;
+};
+
+[[noreturn]] static void die(const std::string& message) {
+  fprintf(stderr, "cdtext: %s\n", message.c_str());
+  exit(2);
+}
+
+static size_t parse_number(const std::string_view option, const std::string_view value) {
+  size_t n = 0;
+  auto [end, error] = std::from_chars(value.data(), value.data() + value.size(), n);
+
+  if (error != std::errc() || end != value.data() + value.size()) {
+    die("invalid number for " + std::string(option) + ": " + std::string(value));
+  }
+
+  return n;
+}
+
+static Config parse_args(int argc, char** argv, std::vector<std::string>& files) {
+  Config config;
+  config.options.f_allow_color = false;
+
+  for (int i = 1; i < argc; i++) {
+    std::string_view arg = argv[i];
+    std::string_view name = arg.substr(0, arg.find('='));
+    std::string_view value = arg.find('=') == std::string_view::npos ? "" : arg.substr(arg.find('=') + 1);
+
+    if (arg == "-h" || arg == "--help") {
+      fputs(USAGE, stdout);
+      exit(0);
+    } else if (arg == "--ndjson") {
+      config.ndjson = true;
+    } else if (arg == "--metadata") {
+      config.metadata = true;
+    } else if (name == "--bench") {
+      config.bench = true;
+      config.passes = value.empty() ? 0 : parse_number(name, value);
+    } else if (name == "--bench-time") {
+      config.bench_time = strtod(std::string(value).c_str(), nullptr);
+    } else if (name == "--bench-threads") {
+      config.bench_threads = std::max<size_t>(parse_number(name, value), 1);
+    } else if (arg == "--json") {
+      config.json = true;
+    } else if (arg == "--profile") {
+#ifndef DTEXT_PROFILE
+      die("--profile needs a build with DTEXT_PROFILE=1");
+#endif
+      config.profile = true;
+    } else if (arg == "--inline") {
+      config.options.f_inline = true;
+    } else if (arg == "--allow-color") {
+      config.options.f_allow_color = true;
+    } else if (arg == "--qtags") {
+      config.options.f_qtags = true;
+    } else if (name == "--base-url") {
+      config.options.base_url = value;
+    } else if (name == "--domain") {
+      config.options.domain = value;
+    } else if (name == "--internal-domain") {
+      config.options.internal_domains.insert(std::string(value));
+    } else if (name == "--max-output-bytes") {
+      config.options.max_output_bytes = parse_number(name, value);
+    } else if (name == "--max-dstack-depth") {
+      config.options.max_dstack_depth = parse_number(name, value);
+    } else if (name == "--timeout") {
+      config.options.timeout = std::chrono::microseconds(static_cast<long>(strtod(std::string(value).c_str(), nullptr) * 1'000'000));
+    } else if (name == "--max-visible-chars") {
+      config.options.max_visible_chars = parse_number(name, value);
+    } else if (name == "--threads") {
+      config.threads = std::max<size_t>(parse_number(name, value), 1);
+    } else if (arg.starts_with("-") && arg != "-") {
+      die("unknown option: " + std::string(arg) + " (see --help)");
+    } else {
+      files.push_back(std::string(arg));
+    }
+  }
+
+  return config;
+}
+
+static void append_utf8(std::string& out, uint32_t codepoint) {
+  if (codepoint < 0x80) {
+    out += static_cast<char>(codepoint);
+  } else if (codepoint < 0x800) {
+    out += static_cast<char>(0xC0 | (codepoint >> 6));
+    out += static_cast<char>(0x80 | (codepoint & 0x3F));
+  } else if (codepoint < 0x10000) {
+    out += static_cast<char>(0xE0 | (codepoint >> 12));
+    out += static_cast<char>(0x80 | ((codepoint >> 6) & 0x3F));
+    out += static_cast<char>(0x80 | (codepoint & 0x3F));
+  } else {
+    out += static_cast<char>(0xF0 | (codepoint >> 18));
+    out += static_cast<char>(0x80 | ((codepoint >> 12) & 0x3F));
+    out += static_cast<char>(0x80 | ((codepoint >> 6) & 0x3F));
+    out += static_cast<char>(0x80 | (codepoint & 0x3F));
+  }
+}
+
+// A minimal JSON reader for NDJSON input. It only decodes strings; other values are skipped and returned as raw JSON.
+struct JSONReader {
+  std::string_view json;
+  size_t pos = 0;
+
+  void skip_space() {
+    while (pos < json.size() && strchr(" \t\r\n", json[pos])) {
+      pos++;
+    }
+  }
+
+  void expect(char c) {
+    skip_space();
+
+    if (pos >= json.size() || json[pos] != c) {
+      throw DTextError(std::string("invalid JSON: expected '") + c + "'");
+    }
+
+    pos++;
+  }
+
+  bool peek(char c) {
+    skip_space();
+    return pos < json.size() && json[pos] == c;
+  }
+
+  unsigned int hex4() {
+    if (pos + 4 > json.size()) {
+      throw DTextError("invalid JSON: bad \\u escape");
+    }
+
+    unsigned int n = 0;
+    auto [end, error] = std::from_chars(json.data() + pos, json.data() + pos + 4, n, 16);
+    if (error != std::errc() || end != json.data() + pos + 4) {
+      throw DTextError("invalid JSON: bad \\u escape");
+    }
+
+    pos += 4;
+    return n;
+  }
+
+  std::string string() {
+    expect('"');
+    std::string out;
+
+    while (pos < json.size() && json[pos] != '"') {
+      char c = json[pos++];
+
+      if (c != '\\') {
+        out += c;
+        continue;
+      } else if (pos >= json.size()) {
+        break;
+      }
+
+      switch (char e = json[pos++]) {
+        case 'n': out += '\n'; break;
+        case 't': out += '\t'; break;
+        case 'r': out += '\r'; break;
+        case 'b': out += '\b'; break;
+        case 'f': out += '\f'; break;
+        case 'u': {
+          uint32_t codepoint = hex4();
+
+          if (codepoint >= 0xD800 && codepoint <= 0xDBFF && json.substr(pos, 2) == "\\u") {
+            pos += 2;
+            uint32_t low = hex4();
+            codepoint = 0x10000 + ((codepoint - 0xD800) << 10) + (low - 0xDC00);
+          }
+
+          append_utf8(out, codepoint);
+          break;
+        }
+        default: out += e; break;
+      }
+    }
+
+    expect('"');
+    return out;
+  }
+
+  // Skip any value and return its raw JSON.
+  std::string_view value() {
+    skip_space();
+    size_t start = pos;
+
+    if (peek('"')) {
+      string();
+    } else if (peek('{') || peek('[')) {
+      char close = json[pos] == '{' ? '}' : ']';
+      pos++;
+
+      while (!peek(close)) {
+        if (close == '}') {
+          string();
+          expect(':');
+        }
+
+        value();
+
+        if (!peek(close)) {
+          expect(',');
+        }
+      }
+
+      pos++;
+    } else {
+      while (pos < json.size() && !strchr(",}] \t\r\n", json[pos])) {
+        pos++;
+      }
+    }
+
+    if (pos == start) {
+      throw DTextError("invalid JSON: expected a value");
+    }
+
+    return json.substr(start, pos - start);
+  }
+};
+
+// Read an NDJSON line: either a JSON string, or an object with a "dtext" string and an optional "id".
+static void parse_ndjson_line(const std::string_view line, Document& doc) {
+  JSONReader reader = { line };
+
+  if (reader.peek('"')) {
+    doc.storage = reader.string();
+  } else {
+    bool found = false;
+    reader.expect('{');
+
+    while (!reader.peek('}')) {
+      std::string key = reader.string();
+      reader.expect(':');
+
+      if (key == "dtext") {
+        doc.storage = reader.string();
+        found = true;
+      } else if (key == "id") {
+        doc.id = reader.value();
+      } else {
+        reader.value();
+      }
+
+      if (!reader.peek('}')) {
+        reader.expect(',');
+      }
+    }
+
+    reader.expect('}');
+
+    if (!found) {
+      throw DTextError("missing \"dtext\" key");
+    }
+  }
+}
+
+static void append_json_string(std::string& out, const std::string_view string) {
+  out += '"';
+
+  for (unsigned char c : string) {
+    switch (c) {
+      case '"': out += "\\\""; break;
+      case '\\': out += "\\\\"; break;
+      case '\n': out += "\\n"; break;
+      case '\r': out += "\\r"; break;
+      case '\t': out += "\\t"; break;
+      default:
+        if (c < 0x20) {
+          char escape[8];
+          snprintf(escape, sizeof(escape), "\\u%04x", c);
+          out += escape;
+        } else {
+          out += c;
+        }
+    }
+  }
+
+  out += '"';
+}
+
+template <typename Strings>
+static void append_json_array(std::string& out, const Strings& strings) {
+  out += '[';
+
+  for (auto& string : strings) {
+    if (out.back() != '[') {
+      out += ',';
+    }
+
+    append_json_string(out, string);
+  }
+
+  out += ']';
+}
+
+// Map a file into memory. The mapping is never unmapped; the process exits once the documents have been rendered.
+static void read_file(const std::string& path, Document& doc) {
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  struct stat st;
+
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    doc.error = strerror(errno);
+  } else if (st.st_size > 0) {
+    void* addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    if (addr == MAP_FAILED) {
+      doc.error = strerror(errno);
+    } else {
+      madvise(addr, st.st_size, MADV_SEQUENTIAL);
+      doc.dtext = std::string_view(static_cast<const char*>(addr), st.st_size);
+    }
+  }
+
+  if (fd >= 0) {
+    close(fd);
+  }
+}
+
+static std::vector<Document> read_documents(const Config& config, const std::vector<std::string>& files) {
+  std::vector<Document> documents;
+
+  if (config.ndjson) {
+    std::string line;
+
+    for (size_t lineno = 1; std::getline(std::cin, line); lineno++) {
+      if (line.find_first_not_of(" \t\r") == std::string::npos) {
+        continue;
+      }
+
+      Document& doc = documents.emplace_back();
+      doc.name = "line " + std::to_string(lineno);
+
+      try {
+        parse_ndjson_line(line, doc);
+      } catch (DTextError& e) {
+        doc.error = e.what();
+      }
+    }
+
+    // Not set until all the documents have been read, since the strings move as the vector grows.
+    for (auto& doc : documents) {
+      doc.dtext = doc.storage;
+    }
+  } else if (files.empty() || (files.size() == 1 && files[0] == "-")) {
+    Document& doc = documents.emplace_back();
+    doc.name = "-";
+    doc.storage.assign(std::istreambuf_iterator<char>(std::cin), std::istreambuf_iterator<char>());
+    doc.dtext = doc.storage;
+  } else {
+    for (auto& file : files) {
+      Document& doc = documents.emplace_back();
+      doc.name = file;
+      read_file(file, doc);
+    }
+  }
+
+  for (auto& doc : documents) {
+    if (doc.error.empty()) {
+      const char* reason = dtext_validate(doc.dtext.data(), doc.dtext.size());
+      doc.error = reason ? reason : "";
+    }
+  }
+
+  return documents;
+}
+
+static StateMachine::ParseResult parse(const Document& doc, const Config& config) {
+  if (config.threads > 1) {
+    return StateMachine::parse_parallel(doc.dtext, config.options, config.threads);
+  } else {
+    return StateMachine::parse_dtext(doc.dtext, config.options);
+  }
+}
+
+static std::string metadata_json(const StateMachine::ParseResult& result, bool include_html) {
+  auto& [html, creators, posts, qtags, truncated] = result;
+  std::vector<std::string_view> sorted_creators(creators.begin(), creators.end());
+  std::sort(sorted_creators.begin(), sorted_creators.end());
+
+  std::string json;
+  if (include_html) {
+    json += "\"html\":";
+    append_json_string(json, html);
+    json += ',';
+  }
+
+  json += "\"creators\":";
+  append_json_array(json, sorted_creators);
+  json += ",\"post_ids\":[";
+
+  for (size_t i = 0; i < posts.size(); i++) {
+    json += (i ? "," : "") + std::to_string(posts[i]);
+  }
+
+  json += "],\"qtags\":";
+  append_json_array(json, qtags);
+  json += truncated ? ",\"truncated\":true" : ",\"truncated\":false";
+  return json;
+}
+
+// Render every document and write the output. Returns the exit status.
+static int render(const std::vector<Document>& documents, const Config& config) {
+  int status = 0;
+
+  for (auto& doc : documents) {
+    std::string out, error = doc.error;
+    StateMachine::ParseResult result;
+
+    if (error.empty()) {
+      try {
+        result = parse(doc, config);
+      } catch (std::exception& e) {
+        error = e.what();
+      }
+    }
+
+    if (config.ndjson) {
+      out = "{";
+
+      if (!doc.id.empty()) {
+        out += "\"id\":" + doc.id + ",";
+      }
+
+      if (error.empty()) {
+        out += metadata_json(result, !config.metadata);
+      } else {
+        out += "\"error\":";
+        append_json_string(out, error);
+      }
+
+      out += "}\n";
+    } else if (!error.empty()) {
+      fprintf(stderr, "cdtext: %s: %s\n", doc.name.c_str(), error.c_str());
+    } else if (config.metadata) {
+      out = "{\"file\":";
+      append_json_string(out, doc.name);
+      out += "," + metadata_json(result, false) + "}\n";
+    } else {
+      out = std::get<0>(result) + "\n";
+    }
+
+    status |= !error.empty();
+    fwrite(out.data(), 1, out.size(), stdout);
+  }
+
+  return status;
+}
+
+// The measurements of one benchmark thread.
+struct BenchResult {
+  std::vector<double> latencies; // In microseconds.
+  size_t passes = 0;
+  size_t errors = 0;
+  size_t allocations = 0;
+  size_t allocated_bytes = 0;
+  size_t peak_bytes = 0; // The most memory that one parse had allocated at once.
+};
+
+// Parse every document over and over, until the given number of passes or until the time is up.
+static void bench_thread(const std::vector<const Document*>& documents, const Config& config, BenchResult& result) {
+  using clock = std::chrono::steady_clock;
+  auto start = clock::now();
+  auto bench_time = std::chrono::duration<double>(config.bench_time);
+
+  while (config.passes ? result.passes < config.passes : (result.passes == 0 || clock::now() - start < bench_time)) {
+    for (auto doc : documents) {
+      size_t before_allocations = allocations, before_allocated_bytes = allocated_bytes, before_live_bytes = live_bytes;
+      peak_live_bytes = live_bytes;
+      auto before = clock::now();
+
+      try {
+        parse(*doc, config);
+      } catch (std::exception&) {
+        result.errors++;
+      }
+
+      auto after = clock::now();
+      result.allocations += allocations - before_allocations;
+      result.allocated_bytes += allocated_bytes - before_allocated_bytes;
+      result.peak_bytes = std::max(result.peak_bytes, peak_live_bytes - before_live_bytes);
+      result.latencies.push_back(std::chrono::duration<double, std::micro>(after - before).count());
+    }
+
+    result.passes++;
+  }
+}
+
+// Parse every document over and over (on each of --bench-threads threads), and report the throughput, latency and
+// allocations.
+static int bench(const std::vector<Document>& documents, const Config& config) {
+  std::vector<const Document*> valid;
+  size_t bytes = 0;
+
+  for (auto& doc : documents) {
+    if (!doc.error.empty()) {
+      fprintf(stderr, "cdtext: %s: %s (skipped)\n", doc.name.c_str(), doc.error.c_str());
+    } else {
+      valid.push_back(&doc);
+      bytes += doc.dtext.size();
+    }
+  }
+
+  if (valid.empty()) {
+    die("no documents to benchmark");
+  }
+
+  std::vector<BenchResult> results(config.bench_threads);
+  std::vector<std::thread> threads;
+  auto start = std::chrono::steady_clock::now();
+
+  for (auto& result : results) {
+    threads.emplace_back(bench_thread, std::cref(valid), std::cref(config), std::ref(result));
+  }
+
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  std::vector<double> latencies;
+  size_t passes = 0, errors = 0, parse_allocations = 0, parse_allocated_bytes = 0, peak_bytes = 0;
+
+  for (auto& result : results) {
+    peak_bytes = std::max(peak_bytes, result.peak_bytes);
+    latencies.insert(latencies.end(), result.latencies.begin(), result.latencies.end());
+    passes += result.passes;
+    errors += result.errors;
+    parse_allocations += result.allocations;
+    parse_allocated_bytes += result.allocated_bytes;
+  }
+
+  size_t parses = latencies.size();
+  std::sort(latencies.begin(), latencies.end());
+
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  size_t max_rss = usage.ru_maxrss * 1024; // ru_maxrss is in KB.
+
+  auto percentile = [&](double p) { return latencies[std::min(parses - 1, static_cast<size_t>(p * parses))]; };
+
+  if (config.json) {
+    double median_latency = percentile(0.5);
+    std::vector<double> deviations;
+
+    for (double latency : latencies) {
+      deviations.push_back(std::abs(latency - median_latency));
+    }
+
+    std::nth_element(deviations.begin(), deviations.begin() + parses / 2, deviations.end());
+
+    printf("{\"documents\":%zu,\"bytes\":%zu,\"threads\":%u,\"passes\":%zu,\"errors\":%zu,\"samples\":%zu,\"elapsed\":%.9g,\"throughput\":%.9g,\"median\":%.9g,\"mad\":%.9g,\"p99\":%.9g,\"allocations\":%.1f,\"allocated_bytes\":%.1f,\"peak_bytes\":%zu,\"max_rss\":%zu}\n",
+      valid.size(), bytes, config.bench_threads, passes, errors, parses, elapsed, bytes * passes / elapsed, median_latency / 1e6, deviations[parses / 2] / 1e6,
+      percentile(0.99) / 1e6, static_cast<double>(parse_allocations) / parses, static_cast<double>(parse_allocated_bytes) / parses, peak_bytes, max_rss);
+    return 0;
+  }
+
+  printf("documents:    %zu (%.1f KB), %u threads, %zu passes, %zu errors\n", valid.size(), bytes / 1e3, config.bench_threads, passes, errors);
+  printf("throughput:   %.2f MB/s, %.0f documents/s\n", bytes * passes / elapsed / 1e6, parses / elapsed);
+  printf("latency (us): p50 %.1f, p90 %.1f, p99 %.1f, p99.9 %.1f, max %.1f\n", percentile(0.5), percentile(0.9), percentile(0.99), percentile(0.999), latencies.back());
+  printf("allocations:  %.1f per document, %.1f KB per document\n", static_cast<double>(parse_allocations) / parses, parse_allocated_bytes / 1e3 / parses);
+  printf("memory:       %.1f KB peak heap per document, %.1f MB max RSS\n", peak_bytes / 1e3, max_rss / 1e6);
+  return 0;
+}
+
+#ifdef DTEXT_PROFILE
+// Print the scanner rules that were hit, the most expensive first.
+static void print_profile() {
+  auto rules = ScannerProfile::snapshot();
+  uint64_t hits = 0, bytes = 0, cycles = 0;
+
+  for (auto& rule : rules) {
+    hits += rule.hits;
+    bytes += rule.bytes;
+    cycles += rule.cycles;
+  }
+
+  std::sort(rules.begin(), rules.end(), [](auto& a, auto& b) { return std::tie(a.cycles, a.hits) > std::tie(b.cycles, b.hits); });
+  fprintf(stderr, "%12s %6s %12s %6s %14s %6s  %s\n", "hits", "", "bytes", "", "cycles", "", "rule");
+
+  for (auto& rule : rules) {
+    fprintf(stderr, "%12" PRIu64 " %5.1f%% %12" PRIu64 " %5.1f%% %14" PRIu64 " %5.1f%%  %s\n", rule.hits, 100.0 * rule.hits / hits, rule.bytes,
+      100.0 * rule.bytes / std::max<uint64_t>(bytes, 1), rule.cycles, 100.0 * rule.cycles / std::max<uint64_t>(cycles, 1), rule.name.c_str());
+  }
+}
+#endif
+
+int main(int argc, char** argv) {
+  std::vector<std::string> files;
+  Config config = parse_args(argc, argv, files);
+  std::vector<Document> documents = read_documents(config, files);
+  int status = config.bench ? bench(documents, config) : render(documents, config);
+
+#ifdef DTEXT_PROFILE
+  if (config.profile) {
+    print_profile();
+  }
+#endif
+
+  return status;
+}
@@ -1,10 +1,26 @@
 #include "dtext.h"
+#include "probes.h"
 #include "url.h"
 
 #include <algorithm>
+#include <bit>
+#include <cerrno>
+#include <charconv>
+#include <cmath>
+#include <cstring>
+#include <fcntl.h>
+#include <iterator>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <unordered_map>
 #include <unordered_set>
 #include <regex>
+#include <thread>
+
+#if defined(DTEXT_PROFILE_CYCLES) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#endif
 
 #ifdef DEBUG
 #undef g_debug
@@ -16,7 +32,17 @@
 #define g_debug(...)
 #endif
 
+#ifdef DTEXT_PROFILE
+#define g_profile(name) static const size_t profile_rule = ScannerProfile::rule(name); ScannerProfile::Hit profile_hit(profile_rule, te - ts)
+#define g_profile_start() ScannerProfile::start()
+#else
+#define g_profile(name)
+#define g_profile_start()
+#endif
+
 static const size_t MAX_STACK_DEPTH = 512;
+static const size_t SCAN_WINDOW_BYTES = 4096; // How much input parse() scans between reads of the clock.
+static const size_t BLOCK_SYNC_BYTES = 64; // How far into a block sync_block_start() feeds the parser.
 
 // Strip qualifier from tag: "Artoria Pendragon (Lancer) (Fate)" -> "Artoria Pendragon (Lancer)"
 static const std::regex tag_qualifier_regex("[ _]\\([^)]+?\\)$");
@@ -42,6 +68,136 @@ static const std::unordered_map<std::string_view, std::function<bool(std::string
 };
 
 static unsigned char ascii_tolower(unsigned char c);
+static void html_escape(const std::string_view string, std::string& output);
+
+#ifdef DTEXT_PROFILE
+#ifndef DTEXT_PROFILE_CYCLES
+static uint64_t profile_clock() { return 0; }
+#elif defined(__x86_64__) || defined(__i386__)
+static uint64_t profile_clock() { return __rdtsc(); }
+#else
+static uint64_t profile_clock() { return std::chrono::steady_clock::now().time_since_epoch().count(); }
+#endif
+
+// One thread's counters. Only the thread itself adds to them, so they're updated without atomic read-modify-writes
+// (which would cost as much as the rules being measured); snapshot() and reset() read and clear them from other threads.
+struct ProfileCounters {
+  std::array<std::atomic<uint64_t>, ScannerProfile::MAX_RULES> hits = {}, bytes = {}, cycles = {};
+  uint64_t last = 0; // The clock at the end of the last action.
+
+  ProfileCounters();
+  ~ProfileCounters();
+};
+
+// The rule names, the counters of every live thread and the totals of the threads that have exited. It's never
+// destroyed, since threads can exit after static destructors have run.
+struct ProfileRegistry {
+  std::mutex mutex;
+  std::vector<std::string> rules;
+  std::vector<ProfileCounters*> threads;
+  std::array<uint64_t, ScannerProfile::MAX_RULES> hits = {}, bytes = {}, cycles = {};
+};
+
+static ProfileRegistry& profile_registry() {
+  static auto* registry = new ProfileRegistry;
+  return *registry;
+}
+
+static thread_local ProfileCounters profile_counters;
+
+static void profile_add(std::atomic<uint64_t>& counter, uint64_t n) {
+  counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+ProfileCounters::ProfileCounters() {
+  auto& registry = profile_registry();
+  std::lock_guard lock(registry.mutex);
+  registry.threads.push_back(this);
+}
+
+ProfileCounters::~ProfileCounters() {
+  auto& registry = profile_registry();
+  std::lock_guard lock(registry.mutex);
+
+  for (size_t i = 0; i < ScannerProfile::MAX_RULES; i++) {
+    registry.hits[i] += hits[i];
+    registry.bytes[i] += bytes[i];
+    registry.cycles[i] += cycles[i];
+  }
+
+  std::erase(registry.threads, this);
+}
+
+ScannerProfile::Hit::Hit(size_t rule, size_t bytes) : rule(rule) {
+  profile_add(profile_counters.hits[rule], 1);
+  profile_add(profile_counters.bytes[rule], bytes);
+}
+
+ScannerProfile::Hit::~Hit() {
+#ifdef DTEXT_PROFILE_CYCLES
+  uint64_t now = profile_clock();
+  profile_add(profile_counters.cycles[rule], now - profile_counters.last);
+  profile_counters.last = now;
+#endif
+}
+
+size_t ScannerProfile::rule(std::string_view name) {
+  auto& registry = profile_registry();
+  std::lock_guard lock(registry.mutex);
+
+  // The same action is generated more than once (once per state it's reached from), so it's registered once per copy.
+  auto it = std::find(registry.rules.begin(), registry.rules.end(), name);
+  if (it != registry.rules.end()) {
+    return it - registry.rules.begin();
+  }
+
+  // There are only about 130 rules, so this can't overflow unless MAX_RULES is lowered.
+  registry.rules.emplace_back(name);
+  return std::min(registry.rules.size() - 1, MAX_RULES - 1);
+}
+
+void ScannerProfile::start() {
+  profile_counters.last = profile_clock();
+}
+
+std::vector<ScannerProfile::Rule> ScannerProfile::snapshot() {
+  auto& registry = profile_registry();
+  std::lock_guard lock(registry.mutex);
+  std::vector<Rule> rules;
+
+  for (size_t i = 0; i < registry.rules.size(); i++) {
+    Rule rule = { registry.rules[i], registry.hits[i], registry.bytes[i], registry.cycles[i] };
+
+    for (auto* thread : registry.threads) {
+      rule.hits += thread->hits[i].load(std::memory_order_relaxed);
+      rule.bytes += thread->bytes[i].load(std::memory_order_relaxed);
+      rule.cycles += thread->cycles[i].load(std::memory_order_relaxed);
+    }
+
+    if (rule.hits > 0) {
+      rules.push_back(std::move(rule));
+    }
+  }
+
+  return rules;
+}
+
+void ScannerProfile::reset() {
+  auto& registry = profile_registry();
+  std::lock_guard lock(registry.mutex);
+  registry.hits = {};
+  registry.bytes = {};
+  registry.cycles = {};
+
+  for (auto* thread : registry.threads) {
+    for (size_t i = 0; i < MAX_RULES; i++) {
+      thread->hits[i].store(0, std::memory_order_relaxed);
+      thread->bytes[i].store(0, std::memory_order_relaxed);
+      thread->cycles[i].store(0, std::memory_order_relaxed);
+    }
+  }
+}
+#endif
 
 %%{
 machine dtext;
@@ -161,7 +317,7 @@ qtag_char = nonspace - (punct - [._/'\-+!]);
 bare_qtag_tag = (qtag_nonboundary_char qtag_char* qtag_nonboundary_char) - (char '#') - (char* '\'' [sd]);
 
 bare_qtag = ('#' when after_qtag_boundary) (bare_qtag_tag >mark_a1 @mark_a2);
-delimited_qtag = '<#' (nonspace nonnewline*) >mark_a1 %mark_a2 :>> '>';
+delimited_qtag = '<#' ((nonspace nonnewline*) -- '<#') >mark_a1 %mark_a2 :>> '>';
 
 # The list of tags that can appear in brackets (e.g. [quote]).
 bracket_tags = (
@@ -187,19 +343,21 @@ bare_relative_url = (path query? fragment? | fragment) - (char* url_boundary_cha
 delimited_absolute_url = http nonspace+;
 delimited_relative_url = [/#] nonspace*;
 
-delimited_url = '<' delimited_absolute_url >mark_a1 %mark_a2 :>> '>';
+# The body of a link can't contain the link's own opening delimiter, so an unclosed link ends at the next link instead of
+# being rescanned to the end of the line from every opening delimiter.
+delimited_url = '<' (delimited_absolute_url -- '<') >mark_a1 %mark_a2 :>> '>';
 basic_textile_link = '"' ^'"'+ >mark_a1 %mark_a2 '"' ':' (bare_absolute_url | bare_relative_url) >mark_b1 @mark_b2;
-bracketed_textile_link = '"' ^'"'+ >mark_a1 %mark_a2 '"' ':[' (delimited_absolute_url | delimited_relative_url) >mark_b1 %mark_b2 :>> ']';
+bracketed_textile_link = '"' ^'"'+ >mark_a1 %mark_a2 '"' ':[' ((delimited_absolute_url | delimited_relative_url) -- '"') >mark_b1 %mark_b2 :>> ']';
 
-backwards_markdown_link = '[' (delimited_absolute_url | ((delimited_relative_url -- ']') - '/' bracket_tags)) >mark_a1 %mark_a2 :>> '](' nonnewline+ >mark_b1 %mark_b2 :>> ')';
-markdown_link = (('[' nonnewline+ >mark_f1 %mark_f2 :>> ']') - ('[' '/'? bracket_tags ']')) '(' (delimited_absolute_url | delimited_relative_url) >mark_g1 %mark_g2 :>> ')';
-html_link = '<a'i ws+ 'href="'i (delimited_absolute_url | delimited_relative_url) >mark_a1 %mark_a2 :>> '">' nonnewline+ >mark_b1 %mark_b2 :>> '</a>'i;
+backwards_markdown_link = '[' ((delimited_absolute_url | ((delimited_relative_url -- ']') - '/' bracket_tags)) -- '[') >mark_a1 %mark_a2 :>> '](' (nonnewline+ -- '](') >mark_b1 %mark_b2 :>> ')';
+markdown_link = (('[' (nonnewline - '[')+ >mark_f1 %mark_f2 :>> ']') - ('[' '/'? bracket_tags ']')) '(' ((delimited_absolute_url | delimited_relative_url) -- '](') >mark_g1 %mark_g2 :>> ')';
+html_link = '<a'i ws+ 'href="'i (delimited_absolute_url | delimited_relative_url) >mark_a1 %mark_a2 :>> '">' (nonnewline+ -- ('<a'i ws)) >mark_b1 %mark_b2 :>> '</a>'i;
 
-unquoted_bbcode_url = delimited_absolute_url | delimited_relative_url;
+unquoted_bbcode_url = (delimited_absolute_url | delimited_relative_url) -- '[url'i;
 double_quoted_bbcode_url = '"' unquoted_bbcode_url >mark_b1 %mark_b2 :>> '"';
 single_quoted_bbcode_url = "'" unquoted_bbcode_url >mark_b1 %mark_b2 :>> "'";
 bbcode_url = double_quoted_bbcode_url | single_quoted_bbcode_url | unquoted_bbcode_url >mark_b1 %mark_b2;
-bbcode_title = nonnewline+ - (ws any* | any* ws);
+bbcode_title = (nonnewline+ -- '[url'i) - (ws any* | any* ws);
 named_bbcode_link   = '[url'i ws* '=' ws* (bbcode_url :>> ws* ']') ws* (bbcode_title >mark_a1 %mark_a2 ws* :>> '[/url]'i);
 unnamed_bbcode_link = '[url]'i ws* unquoted_bbcode_url >mark_a1 %mark_a2 ws* :>> '[/url]'i;
 
@@ -209,9 +367,9 @@ internal_anchor = '[#' internal_anchor_target ']';
 emoticon_tags = '|' alnum | ':|' | '|_|' | '||_||' | '\\||/' | '<|>_<|>' | '>:|' | '>|3' | '|w|' | ':{' | ':}';
 creator_prefix = alnum* >mark_a1 %mark_a2;
 creator_suffix = alnum* >mark_e1 %mark_e2;
-creator_target = (nonpipebracket* (nonpipebracket - space) | emoticon_tags) >mark_b1 %mark_b2;
+creator_target = ((nonpipebracket* (nonpipebracket - space)) -- '[[' | emoticon_tags) >mark_b1 %mark_b2;
 creator_anchor_id = (alnum ([ _\-]* alnum+)*) >mark_c1 %mark_c2;
-creator_title = (ws* (nonpipebracket - space)+)* >mark_d1 %mark_d2;
+creator_title = ((ws* (nonpipebracket - space)+)* -- '[[') >mark_d1 %mark_d2;
 
 basic_internal_anchor_link = creator_prefix '[[' '#' internal_anchor_target ']]' creator_suffix;
 aliased_internal_anchor_link = creator_prefix '[[' '#' internal_anchor_target '|' ws* creator_title ws* ']]' creator_suffix;
@@ -220,7 +378,7 @@ aliased_creator_link = creator_prefix '[[' ws* creator_target ws* :>> ('#' creat
 
 tag = (nonspace - [|{}])+ | ([~\-]? emoticon_tags);
 tags = (tag (ws+ tag)*) >mark_b1 %mark_b2;
-search_title = ((nonnewline* nonspace) -- '}')? >mark_c1 %mark_c2;
+search_title = ((nonnewline* nonspace) -- ('}' | '{{'))? >mark_c1 %mark_c2;
 search_prefix = alnum* >mark_a1 %mark_a2;
 search_suffix = alnum* >mark_d1 %mark_d2;
 
@@ -236,10 +394,10 @@ dmail_key = (alnum | '=' | '-')+ >mark_b1 %mark_b2;
 header_id = (alnum | [_/#!:&\-])+; # XXX '/', '#', '!', ':', and '&' are grandfathered in for old wiki versions.
 header = 'h'i [123456] >mark_a1 %mark_a2 '.' >mark_b1 >mark_b2 ws*;
 header_with_id = 'h'i [123456] >mark_a1 %mark_a2 '#' header_id >mark_b1 %mark_b2 '.' ws*;
-open_aliased_section = ('[section'i (ws* '=' ws* | ws+) ((nonnewline - ']')* >mark_a1 %mark_a2) ']')
-               | ('<section'i (ws* '=' ws* | ws+) ((nonnewline - '>')* >mark_a1 %mark_a2) '>');
-open_aliased_section_expanded = ('[section,expanded'i (ws* '=' ws* | ws+) ((nonnewline - ']')* >mark_a1 %mark_a2) ']')
-               | ('<section,expanded'i (ws* '=' ws* | ws+) ((nonnewline - '>')* >mark_a1 %mark_a2) '>');
+open_aliased_section = ('[section'i (ws* '=' ws* | ws+) (((nonnewline - ']')* -- '[section'i) >mark_a1 %mark_a2) ']')
+               | ('<section'i (ws* '=' ws* | ws+) (((nonnewline - '>')* -- '<section'i) >mark_a1 %mark_a2) '>');
+open_aliased_section_expanded = ('[section,expanded'i (ws* '=' ws* | ws+) (((nonnewline - ']')* -- '[section'i) >mark_a1 %mark_a2) ']')
+               | ('<section,expanded'i (ws* '=' ws* | ws+) (((nonnewline - '>')* -- '<section'i) >mark_a1 %mark_a2) '>');
 
 list_item = '*'+ >mark_e1 %mark_e2 ws+ nonnewline+ >mark_f1 %mark_f2;
 
@@ -301,137 +459,147 @@ close_sub = '[/sub]'i | '</sub>'i;
 close_color = '[/color]'i;
 
 basic_inline := |*
-  open_b    => { dstack_open_element(INLINE_B, "<strong>"); };
-  close_b   => { dstack_close_element(INLINE_B, { ts, te }); };
-  open_i    => { dstack_open_element(INLINE_I, "<em>"); };
-  close_i   => { dstack_close_element(INLINE_I, { ts, te }); };
-  open_s    => { dstack_open_element(INLINE_S, "<s>"); };
-  close_s   => { dstack_close_element(INLINE_S, { ts, te }); };
-  open_u    => { dstack_open_element(INLINE_U, "<u>"); };
-  close_u   => { dstack_close_element(INLINE_U, { ts, te }); };
-  open_sup  => { dstack_open_element(INLINE_SUP, "<sup>"); };
-  close_sup => { dstack_close_element(INLINE_SUP, { ts, te }); };
-  open_sub  => { dstack_open_element(INLINE_SUB, "<sub>"); };
-  close_sub => { dstack_close_element(INLINE_SUB, { ts, te }); };
+  open_b    => { g_profile("basic_inline open_b"); dstack_open_element(INLINE_B, "<strong>"); };
+  close_b   => { g_profile("basic_inline close_b"); dstack_close_element(INLINE_B, { ts, te }); };
+  open_i    => { g_profile("basic_inline open_i"); dstack_open_element(INLINE_I, "<em>"); };
+  close_i   => { g_profile("basic_inline close_i"); dstack_close_element(INLINE_I, { ts, te }); };
+  open_s    => { g_profile("basic_inline open_s"); dstack_open_element(INLINE_S, "<s>"); };
+  close_s   => { g_profile("basic_inline close_s"); dstack_close_element(INLINE_S, { ts, te }); };
+  open_u    => { g_profile("basic_inline open_u"); dstack_open_element(INLINE_U, "<u>"); };
+  close_u   => { g_profile("basic_inline close_u"); dstack_close_element(INLINE_U, { ts, te }); };
+  open_sup  => { g_profile("basic_inline open_sup"); dstack_open_element(INLINE_SUP, "<sup>"); };
+  close_sup => { g_profile("basic_inline close_sup"); dstack_close_element(INLINE_SUP, { ts, te }); };
+  open_sub  => { g_profile("basic_inline open_sub"); dstack_open_element(INLINE_SUB, "<sub>"); };
+  close_sub => { g_profile("basic_inline close_sub"); dstack_close_element(INLINE_SUB, { ts, te }); };
   eos;
-  any => { append_html_escaped(fc); };
+  any => { g_profile("basic_inline any"); append_text(fc); };
 *|;
 
 inline := |*
   '\\`' => {
-    append("`");
+    g_profile("inline '\\\\`'");
+    append_text('`');
   };
 
   '`' => {
+    g_profile("inline '`'");
     append("<span class=\"inline-code\">");
+    in_inline_code = true;
     fcall inline_code;
   };
 
   'thumb #'i id => {
-    long post_id = strtol(a1, (char**)&a2, 10);
-    posts.push_back(post_id);
-    append("<a class=\"dtext-link dtext-id-link dtext-post-id-link thumb-placeholder-link\" data-id=\"");
-    append_html_escaped({ a1, a2 });
-    append("\" href=\"");
-    append_relative_url("/posts/");
-    append_uri_escaped({ a1, a2 });
-    append("\">");
-    append("post #");
-    append_html_escaped({ a1, a2 });
-    append("</a>");
+    g_profile("inline 'thumb #'i id");
+    append_thumb_link({ a1, a2 });
   };
 
-  'post #'i id                                 => { append_id_link("post", "post", "/posts/", { a1, a2 }); };
-  'post changes #'i id                         => { append_id_link("post changes", "post-changes-for", "/posts/versions?search[post_id]=", { a1, a2 }); };
-  'post changes #'i id ':'i version            => { append_post_changes_version_link({ a1, a2 }, { b1, b2 }); };
-  'pool #'i id                                 => { append_id_link("pool", "pool", "/pools/", { a1, a2 }); };
-  'creator #'i id                               => { append_id_link("creator", "creator", "/creators/", { a1, a2 }); };
-  'creator changes #'i id                       => { append_id_link("creator changes", "creator-changes-for", "/creators/versions?search[creator_id]=", { a1, a2 }); };
-  'alias #'i id                                => { append_id_link("alias", "tag-alias", "/tags/aliases/", { a1, a2 }); };
-  'implication #'i id                          => { append_id_link("implication", "tag-implication", "/tags/implications/", { a1, a2 }); };
-  'mod action #'i id                           => { append_id_link("mod action", "mod-action", "/mod_actions/", { a1, a2 }); };
+  'post #'i id                                 => { g_profile("inline 'post #'i id"); append_id_link("post", "post", "/posts/", { a1, a2 }); };
+  'post changes #'i id                         => { g_profile("inline 'post changes #'i id"); append_id_link("post changes", "post-changes-for", "/posts/versions?search[post_id]=", { a1, a2 }); };
+  'post changes #'i id ':'i version            => { g_profile("inline 'post changes #'i id ':'i version"); append_post_changes_version_link({ a1, a2 }, { b1, b2 }); };
+  'pool #'i id                                 => { g_profile("inline 'pool #'i id"); append_id_link("pool", "pool", "/pools/", { a1, a2 }); };
+  'creator #'i id                               => { g_profile("inline 'creator #'i id"); append_id_link("creator", "creator", "/creators/", { a1, a2 }); };
+  'creator changes #'i id                       => { g_profile("inline 'creator changes #'i id"); append_id_link("creator changes", "creator-changes-for", "/creators/versions?search[creator_id]=", { a1, a2 }); };
+  'alias #'i id                                => { g_profile("inline 'alias #'i id"); append_id_link("alias", "tag-alias", "/tags/aliases/", { a1, a2 }); };
+  'implication #'i id                          => { g_profile("inline 'implication #'i id"); append_id_link("implication", "tag-implication", "/tags/implications/", { a1, a2 }); };
+  'mod action #'i id                           => { g_profile("inline 'mod action #'i id"); append_id_link("mod action", "mod-action", "/mod_actions/", { a1, a2 }); };
 
-  'issue #'i id                                => { append_id_link("issue", "github", "https://github.com/DonovanDMC/LocalBooru/issues/", { a1, a2 }); };
-  'pull #'i id                                 => { append_id_link("pull", "github-pull", "https://github.com/DonovanDMC/LocalBooru/pull/", { a1, a2 }); };
-  'commit #'i id                               => { append_id_link("commit", "github-commit", "https://github.com/DonovanDMC/LocalBooru/commit/", { a1, a2 }); };
+  'issue #'i id                                => { g_profile("inline 'issue #'i id"); append_id_link("issue", "github", "https://github.com/DonovanDMC/LocalBooru/issues/", { a1, a2 }); };
+  'pull #'i id                                 => { g_profile("inline 'pull #'i id"); append_id_link("pull", "github-pull", "https://github.com/DonovanDMC/LocalBooru/pull/", { a1, a2 }); };
+  'commit #'i id                               => { g_profile("inline 'commit #'i id"); append_id_link("commit", "github-commit", "https://github.com/DonovanDMC/LocalBooru/commit/", { a1, a2 }); };
 
 
   basic_post_search_link => {
+    g_profile("inline basic_post_search_link");
     append_post_search_link({ a1, a2 }, { b1, b2 }, { b1, b2 }, { d1, d2 });
   };
 
   aliased_post_search_link => {
+    g_profile("inline aliased_post_search_link");
     append_post_search_link({ a1, a2 }, { b1, b2 }, { c1, c2 }, { d1, d2 });
   };
 
   basic_internal_anchor_link => {
+    g_profile("inline basic_internal_anchor_link");
     append_internal_anchor_link({ a1, a2 }, { b1, b2 }, { b1, b2 }, { e1, e2 });
   };
 
   aliased_internal_anchor_link => {
+    g_profile("inline aliased_internal_anchor_link");
     append_internal_anchor_link({ a1, a2 }, { b1, b2 }, { d1, d2 }, { e1, e2 });
   };
 
   basic_creator_link => {
+    g_profile("inline basic_creator_link");
     append_creator_link({ a1, a2 }, { b1, b2 }, { c1, c2 }, { b1, b2 }, { e1, e2 });
   };
 
   aliased_creator_link => {
+    g_profile("inline aliased_creator_link");
     append_creator_link({ a1, a2 }, { b1, b2 }, { c1, c2 }, { d1, d2 }, { e1, e2 });
   };
 
   basic_textile_link => {
+    g_profile("inline basic_textile_link");
     append_bare_named_url({ b1, b2 + 1 }, { a1, a2 });
   };
 
   bracketed_textile_link | named_bbcode_link => {
+    g_profile("inline bracketed_textile_link | named_bbcode_link");
     append_named_url({ b1, b2 }, { a1, a2 });
   };
 
   backwards_markdown_link | html_link => {
+    g_profile("inline backwards_markdown_link | html_link");
     append_named_url({ a1, a2 }, { b1, b2 });
   };
 
   markdown_link => {
+    g_profile("inline markdown_link");
     append_named_url({ g1, g2 }, { f1, f2 });
   };
 
   bare_absolute_url => {
+    g_profile("inline bare_absolute_url");
     append_bare_unnamed_url({ ts, te });
   };
 
   delimited_url | unnamed_bbcode_link => {
+    g_profile("inline delimited_url | unnamed_bbcode_link");
     append_unnamed_url({ a1, a2 });
   };
 
   (bare_qtag | delimited_qtag) when qtags_enabled => {
+    g_profile("inline (bare_qtag | delimited_qtag) when qtags_enabled");
     append_qtag({ a1, a2 + 1 });
   };
 
   newline list_item => {
+    g_profile("inline newline list_item");
     g_debug("inline list");
     fexec ts + 1;
     fret;
   };
 
-  open_b    => { dstack_open_element(INLINE_B, "<strong>"); };
-  close_b   => { dstack_close_element(INLINE_B, { ts, te }); };
-  open_i    => { dstack_open_element(INLINE_I, "<em>"); };
-  close_i   => { dstack_close_element(INLINE_I, { ts, te }); };
-  open_s    => { dstack_open_element(INLINE_S, "<s>"); };
-  close_s   => { dstack_close_element(INLINE_S, { ts, te }); };
-  open_u    => { dstack_open_element(INLINE_U, "<u>"); };
-  close_u   => { dstack_close_element(INLINE_U, { ts, te }); };
-  open_sup  => { dstack_open_element(INLINE_SUP, "<sup>"); };
-  close_sup => { dstack_close_element(INLINE_SUP, { ts, te }); };
-  open_sub  => { dstack_open_element(INLINE_SUB, "<sub>"); };
-  close_sub => { dstack_close_element(INLINE_SUB, { ts, te }); };
+  open_b    => { g_profile("inline open_b"); dstack_open_element(INLINE_B, "<strong>"); };
+  close_b   => { g_profile("inline close_b"); dstack_close_element(INLINE_B, { ts, te }); };
+  open_i    => { g_profile("inline open_i"); dstack_open_element(INLINE_I, "<em>"); };
+  close_i   => { g_profile("inline close_i"); dstack_close_element(INLINE_I, { ts, te }); };
+  open_s    => { g_profile("inline open_s"); dstack_open_element(INLINE_S, "<s>"); };
+  close_s   => { g_profile("inline close_s"); dstack_close_element(INLINE_S, { ts, te }); };
+  open_u    => { g_profile("inline open_u"); dstack_open_element(INLINE_U, "<u>"); };
+  close_u   => { g_profile("inline close_u"); dstack_close_element(INLINE_U, { ts, te }); };
+  open_sup  => { g_profile("inline open_sup"); dstack_open_element(INLINE_SUP, "<sup>"); };
+  close_sup => { g_profile("inline close_sup"); dstack_close_element(INLINE_SUP, { ts, te }); };
+  open_sub  => { g_profile("inline open_sub"); dstack_open_element(INLINE_SUB, "<sub>"); };
+  close_sub => { g_profile("inline close_sub"); dstack_close_element(INLINE_SUB, { ts, te }); };
 
   open_note => {
+    g_profile("inline open_note");
     dstack_open_element(INLINE_NOTE, "<span class=\"dtext-note\">");
   };
 
   newline* close_note => {
+    g_profile("inline newline* close_note");
     g_debug("inline [/note]");
 
     if (dstack_check(INLINE_NOTE)) {
@@ -442,14 +610,16 @@ inline := |*
   };
 
   open_br => {
+    g_profile("inline open_br");
     if (header_mode) {
-      append_html_escaped("<br>");
+      append_text("<br>");
     } else {
-      append("<br>");
+      append_line_break();
     };
   };
 
   open_color_typed => {
+    g_profile("inline open_color_typed");
     if(options.f_allow_color) {
       dstack_open_element(INLINE_COLOR, "<span class=\"dtext-color-");
       append_uri_escaped({ a1, a2 });
@@ -458,6 +628,7 @@ inline := |*
   };
 
   open_color => {
+    g_profile("inline open_color");
     if(options.f_allow_color) {
         dstack_open_element(INLINE_COLOR, "<span class=\"dtext-color\" style=\"color: ");
       if(a1[0] == '#') {
@@ -471,51 +642,59 @@ inline := |*
   };
 
   close_color => {
+    g_profile("inline close_color");
     if(options.f_allow_color) {
       dstack_close_element(INLINE_COLOR, { ts, te });
     }
   };
 
   internal_anchor => {
+    g_profile("inline internal_anchor");
     append("<a id=\"");
-    std::string lowercased_tag = std::string(b1, b2 - b1);
+    std::string lowercased_tag = std::string(ts + 2, te - ts - 3); // Between the `[#` and `]`; b1 and b2 may belong to a longer candidate like `[#a](b`.
     std::transform(lowercased_tag.begin(), lowercased_tag.end(), lowercased_tag.begin(), [](unsigned char c) { return std::tolower(c); });
     append_uri_escaped(lowercased_tag);
     append("\"></a>");
   };
 
   open_code blank_line? => {
+    g_profile("inline open_code blank_line?");
     append_inline_code();
     fcall code;
   };
 
   open_code_lang blank_line? => {
+    g_profile("inline open_code_lang blank_line?");
     append_inline_code({ a1, a2 });
     fcall code;
   };
 
   newline ws* open_spoilers ws* eol => {
+    g_profile("inline newline ws* open_spoilers ws* eol");
     dstack_close_leaf_blocks();
     fexec ts;
     fret;
   };
 
   open_spoilers => {
+    g_profile("inline open_spoilers");
     dstack_open_element(INLINE_SPOILER, "<span class=\"spoiler\">");
   };
 
   newline? close_spoilers => {
+    g_profile("inline newline? close_spoilers");
     if (dstack_is_open(INLINE_SPOILER)) {
       dstack_close_element(INLINE_SPOILER, { ts, te });
     } else if (dstack_is_open(BLOCK_SPOILER)) {
       dstack_close_until(BLOCK_SPOILER);
       fret;
     } else {
-      append_html_escaped({ ts, te });
+      append_text({ ts, te });
     }
   };
 
   open_nodtext blank_line? => {
+    g_profile("inline open_nodtext blank_line?");
     dstack_open_element(INLINE_NODTEXT, "");
     fcall nodtext;
   };
@@ -524,40 +703,47 @@ inline := |*
   # scanner
 
   newline (open_code | open_code_lang | open_nodtext | open_table | open_section | open_section_expanded | open_aliased_section | open_aliased_section_expanded | hr | header | header_with_id) => {
+    g_profile("inline newline (open_code | open_code_lang | open_nodtext | open_table | open_section | open_section_expanded | open_aliased_section | open_aliased_section_expanded | hr | header | header_with_id)");
     dstack_close_leaf_blocks();
     fexec ts;
     fret;
   };
 
   (newline ws*)? close_quote ws* => {
+    g_profile("inline (newline ws*)? close_quote ws*");
     dstack_close_until(BLOCK_QUOTE);
     fret;
   };
 
   (newline ws*)? open_quote >mark_a1 => {
+    g_profile("inline (newline ws*)? open_quote >mark_a1");
     dstack_close_leaf_blocks();
     fexec a1;
     fret;
   };
 
   (newline ws*)? close_section ws* => {
+    g_profile("inline (newline ws*)? close_section ws*");
     dstack_close_until(BLOCK_SECTION);
     fret;
   };
 
   (newline ws*)? close_th => {
+    g_profile("inline (newline ws*)? close_th");
     if (dstack_close_element(BLOCK_TH, { ts, te })) {
       fret;
     }
   };
 
   (newline ws*)? close_td => {
+    g_profile("inline (newline ws*)? close_td");
     if (dstack_close_element(BLOCK_TD, { ts, te })) {
       fret;
     }
   };
 
   blank_lines => {
+    g_profile("inline blank_lines");
     g_debug("inline newline2");
 
     if (dstack_check(BLOCK_P)) {
@@ -568,14 +754,13 @@ inline := |*
       dstack_close_list();
     }
 
-    if (options.f_inline) {
-      append(" ");
-    }
+    append_inline_text(' ');
 
     fret;
   };
 
   newline => {
+    g_profile("inline newline");
     g_debug("inline newline");
 
     if (header_mode) {
@@ -585,58 +770,66 @@ inline := |*
       dstack_close_list();
       fret;
     } else {
-      append("<br>");
+      append_line_break();
     }
   };
 
   # Only support HTML character entities that are common, or that are needed to escape DText.
-  '&amp;'i    => { append("&amp;"); };
-  '&lt;'i     => { append("&lt;"); };
-  '&gt;'i     => { append("&gt;"); };
-  '&quot;'i   => { append("&quot;"); };
-  '&#39;'i    => { append("'"); }; # &#39; is more common than &apos; because &apos; wasn't officially supported before HTML5.
-  '&apos;'i   => { append("'"); };
-  '&lbrace;'i => { append('{'); };
-  '&lbrack;'i => { append('['); };
-  '&ast;'i    => { append('*'); };
-  '&colon;'i  => { append(':'); };
-  '&commat;'i => { append('@'); };
-  '&grave;'i  => { append('`'); };
-  '&num;'i    => { append('#'); };
-  '&period;'i => { append('.'); };
+  '&amp;'i    => { g_profile("inline '&amp;'i"); append_text('&'); };
+  '&lt;'i     => { g_profile("inline '&lt;'i"); append_text('<'); };
+  '&gt;'i     => { g_profile("inline '&gt;'i"); append_text('>'); };
+  '&quot;'i   => { g_profile("inline '&quot;'i"); append_text('"'); };
+  '&#39;'i    => { g_profile("inline '&#39;'i"); append_text('\''); }; # &#39; is more common than &apos; because &apos; wasn't officially supported before HTML5.
+  '&apos;'i   => { g_profile("inline '&apos;'i"); append_text('\''); };
+  '&lbrace;'i => { g_profile("inline '&lbrace;'i"); append_text('{'); };
+  '&lbrack;'i => { g_profile("inline '&lbrack;'i"); append_text('['); };
+  '&ast;'i    => { g_profile("inline '&ast;'i"); append_text('*'); };
+  '&colon;'i  => { g_profile("inline '&colon;'i"); append_text(':'); };
+  '&commat;'i => { g_profile("inline '&commat;'i"); append_text('@'); };
+  '&grave;'i  => { g_profile("inline '&grave;'i"); append_text('`'); };
+  '&num;'i    => { g_profile("inline '&num;'i"); append_text('#'); };
+  '&period;'i => { g_profile("inline '&period;'i"); append_text('.'); };
 
   '\r' => {
-    append(' ');
+    g_profile("inline '\\r'");
+    append_text(' ');
   };
 
   eos;
 
   alnum+ | utf8char+ => {
-    append({ ts, te });
+    g_profile("inline alnum+ | utf8char+");
+    append_text({ ts, te });
   };
 
   any => {
-    append_html_escaped(fc);
+    g_profile("inline any");
+    append_text(fc);
   };
 *|;
 
 inline_code := |*
   '\\`' => {
-    append("`");
+    g_profile("inline_code '\\\\`'");
+    append_text('`');
   };
 
   '`' => {
+    g_profile("inline_code '`'");
     append("</span>");
+    in_inline_code = false;
     fret;
   };
 
   any => {
-    append_html_escaped(fc);
+    g_profile("inline_code any");
+    append_text(fc);
   };
 *|;
 
 code := |*
   newline? close_code => {
+    g_profile("code newline? close_code");
     dstack_rewind();
     fret;
   };
@@ -644,12 +837,14 @@ code := |*
   eos;
 
   any => {
-    append_html_escaped(fc);
+    g_profile("code any");
+    append_text(fc);
   };
 *|;
 
 nodtext := |*
   newline? close_nodtext => {
+    g_profile("nodtext newline? close_nodtext");
     dstack_rewind();
     fret;
   };
@@ -657,59 +852,72 @@ nodtext := |*
   eos;
 
   any => {
-    append_html_escaped(fc);
+    g_profile("nodtext any");
+    append_text(fc);
   };
 *|;
 
 table := |*
   open_colgroup => {
+    g_profile("table open_colgroup");
     dstack_open_element_attributes(BLOCK_COLGROUP, "colgroup");
   };
 
   close_colgroup => {
+    g_profile("table close_colgroup");
     dstack_close_element(BLOCK_COLGROUP, { ts, te });
   };
 
   open_col => {
+    g_profile("table open_col");
     dstack_open_element_attributes(BLOCK_COL, "col");
     dstack_rewind();
   };
 
   open_thead => {
+    g_profile("table open_thead");
     dstack_open_element_attributes(BLOCK_THEAD, "thead");
   };
 
   close_thead => {
+    g_profile("table close_thead");
     dstack_close_element(BLOCK_THEAD, { ts, te });
   };
 
   open_tbody => {
+    g_profile("table open_tbody");
     dstack_open_element_attributes(BLOCK_TBODY, "tbody");
   };
 
   close_tbody => {
+    g_profile("table close_tbody");
     dstack_close_element(BLOCK_TBODY, { ts, te });
   };
 
   open_th => {
+    g_profile("table open_th");
     dstack_open_element_attributes(BLOCK_TH, "th");
     fcall inline;
   };
 
   open_tr => {
+    g_profile("table open_tr");
     dstack_open_element_attributes(BLOCK_TR, "tr");
   };
 
   close_tr => {
+    g_profile("table close_tr");
     dstack_close_element(BLOCK_TR, { ts, te });
   };
 
   open_td => {
+    g_profile("table open_td");
     dstack_open_element_attributes(BLOCK_TD, "td");
     fcall inline;
   };
 
   close_table => {
+    g_profile("table close_table");
     if (dstack_close_element(BLOCK_TABLE, { ts, te })) {
       fret;
     }
@@ -720,84 +928,101 @@ table := |*
 
 main := |*
   header | header_with_id => {
+    g_profile("main header | header_with_id");
     append_header(*a1, { b1, b2 });
     fcall inline;
   };
 
   open_quote space* => {
+    g_profile("main open_quote space*");
     dstack_close_leaf_blocks();
     dstack_open_element(BLOCK_QUOTE, "<blockquote>");
   };
 
   space* close_quote ws* => {
+    g_profile("main space* close_quote ws*");
     dstack_close_until(BLOCK_QUOTE);
   };
 
   open_spoilers space* => {
+    g_profile("main open_spoilers space*");
     dstack_close_leaf_blocks();
     dstack_open_element(BLOCK_SPOILER, "<div class=\"spoiler\">");
   };
 
   space* (close_spoilers when in_spoiler) ws* => {
+    g_profile("main space* (close_spoilers when in_spoiler) ws*");
     dstack_close_until(BLOCK_SPOILER);
   };
 
   open_code blank_line? => {
+    g_profile("main open_code blank_line?");
     append_block_code();
     fcall code;
   };
 
   open_code_lang blank_line? => {
+    g_profile("main open_code_lang blank_line?");
     append_block_code({ a1, a2 });
     fcall code;
   };
 
   open_section space* => {
+    g_profile("main open_section space*");
     append_section({}, false);
   };
 
   open_section_expanded space* => {
+    g_profile("main open_section_expanded space*");
     append_section({}, true);
   };
 
   open_aliased_section space* => {
+    g_profile("main open_aliased_section space*");
     g_debug("block [section=]");
     append_section({ a1, a2 }, false);
   };
 
   open_aliased_section_expanded space* => {
+    g_profile("main open_aliased_section_expanded space*");
     g_debug("block expanded [section=]");
     append_section({ a1, a2 }, true);
   };
 
   space* close_section ws* => {
+    g_profile("main space* close_section ws*");
     dstack_close_until(BLOCK_SECTION);
   };
 
   open_nodtext blank_line? => {
+    g_profile("main open_nodtext blank_line?");
     dstack_close_leaf_blocks();
     dstack_open_element(BLOCK_NODTEXT, "<p>");
     fcall nodtext;
   };
 
   ws* open_table => {
+    g_profile("main ws* open_table");
     dstack_close_leaf_blocks();
     dstack_open_element(BLOCK_TABLE, "<table class=\"striped\">");
     fcall table;
   };
 
   open_note => {
+    g_profile("main open_note");
     dstack_close_leaf_blocks();
     dstack_open_element(BLOCK_NOTE, "<p class=\"dtext-note\">");
     fcall inline;
   };
 
   hr => {
+    g_profile("main hr");
     dstack_close_leaf_blocks();
     append_block("<hr>");
   };
 
   list_item => {
+    g_profile("main list_item");
     dstack_open_list(e2 - e1);
     fexec f1;
     fcall inline;
@@ -805,10 +1030,12 @@ main := |*
 
   blank_line;
   blank_lines => {
+    g_profile("main blank_lines");
     g_debug("block blank line(s)");
   };
 
   any => {
+    g_profile("main any");
     g_debug("block char");
     fhold;
 
@@ -825,7 +1052,23 @@ main := |*
 %% write data;
 
 void StateMachine::dstack_push(element_t element) {
+  if (options.max_dstack_depth && dstack.size() >= options.max_dstack_depth) {
+    g_probe(limit, "too many nested elements", input.size(), flushed + output.size(), options.flags());
+    throw DTextLimitExceeded("too many nested elements");
+  }
+
+  // Don't open elements that would be left empty.
+  if (options.max_visible_chars && visible_chars == options.max_visible_chars) {
+    throw DTextTruncated();
+  }
+
   dstack.push_back(element);
+  dstack_counts[element]++;
+
+  if (events) {
+    flush_text();
+    events->on_open(element, tag_attributes);
+  }
 }
 
 element_t StateMachine::dstack_pop() {
@@ -835,6 +1078,7 @@ element_t StateMachine::dstack_pop() {
   } else {
     auto element = dstack.back();
     dstack.pop_back();
+    dstack_counts[element]--;
     return element;
   }
 }
@@ -849,11 +1093,11 @@ bool StateMachine::dstack_check(element_t expected_element) {
 
 // Return true if the given tag is currently open.
 bool StateMachine::dstack_is_open(element_t element) {
-  return std::find(dstack.begin(), dstack.end(), element) != dstack.end();
+  return dstack_counts[element] > 0;
 }
 
 int StateMachine::dstack_count(element_t element) {
-  return std::count(dstack.begin(), dstack.end(), element);
+  return dstack_counts[element];
 }
 
 bool StateMachine::is_inline_element(element_t type) {
@@ -866,21 +1110,85 @@ bool StateMachine::is_internal_url(const std::string_view url) {
   } else if (options.domain.empty() || url.empty()) {
     return false;
   } else {
-    // Matches the domain name part of a URL.
-    static const std::regex url_regex("^https?://(?:[^/?#]*@)?([^/?#:]+)", std::regex_constants::icase);
+    // Match the domain name part of a URL, like `^https?://(?:[^/?#]*@)?([^/?#:]+)` would.
+    auto authority = DText::URL::strip_scheme(url);
+    authority = authority.substr(0, authority.find_first_of("/?#"));
+
+    // Try the longest userinfo first, then shorter ones, then none at all.
+    for (auto at = authority.rfind('@'); at != std::string_view::npos; at = at ? authority.rfind('@', at - 1) : std::string_view::npos) {
+      auto domain = authority.substr(at + 1);
+      domain = domain.substr(0, domain.find(':'));
+
+      if (!domain.empty()) {
+        return domain == options.domain;
+      }
+    }
 
-    std::match_results<std::string_view::const_iterator> matches;
-    std::regex_search(url.begin(), url.end(), matches, url_regex);
-    return matches[1] == options.domain;
+    auto domain = authority.substr(0, authority.find(':'));
+    return !domain.empty() && domain == options.domain;
   }
 }
 
+// Enforce the output size and timeout limits. The clock is only read every 256 calls to keep this cheap.
+void StateMachine::check_limits() {
+  if (options.max_output_bytes && flushed + output.size() > options.max_output_bytes) {
+    g_probe(limit, "output too large", input.size(), flushed + output.size(), options.flags());
+    throw DTextLimitExceeded("output too large");
+  }
+
+  if (options.timeout.count() && (++steps % 256) == 0 && std::chrono::steady_clock::now() > deadline) {
+    g_probe(limit, "parse timed out", input.size(), flushed + output.size(), options.flags());
+    throw DTextLimitExceeded("parse timed out");
+  }
+}
+
+// Run the scanner from p up to pe. If eof isn't set yet, the scanner stops at pe in the middle of the current token
+// (if any) and picks up from there on the next call, once more input has been appended.
+//
+// With a timeout, the input is scanned a window at a time, reading the clock between windows. check_limits() only reads
+// it when output is appended, so without this a long run of input that produces no output (e.g. a link that's never
+// closed) could keep the parse going long past its deadline. Stopping at the end of a window is the same as a streaming
+// parse stopping at the end of a chunk, so this doesn't change the output.
+void StateMachine::scan() {
+  if (!options.timeout.count()) {
+    return scan_window();
+  }
+
+  const char * end = pe;
+  const char * end_eof = eof;
+
+  do {
+    pe = p + std::min<size_t>(end - p, SCAN_WINDOW_BYTES);
+    eof = pe == end ? end_eof : NULL;
+    scan_window();
+
+    if (std::chrono::steady_clock::now() > deadline) {
+      g_probe(limit, "parse timed out", input.size(), flushed + output.size(), options.flags());
+      throw DTextLimitExceeded("parse timed out");
+    }
+  } while (pe != end);
+}
+
 void StateMachine::append(const auto c) {
+  if (discard_output) {
+    return;
+  } else if (compiling) {
+    ir_begin(IR_TEXT);
+  }
+
   output += c;
+  check_limits();
 }
 
 void StateMachine::append(const std::string_view string) {
+  if (discard_output) {
+    return;
+  } else if (compiling) {
+    ir_begin(IR_TEXT);
+  }
+
   output += string;
+  check_limits();
 }
 
 void StateMachine::append_html_escaped(char s) {
@@ -894,8 +1202,120 @@ void StateMachine::append_html_escaped(char s) {
 }
 
 void StateMachine::append_html_escaped(const std::string_view string) {
-  for (const unsigned char c : string) {
-    append_html_escaped(c);
+  size_t start = 0, end;
+
+  // Append runs of characters that don't need escaping all at once.
+  while ((end = string.find_first_of("<>&\"", start)) != std::string_view::npos) {
+    append(string.substr(start, end - start));
+    append_html_escaped(string[end]);
+    start = end + 1;
+  }
+
+  append(string.substr(start));
+}
+
+// Append text from the document (as opposed to markup), and report it to the event handler.
+void StateMachine::append_text(const char c) {
+  if (options.max_visible_chars && count_visible_chars({ &c, 1 }) == 0) {
+    throw DTextTruncated();
+  }
+
+  append_html_escaped(c);
+
+  if (events) {
+    event_text += c;
+  }
+}
+
+void StateMachine::append_text(std::string_view text) {
+  bool truncate = false;
+
+  // Append as much of the text as fits, then stop.
+  if (options.max_visible_chars) {
+    size_t length = count_visible_chars(text);
+    truncate = length < text.size();
+    text = text.substr(0, length);
+  }
+
+  append_html_escaped(text);
+
+  if (events) {
+    event_text += text;
+  }
+
+  if (truncate) {
+    throw DTextTruncated();
+  }
+}
+
+// Append text that's only shown in inline mode.
+void StateMachine::append_inline_text(const char c) {
+  if (compiling) {
+    ir_begin(IR_INLINE);
+    html_escape({ &c, 1 }, output);
+  } else if (options.f_inline) {
+    append_text(c);
+  }
+}
+
+// Append text that's not shown in inline mode.
+void StateMachine::append_block_text(const std::string_view text) {
+  if (compiling) {
+    append_block_html_escaped(text);
+  } else if (!options.f_inline) {
+    append_text(text);
+  }
+}
+
+void StateMachine::append_line_break() {
+  if (options.max_visible_chars && count_visible_chars("\n") == 0) {
+    throw DTextTruncated();
+  }
+
+  append("<br>");
+
+  if (events) {
+    event_text += '\n';
+  }
+}
+
+// Pass the text collected since the last event to the event handler. Text is collected so that a run of text is
+// reported as one event, rather than one event per character.
+void StateMachine::flush_text() {
+  if (!event_text.empty()) {
+    events->on_text(event_text);
+    event_text.clear();
+  }
+}
+
+// Count the characters of `text` towards max_visible_chars. Returns the number of bytes of `text` that fit.
+size_t StateMachine::count_visible_chars(const std::string_view text) {
+  size_t i = 0;
+
+  for (; i < text.size(); i++) {
+    // UTF-8 continuation bytes belong to the previous character.
+    if ((text[i] & 0xC0) != 0x80) {
+      if (visible_chars == options.max_visible_chars) {
+        break;
+      }
+
+      visible_chars++;
+    }
+  }
+
+  return i;
+}
+
+// Report a link to the event handler. This is called before the link's HTML is appended, so that the link can be left
+// out if there's no room for it; links that only partly fit are kept whole.
+void StateMachine::emit_link(link_t kind, const std::string_view url, const std::string_view title) {
+  if (options.max_visible_chars && !title.empty() && count_visible_chars(title) == 0) {
+    throw DTextTruncated();
+  }
+
+  if (events) {
+    flush_text();
+    events->on_link(kind, url, title);
   }
 }
 
@@ -914,7 +1334,9 @@ void StateMachine::append_uri_escaped(const std::string_view string) {
 }
 
 void StateMachine::append_relative_url(const auto url) {
-  if ((url[0] == '/' || url[0] == '#') && !options.base_url.empty()) {
+  if ((url[0] == '/' || url[0] == '#') && compiling) {
+    ir_emit(IR_BASE_URL, {});
+  } else if ((url[0] == '/' || url[0] == '#') && !options.base_url.empty()) {
     append_html_escaped(options.base_url);
   }
 
@@ -943,7 +1365,21 @@ void StateMachine::append_absolute_link(const std::string_view url, const std::s
 }
 
 void StateMachine::append_qtag(const std::string_view name) {
+  if (options.max_visible_chars && count_visible_chars(name) == 0) {
+    throw DTextTruncated();
+  }
+
   qtags.push_back(std::string{name});
+
+  if (compiling) {
+    ir_emit(IR_QTAG, { name });
+  }
+
+  if (events) {
+    flush_text();
+    events->on_qtag(name);
+  }
+
   append("<a class=\"dtext-link dtext-qtag-link\" data-qtag-name=\"");
   append_html_escaped(name);
   append("\" href=\"");
@@ -955,6 +1391,10 @@ void StateMachine::append_qtag(const std::string_view name) {
 }
 
 void StateMachine::append_id_link(const char * title, const char * id_name, const char * url, const std::string_view id) {
+  if (events || options.max_visible_chars) {
+    emit_link(LINK_ID, std::string(url) + std::string(id), std::string(title) + " #" + std::string(id));
+  }
+
   if (url[0] == '/') {
     append("<a class=\"dtext-link dtext-id-link dtext-");
     append(id_name);
@@ -975,18 +1415,46 @@ void StateMachine::append_id_link(const char * title, const char * id_name, cons
   append("</a>");
 }
 
+void StateMachine::append_thumb_link(const std::string_view id) {
+  if (events || options.max_visible_chars) {
+    emit_link(LINK_ID, "/posts/" + std::string(id), "post #" + std::string(id));
+  }
+
+  posts.push_back(strtol(id.data(), NULL, 10));
+
+  if (compiling) {
+    ir_emit(IR_POST, { id });
+  }
+
+  append("<a class=\"dtext-link dtext-id-link dtext-post-id-link thumb-placeholder-link\" data-id=\"");
+  append_html_escaped(id);
+  append("\" href=\"");
+  append_relative_url("/posts/");
+  append_uri_escaped(id);
+  append("\">");
+  append("post #");
+  append_html_escaped(id);
+  append("</a>");
+}
+
 void StateMachine::append_bare_unnamed_url(const std::string_view url) {
   auto [trimmed_url, leftovers] = trim_url(url);
   append_unnamed_url(trimmed_url);
-  append_html_escaped(leftovers);
+  append_text(leftovers);
 }
 
 void StateMachine::append_unnamed_url(const std::string_view url) {
+  // Whether the URL is internal depends on the domain options, so it's rendered later.
+  if (compiling) {
+    return ir_emit(IR_UNNAMED_URL, { url });
+  }
+
   DText::URL parsed_url(url);
 
   if (options.internal_domains.find(std::string(parsed_url.domain)) != options.internal_domains.end()) {
     append_internal_url(parsed_url);
   } else {
+    emit_link(parsed_url.domain == options.domain ? LINK_INTERNAL : LINK_EXTERNAL, url, url);
     append_absolute_link(url, url, parsed_url.domain == options.domain);
   }
 }
@@ -1027,17 +1495,29 @@ void StateMachine::append_internal_url(const DText::URL& url) {
     }
   }
 
+  emit_link(url.domain == options.domain ? LINK_INTERNAL : LINK_EXTERNAL, url.url, url.url);
   append_absolute_link(url.url, url.url, url.domain == options.domain);
 }
 
 void StateMachine::append_named_url(const std::string_view url, const std::string_view title) {
-  auto parsed_title = parse_basic_inline(title);
+  append_named_url(url, title, parse_basic_inline(title));
+}
+
+void StateMachine::append_named_url(const std::string_view url, const std::string_view title, const std::string_view parsed_title) {
+  bool protocol_relative = url.size() > 2 && url.starts_with("//");
+
+  // Whether an absolute URL is internal depends on the domain options, so it's rendered later.
+  if (compiling && (protocol_relative || (url[0] != '/' && url[0] != '#'))) {
+    return ir_emit(IR_NAMED_URL, { url, title, parsed_title });
+  }
 
   // protocol-relative url; treat `//example.com` like `http://example.com`
-  if (url.size() > 2 && url.starts_with("//")) {
+  if (protocol_relative) {
     auto full_url = "http:" + std::string(url);
+    emit_link(is_internal_url(full_url) ? LINK_INTERNAL : LINK_EXTERNAL, full_url, title);
     append_absolute_link(full_url, parsed_title, is_internal_url(full_url), false);
   } else if (url[0] == '/' || url[0] == '#') {
+    emit_link(LINK_INTERNAL, url, title);
     append("<a class=\"dtext-link\" href=\"");
     append_relative_url(url);
     append("\">");
@@ -1046,6 +1526,7 @@ void StateMachine::append_named_url(const std::string_view url, const std::strin
   } else if (url == title) {
     append_unnamed_url(url);
   } else {
+    emit_link(is_internal_url(url) ? LINK_INTERNAL : LINK_EXTERNAL, url, title);
     append_absolute_link(url, parsed_title, is_internal_url(url), false);
   }
 }
@@ -1053,17 +1534,12 @@ void StateMachine::append_named_url(const std::string_view url, const std::strin
 void StateMachine::append_bare_named_url(const std::string_view url, std::string_view title) {
   auto [trimmed_url, leftovers] = trim_url(url);
   append_named_url(trimmed_url, title);
-  append_html_escaped(leftovers);
+  append_text(leftovers);
 }
 
 void StateMachine::append_post_search_link(const std::string_view prefix, const std::string_view search, const std::string_view title, const std::string_view suffix) {
   auto normalized_title = std::string(title);
 
-  append("<a class=\"dtext-link dtext-post-search-link\" href=\"");
-  append_relative_url("/posts?tags=");
-  append_uri_escaped(search);
-  append("\">");
-
   // 19{{60s}} -> {{60s|1960s}}
   if (!prefix.empty()) {
     normalized_title.insert(0, prefix);
@@ -1079,6 +1555,12 @@ void StateMachine::append_post_search_link(const std::string_view prefix, const
     normalized_title.append(suffix);
   }
 
+  emit_link(LINK_POST_SEARCH, search, normalized_title);
+
+  append("<a class=\"dtext-link dtext-post-search-link\" href=\"");
+  append_relative_url("/posts?tags=");
+  append_uri_escaped(search);
+  append("\">");
   append_html_escaped(normalized_title);
   append("</a>");
 
@@ -1098,7 +1580,13 @@ void StateMachine::append_section(const std::string_view summary, bool initially
   append_block("</summary><div>");
 }
 
-void StateMachine::append_creator_link(const std::string_view prefix, const std::string_view tag, const std::string_view anchor, const std::string_view title, const std::string_view suffix) {
+void StateMachine::append_creator_link(const std::string_view prefix, const std::string_view tag, std::string_view anchor, const std::string_view title, const std::string_view suffix) {
+  // The anchor is optional, so its marks can be left over from an earlier token. Ignore them unless they're inside the
+  // current token.
+  if (!anchor.empty() && (anchor.data() < ts || anchor.data() > te || anchor.size() > size_t(te - anchor.data()))) {
+    anchor = {};
+  }
+
   auto normalized_tag = std::string(tag);
   auto title_string = std::string(title);
 
@@ -1120,6 +1608,8 @@ void StateMachine::append_creator_link(const std::string_view prefix, const std:
     title_string.append(suffix);
   }
 
+  emit_link(LINK_CREATOR, normalized_tag, title_string);
+
   append("<a rel=\"nofollow\" class=\"dtext-link dtext-creator-link\" href=\"");
   if (std::all_of(normalized_tag.cbegin(), normalized_tag.cend(), ::isdigit)) {
   append_relative_url("/creators/");
@@ -1141,6 +1631,10 @@ void StateMachine::append_creator_link(const std::string_view prefix, const std:
 
   creators.insert(std::string(tag));
 
+  if (compiling) {
+    ir_emit(IR_CREATOR, { tag });
+  }
+
   clear_matches();
 }
 
@@ -1158,6 +1652,8 @@ void StateMachine::append_internal_anchor_link(const std::string_view prefix, co
     title_string.append(suffix);
   }
 
+  emit_link(LINK_ANCHOR, "#" + anchor_string, title_string);
+
   append("<a class=\"dtext-link dtext-internal-anchor-link\" href=\"#");
   append_uri_escaped(anchor_string);
   append("\">");
@@ -1168,6 +1664,10 @@ void StateMachine::append_internal_anchor_link(const std::string_view prefix, co
 }
 
 void StateMachine::append_paged_link(const char * title, const std::string_view id, const char * tag, const char * href, const char * param, const std::string_view page) {
+  if (events || options.max_visible_chars) {
+    emit_link(LINK_ID, std::string(href) + std::string(id) + param + std::string(page), std::string(title) + std::string(id) + " (page " + std::string(page) + ")");
+  }
+
   append(tag);
   append_relative_url(href);
   append(id);
@@ -1182,6 +1682,10 @@ void StateMachine::append_paged_link(const char * title, const std::string_view
 }
 
 void StateMachine::append_dmail_key_link(const std::string_view dmail_id, const std::string_view dmail_key) {
+  if (events || options.max_visible_chars) {
+    emit_link(LINK_ID, "/dmails/" + std::string(dmail_id) + "?key=" + std::string(dmail_key), "dmail #" + std::string(dmail_id));
+  }
+
   append("<a class=\"dtext-link dtext-id-link dtext-dmail-id-link\" href=\"");
   append_relative_url("/dmails/");
   append(dmail_id);
@@ -1194,6 +1698,10 @@ void StateMachine::append_dmail_key_link(const std::string_view dmail_id, const
 }
 
 void StateMachine::append_post_changes_version_link(const std::string_view post_id, const std::string_view version) {
+  if (events || options.max_visible_chars) {
+    emit_link(LINK_ID, "/posts/versions?search[post_id]=" + std::string(post_id) + "&search[version]=" + std::string(version), "post changes #" + std::string(post_id));
+  }
+
   append("<a class=\"dtext-link dtext-id-link dtext-post-changes-for-id-version-link\" href=\"");
   append_relative_url("/posts/versions?search[post_id]=");
   append_uri_escaped(post_id);
@@ -1252,13 +1760,19 @@ void StateMachine::append_header(char header, const std::string_view id) {
 }
 
 void StateMachine::append_block(const auto s) {
-  if (!options.f_inline) {
+  if (compiling) {
+    ir_begin(IR_BLOCK);
+    output += s;
+  } else if (!options.f_inline) {
     append(s);
   }
 }
 
 void StateMachine::append_block_html_escaped(const std::string_view string) {
-  if (!options.f_inline) {
+  if (compiling) {
+    ir_begin(IR_BLOCK);
+    html_escape(string, output);
+  } else if (!options.f_inline) {
     append_html_escaped(string);
   }
 }
@@ -1309,11 +1823,11 @@ bool StateMachine::dstack_close_element(element_t type, const std::string_view t
     return true;
   } else if (type >= INLINE) {
     g_debug("out-of-order closing %s", element_names[type]);
-    append_html_escaped(tag_name);
+    append_text(tag_name);
     return false;
   } else {
     g_debug("out-of-order closing %s", element_names[type]);
-    append_block_html_escaped(tag_name);
+    append_block_text(tag_name);
     return false;
   }
 }
@@ -1323,6 +1837,11 @@ void StateMachine::dstack_rewind() {
   element_t element = dstack_pop();
   g_debug("dstack rewind %s", element_names[element]);
 
+  if (events && element != DSTACK_EMPTY) {
+    flush_text();
+    events->on_close(element);
+  }
+
   switch(element) {
     case BLOCK_P: append_block("</p>"); break;
     case INLINE_SPOILER: append("</span>"); break;
@@ -1470,6 +1989,18 @@ static unsigned char ascii_tolower(unsigned char c) {
   return (c >= 'A' && c <= 'Z') ? c ^ 0x20 : c;
 }
 
+static void html_escape(const std::string_view string, std::string& output) {
+  for (const char c : string) {
+    switch (c) {
+      case '<': output += "&lt;"; break;
+      case '>': output += "&gt;"; break;
+      case '&': output += "&amp;"; break;
+      case '"': output += "&quot;"; break;
+      default:  output += c;
+    }
+  }
+}
+
 // Replace CRLF sequences with LF.
 static void replace_newlines(const std::string_view input, std::string& output) {
   size_t pos, last = 0;
@@ -1483,7 +2014,19 @@ static void replace_newlines(const std::string_view input, std::string& output)
   output.append(input, last, pos - last);
 }
 
-StateMachine::StateMachine(const auto string, int initial_state, const DTextOptions options) : options(options) {
+StateMachine::StateMachine(const auto string, int initial_state, const DTextOptions options, ParseBuffers * buffers) : options(options) {
+  if (buffers) {
+    swap_buffers(*buffers);
+    input.clear();
+    output.clear();
+    stack.clear();
+    dstack.clear();
+    creators.clear();
+    posts.clear();
+    qtags.clear();
+    truncated = false;
+  }
+
   // Add null bytes to the beginning and end of the string as start and end of string markers.
   input.reserve(string.size());
   input.append(1, '\0');
@@ -1494,6 +2037,10 @@ StateMachine::StateMachine(const auto string, int initial_state, const DTextOpti
   stack.reserve(16);
   dstack.reserve(16);
 
+  if (options.timeout.count()) {
+    deadline = std::chrono::steady_clock::now() + options.timeout;
+  }
+
   p = input.c_str();
   pb = input.c_str();
   pe = input.c_str() + input.size();
@@ -1501,31 +2048,1680 @@ StateMachine::StateMachine(const auto string, int initial_state, const DTextOpti
   cs = initial_state;
 }
 
+// Start a streaming parse. Input is given to feed() in chunks, and output is passed to the sink as it's produced.
+StateMachine::StateMachine(const DTextOptions options, Sink sink) : options(options), sink(std::move(sink)) {
+  input.append(1, '\0');
+  stack.reserve(16);
+  dstack.reserve(16);
+
+  if (options.timeout.count()) {
+    deadline = std::chrono::steady_clock::now() + options.timeout;
+  }
+
+  // top, ts, te and act are already zeroed, which is all that `write init` would do.
+  p = input.c_str();
+  pb = input.c_str();
+  pe = input.c_str() + input.size();
+  cs = dtext_en_main;
+}
+
+// Parse the next chunk of a streamed document.
+void StateMachine::feed(const std::string_view chunk) {
+  buffer_input(chunk, false);
+  scan();
+  flush();
+}
+
+// Parse the rest of a streamed document and close any open tags.
+void StateMachine::finish() {
+  buffer_input({}, true);
+  scan();
+  dstack_close_all();
+
+  if (events) {
+    flush_text();
+  }
+
+  flush();
+}
+
+// Discard the input that has already been scanned and append the next chunk. Everything from the start of the current
+// token is kept (plus one character of lookbehind), so memory use is bounded by the longest token rather than the
+// whole document.
+void StateMachine::buffer_input(const std::string_view chunk, bool last) {
+  const char ** pointers[] = { &p, &ts, &te, &a1, &a2, &b1, &b2, &c1, &c2, &d1, &d2, &e1, &e2, &f1, &f2, &g1, &g2 };
+  std::ptrdiff_t offsets[std::size(pointers)];
+
+  const char * start = std::max((ts ? ts : p) - 1, input.c_str());
+  size_t discarded = start - input.c_str();
+
+  // Pointers that point before the kept input belong to finished tokens and are stale, so they're cleared.
+  for (size_t i = 0; i < std::size(pointers); i++) {
+    offsets[i] = *pointers[i] && *pointers[i] >= start ? *pointers[i] - start : -1;
+  }
+
+  std::vector<std::tuple<size_t, size_t, size_t, size_t>> attribute_offsets;
+  for (auto [name, value] : tag_attributes) {
+    attribute_offsets.emplace_back(name.data() - start, name.size(), value.data() - start, value.size());
+  }
+
+  input.erase(0, discarded);
+
+  // A CR at the end of a chunk may be the first half of a CRLF, so hold it back until the next chunk.
+  if (pending_cr) {
+    std::string text = "\r";
+    text += chunk;
+    pending_cr = false;
+    buffer_chunk(text, last);
+  } else {
+    buffer_chunk(chunk, last);
+  }
+
+  for (size_t i = 0; i < std::size(pointers); i++) {
+    *pointers[i] = offsets[i] >= 0 ? input.c_str() + offsets[i] : NULL;
+  }
+
+  tag_attributes.clear();
+  for (auto [name, name_size, value, value_size] : attribute_offsets) {
+    tag_attributes[{ input.c_str() + name, name_size }] = { input.c_str() + value, value_size };
+  }
+
+  pb = input.c_str();
+  pe = input.c_str() + input.size();
+
+  if (last) {
+    eof = pe;
+  }
+}
+
+// Append a chunk to the input, normalizing its newlines.
+void StateMachine::buffer_chunk(std::string_view chunk, bool last) {
+  if (!last && !chunk.empty() && chunk.back() == '\r') {
+    chunk.remove_suffix(1);
+    pending_cr = true;
+  }
+
+  replace_newlines(chunk, input);
+
+  if (last) {
+    input.append(1, '\0');
+  }
+}
+
+// Pass the output produced so far to the sink.
+void StateMachine::flush() {
+  if (!output.empty()) {
+    flushed += output.size();
+    sink(output);
+    output.clear();
+  }
+}
+
+// A sink that writes output to a file descriptor (used to stream output straight to a socket or pipe).
+StateMachine::Sink StateMachine::fd_sink(int fd) {
+  return [fd](std::string_view data) {
+    while (!data.empty()) {
+      ssize_t written = write(fd, data.data(), data.size());
+
+      if (written < 0 && errno == EINTR) {
+        continue;
+      } else if (written < 0) {
+        throw DTextError(std::string("write failed: ") + strerror(errno));
+      }
+
+      data.remove_prefix(written);
+    }
+  };
+}
+
 std::string StateMachine::parse_inline(const std::string_view dtext) {
+  g_probe(subparse__start, dtext.size(), options.flags());
   StateMachine sm(dtext, dtext_en_inline, options);
-  return sm.parse();
+  sm.deadline = deadline;
+  auto output = sm.parse();
+  g_probe(subparse__done, dtext.size(), output.size(), options.flags());
+  return output;
 }
 
 std::string StateMachine::parse_basic_inline(const std::string_view dtext) {
+  g_probe(subparse__start, dtext.size(), options.flags());
+
+  // Link titles are counted towards max_visible_chars by the link, not here.
   DTextOptions opt = options;
-  StateMachine sm(dtext, dtext_en_basic_inline, options);
-  return sm.parse();
+  opt.max_visible_chars = 0;
+  StateMachine sm(dtext, dtext_en_basic_inline, opt);
+  sm.deadline = deadline;
+  auto output = sm.parse();
+  g_probe(subparse__done, dtext.size(), output.size(), options.flags());
+  return output;
 }
 
-StateMachine::ParseResult StateMachine::parse_dtext(const std::string_view dtext, DTextOptions options) {
+StateMachine::ParseResult StateMachine::parse_dtext(const std::string_view dtext, DTextOptions options, DTextEventHandler * events) {
+  g_probe(parse__start, dtext.size(), options.flags());
   StateMachine sm(dtext, dtext_en_main, options);
-  return { sm.parse(), sm.creators, sm.posts, sm.qtags };
+  sm.events = events;
+  auto output = sm.parse();
+  g_probe(parse__done, dtext.size(), output.size(), options.flags());
+  return { std::move(output), sm.creators, sm.posts, sm.qtags, sm.truncated };
 }
 
-std::string StateMachine::parse() {
-  g_debug("parse '%.*s'", (int)(input.size() - 2), input.c_str() + 1);
+// Parse the document into the given buffers, reusing their capacity rather than allocating new ones.
+void StateMachine::parse_dtext(const std::string_view dtext, DTextOptions options, ParseBuffers& buffers) {
+  g_probe(parse__start, dtext.size(), options.flags());
+  StateMachine sm(dtext, dtext_en_main, options, &buffers);
 
-  %% write init nocs;
-  %% write exec;
+  // Give the buffers back even if the parse fails, so that their capacity isn't lost.
+  struct Restore {
+    StateMachine& sm;
+    ParseBuffers& buffers;
+    ~Restore() { sm.swap_buffers(buffers); }
+  } restore{sm, buffers};
 
-  g_debug("EOF; closing stray blocks");
-  dstack_close_all();
-  g_debug("done");
+  sm.parse();
+  g_probe(parse__done, dtext.size(), sm.output.size(), options.flags());
+}
 
-  return output;
+void StateMachine::swap_buffers(ParseBuffers& buffers) {
+  input.swap(buffers.input);
+  output.swap(buffers.output);
+  stack.swap(buffers.stack);
+  dstack.swap(buffers.dstack);
+  creators.swap(buffers.creators);
+  posts.swap(buffers.posts);
+  qtags.swap(buffers.qtags);
+  std::swap(truncated, buffers.truncated);
+}
+
+// Return a block that `text` starts with, if there's one in the cache. Blocks are looked up by the hash of their first
+// paragraph, so the rest of the block is checked against the text. The block stays valid even if it's evicted while
+// it's being used.
+std::shared_ptr<const BlockCache::Block> BlockCache::find(size_t key, size_t options_hash, const std::string_view text) {
+  std::lock_guard lock(mutex);
+  auto [first, last] = index.equal_range(key);
+
+  for (auto it = first; it != last; it++) {
+    auto& block = it->second->block;
+
+    if (block->options_hash == options_hash && text.starts_with(block->text)) {
+      hits++;
+      it->second->last_used = ++clock;
+      lru.splice(lru.begin(), lru, it->second);
+      return block;
+    }
+  }
+
+  misses++;
+  return nullptr;
+}
+
+// Add a block, replacing the block with the same text. Several blocks can start with the same paragraph (e.g. a header
+// shared by many documents), but only the MAX_BLOCKS_PER_KEY most recently used ones are kept.
+void BlockCache::insert(size_t key, Block block) {
+  std::lock_guard lock(mutex);
+  auto [first, last] = index.equal_range(key);
+  auto oldest = last;
+  size_t count = 0;
+
+  for (auto it = first; it != last; it++, count++) {
+    auto& cached = it->second->block;
+
+    if (cached->options_hash == block.options_hash && cached->text == block.text) {
+      oldest = it;
+      count = MAX_BLOCKS_PER_KEY;
+      break;
+    } else if (oldest == last || it->second->last_used < oldest->second->last_used) {
+      oldest = it;
+    }
+  }
+
+  if (count >= MAX_BLOCKS_PER_KEY) {
+    evict(oldest->second);
+  }
+
+  bytes += block.text.size() + block.html.size();
+  lru.push_front({ key, std::make_shared<const Block>(std::move(block)), ++clock });
+  index.emplace(key, lru.begin());
+
+  while (bytes > max_bytes && !lru.empty()) {
+    evict(std::prev(lru.end()));
+  }
+}
+
+void BlockCache::clear() {
+  std::lock_guard lock(mutex);
+  lru.clear();
+  index.clear();
+  bytes = 0;
+}
+
+// The number of blocks and the number of bytes they take up.
+std::pair<size_t, size_t> BlockCache::size() {
+  std::lock_guard lock(mutex);
+  return { lru.size(), bytes };
+}
+
+void BlockCache::evict(decltype(lru)::iterator it) {
+  bytes -= it->block->text.size() + it->block->html.size();
+
+  for (auto [first, last] = index.equal_range(it->key); first != last; first++) {
+    if (first->second == it) {
+      index.erase(first);
+      break;
+    }
+  }
+
+  lru.erase(it);
+}
+
+// Check whether the parser, which has just been fed the first character of `block`, is in the same state as a new parser
+// that has been fed the same start of the block. If it is, the rest of the document can be parsed by a new parser
+// instead: the new parser's output, after the first `start.html_size` bytes and the first `start.posts_size` posts and
+// `start.qtags_size` qtags, is what this parser's would have been. If the parser is still scanning a token that started
+// before the block (e.g. blank lines, which may be followed by a [/note]), it's first fed more of the block's first line
+// until the token ends, so that the check doesn't depend on how far ahead the scanner had to look to end the paragraph
+// before.
+bool StateMachine::sync_block_start(const std::string_view block, BlockStart& start) {
+  size_t limit = std::min({ block.size(), block.find_first_of("\r\n"), BLOCK_SYNC_BYTES });
+  start = {};
+  start.length = 1;
+
+  while (ts && ts < pe - start.length && start.length < limit) {
+    feed(block.substr(start.length++, 1));
+  }
+
+  if (ts && ts < pe - start.length) {
+    return false;
+  }
+
+  StateMachine sm(options, [&start](std::string_view output) { start.html_size += output.size(); });
+  sm.feed(block.substr(0, start.length));
+  start.posts_size = sm.posts.size();
+  start.qtags_size = sm.qtags.size();
+  return scan_state() == sm.scan_state();
+}
+
+// Return the state the parser is in after scanning all of the input it has been fed.
+StateMachine::ScanState StateMachine::scan_state() const {
+  const char * base = ts ? ts : pe;
+  const char * pointers[] = { te, a1, a2, b1, b2, c1, c2, d1, d2, e1, e2, f1, f2, g1, g2 };
+
+  ScanState state;
+  state.cs = cs;
+  state.stack.assign(stack.begin(), stack.begin() + top);
+  state.dstack = dstack;
+  state.token = ts ? std::string(ts, pe) : "";
+  state.header_mode = header_mode;
+  state.in_inline_code = in_inline_code;
+  state.pending_cr = pending_cr;
+
+  for (size_t i = 0; i < std::size(pointers); i++) {
+    state.pointers[i] = pointers[i] && pointers[i] >= base ? pointers[i] - base : -1;
+  }
+
+  for (auto [name, value] : tag_attributes) {
+    state.tag_attributes.emplace_back(name, value);
+  }
+
+  return state;
+}
+
+// Return a string that identifies the options that affect the output (used as part of the key of cached output).
+std::string DTextOptions::fingerprint() const {
+  std::string fingerprint = std::to_string(f_inline) + std::to_string(f_allow_color) + std::to_string(f_qtags) + ' ' + std::to_string(max_dstack_depth) + ' ' + std::to_string(max_visible_chars) + '\0' + base_url + '\0' + domain;
+
+  std::vector<std::string> domains(internal_domains.begin(), internal_domains.end());
+  std::sort(domains.begin(), domains.end());
+
+  for (auto& domain : domains) {
+    fingerprint += '\0' + domain;
+  }
+
+  return fingerprint;
+}
+
+// Return the start of the next paragraph at or after `pos`, or npos if there isn't one. Paragraphs start after two or
+// more newlines (LF or CRLF), at a character that can't continue the blank line.
+static size_t next_paragraph(const std::string_view input, size_t pos) {
+  while ((pos = input.find('\n', pos)) != std::string_view::npos) {
+    int newlines = 0;
+
+    for (; pos < input.size() && (input[pos] == '\n' || input.substr(pos, 2) == "\r\n"); pos += (input[pos] == '\r') + 1) {
+      newlines++;
+    }
+
+    if (pos == input.size()) {
+      return std::string_view::npos;
+    } else if (newlines >= 2 && input[pos] != ' ' && input[pos] != '\t' && input[pos] != '\r' && input[pos] != '\0') {
+      break;
+    }
+  }
+
+  return pos;
+}
+
+// Parse a document one block at a time, reusing the HTML of blocks that are in the cache. The output is the same as
+// parse_dtext. A block is one or more paragraphs that a new parser parses the same way as the parser of the whole
+// document (see sync_block_start), so every block starts in the same state and is cached on its text alone; a paragraph
+// that leaves something open (e.g. a [quote] with blank lines in it) is parsed together with the following ones.
+StateMachine::ParseResult StateMachine::parse_cached(const std::string_view dtext, const DTextOptions options, BlockCache& cache) {
+  if (options.max_visible_chars) {
+    return parse_dtext(dtext, options);
+  }
+
+  g_probe(parse__start, dtext.size(), options.flags());
+
+  // The input isn't normalized here, since the parser does that (and doing it twice would turn \r\r\n into \n).
+  const std::string_view input = dtext;
+
+  size_t options_hash = std::hash<std::string>{}(options.fingerprint());
+  auto deadline = std::chrono::steady_clock::now() + options.timeout;
+  ParseResult result;
+  auto& [html, creators, posts, qtags, truncated] = result;
+
+  // The output of the next block that's already in the output of the block before it.
+  BlockStart skip;
+
+  auto add_block = [&](const BlockCache::Block& block) {
+    html.append(block.html, skip.html_size);
+    creators.insert(block.creators.begin(), block.creators.end());
+    posts.insert(posts.end(), block.posts.begin() + skip.posts_size, block.posts.end());
+    qtags.insert(qtags.end(), block.qtags.begin() + skip.qtags_size, block.qtags.end());
+    skip = block.next;
+
+    if (options.max_output_bytes && html.size() > options.max_output_bytes) {
+      g_probe(limit, "output too large", dtext.size(), html.size(), options.flags());
+      throw DTextLimitExceeded("output too large");
+    }
+  };
+
+  for (size_t start = 0, end; start < input.size(); start = end) {
+    std::string_view rest = input.substr(start);
+    end = next_paragraph(input, start);
+    size_t key = std::hash<std::string_view>{}(rest.substr(0, end - start)) ^ options_hash;
+
+    if (auto block = cache.find(key, options_hash, rest)) {
+      add_block(*block);
+      end = start + block->text.size() - block->next.length;
+      continue;
+    }
+
+    DTextOptions block_options = options;
+    block_options.max_output_bytes = options.max_output_bytes ? std::max(options.max_output_bytes - std::min(html.size(), options.max_output_bytes), size_t(1)) + skip.html_size : 0;
+
+    BlockCache::Block block;
+    block.options_hash = options_hash;
+    StateMachine sm(block_options, [&](std::string_view output) { block.html += output; });
+    sm.deadline = deadline;
+
+    // Feed paragraphs (plus the start of the next one) until the parser is in the same state as a new parser would be.
+    size_t pos = start;
+    while (end != std::string_view::npos) {
+      sm.feed(input.substr(pos, end + 1 - pos));
+      bool synced = sm.sync_block_start(input.substr(end), block.next);
+      pos = end + block.next.length;
+
+      if (synced) {
+        break;
+      }
+
+      end = next_paragraph(input, end);
+    }
+
+    if (end == std::string_view::npos) {
+      sm.feed(input.substr(pos));
+      sm.finish();
+      end = input.size();
+      block.next = {};
+    }
+
+    block.text = std::string(input.substr(start, pos - start));
+    block.creators.assign(sm.creators.begin(), sm.creators.end());
+    block.posts = std::move(sm.posts);
+    block.qtags = std::move(sm.qtags);
+    add_block(block);
+
+    // The last block was parsed up to the end of the document rather than the start of the next block, so it's only
+    // valid there.
+    if (end != input.size()) {
+      cache.insert(key, std::move(block));
+    }
+  }
+
+  g_probe(parse__done, dtext.size(), html.size(), options.flags());
+  return result;
+}
+
+// A fast 128-bit hash (two 64-bit lanes, each finished with the MurmurHash3 finalizer). It's not cryptographic: inputs
+// that collide can be crafted, so a cache that uses it as a key must still compare the input it was given.
+static RenderCache::Key hash128(const std::string_view data, uint64_t seed) {
+  auto rotl = [](uint64_t x, int r) { return (x << r) | (x >> (64 - r)); };
+  auto fmix = [](uint64_t k) {
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+  };
+
+  uint64_t a = seed ^ 0x9e3779b97f4a7c15ULL, b = seed ^ 0xc2b2ae3d27d4eb4fULL;
+  size_t i = 0;
+
+  for (; i + 8 <= data.size(); i += 8) {
+    uint64_t word;
+    memcpy(&word, data.data() + i, 8);
+    a = rotl((a ^ word) * 0x87c37b91114253d5ULL, 31);
+    b = rotl((b ^ word) * 0x4cf5ad432745937fULL, 33) + a;
+  }
+
+  uint64_t tail = 0;
+  memcpy(&tail, data.data() + i, data.size() - i);
+  a = rotl((a ^ tail) * 0x87c37b91114253d5ULL, 31) ^ data.size();
+  b = rotl((b ^ tail) * 0x4cf5ad432745937fULL, 33) + a;
+
+  return { fmix(a + b), fmix(b ^ rotl(a, 17)) };
+}
+
+// Enable the cache with the given size, or disable it if max_bytes is 0. The version is part of every key, so that
+// output from another version of the parser is never returned.
+void RenderCache::configure(size_t max_bytes, const std::string_view version) {
+  clear();
+  seed = hash128(version, DTEXT_IR_VERSION).lo;
+  this->max_bytes = max_bytes;
+}
+
+// The cache key of a document parsed with the given options (see DTextOptions::fingerprint), by a parser with the given
+// version seed.
+static RenderCache::Key render_cache_key(const std::string_view dtext, const std::string_view fingerprint, uint64_t seed) {
+  auto key = hash128(fingerprint, seed);
+  return hash128(dtext, key.lo ^ key.hi);
+}
+
+// Parse the document, or return its cached output. On a miss, the shared cache is tried next, if one is given. An entry
+// is only returned if its input and options are the same as the document's, so a hash collision is just a miss.
+StateMachine::ParseResult RenderCache::parse(const std::string_view dtext, const DTextOptions& options, SharedRenderCache* shared) {
+  auto fingerprint = options.fingerprint();
+  auto key = render_cache_key(dtext, fingerprint, seed);
+  auto& shard = shards[key.lo % SHARDS];
+
+  {
+    std::lock_guard lock(shard.mutex);
+
+    if (auto it = shard.index.find(key); it != shard.index.end() && it->second->dtext == dtext && it->second->fingerprint == fingerprint) {
+      hits++;
+      shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+      auto result = it->second->result;
+
+      if (options.max_output_bytes && std::get<0>(result).size() > options.max_output_bytes) {
+        g_probe(limit, "output too large", dtext.size(), std::get<0>(result).size(), options.flags());
+        throw DTextLimitExceeded("output too large");
+      }
+
+      return result;
+    }
+  }
+
+  misses++;
+  auto result = shared ? shared->parse(dtext, options) : StateMachine::parse_dtext(dtext, options);
+  Entry entry = { key, std::string(dtext), std::move(fingerprint), result };
+  size_t size = entry_size(entry);
+
+  std::lock_guard lock(shard.mutex);
+
+  if (shard.index.contains(key) || size > max_bytes / SHARDS) {
+    return result;
+  }
+
+  shard.lru.push_front(std::move(entry));
+  shard.index[key] = shard.lru.begin();
+  shard.bytes += size;
+
+  while (shard.bytes > max_bytes / SHARDS) {
+    auto& oldest = shard.lru.back();
+    shard.bytes -= entry_size(oldest);
+    shard.index.erase(oldest.key);
+    shard.lru.pop_back();
+    evictions++;
+  }
+
+  return result;
+}
+
+void RenderCache::clear() {
+  for (auto& shard : shards) {
+    std::lock_guard lock(shard.mutex);
+    shard.lru.clear();
+    shard.index.clear();
+    shard.bytes = 0;
+  }
+}
+
+// The number of entries and the number of bytes they take up.
+std::pair<size_t, size_t> RenderCache::size() {
+  size_t entries = 0, bytes = 0;
+
+  for (auto& shard : shards) {
+    std::lock_guard lock(shard.mutex);
+    entries += shard.lru.size();
+    bytes += shard.bytes;
+  }
+
+  return { entries, bytes };
+}
+
+// Roughly how much memory an entry uses.
+size_t RenderCache::entry_size(const Entry& entry) {
+  auto& [html, creators, posts, qtags, truncated] = entry.result;
+  size_t size = sizeof(entry) + entry.dtext.size() + entry.fingerprint.size() + html.size() + posts.size() * sizeof(long);
+
+  for (auto& creator : creators) {
+    size += sizeof(creator) + creator.size();
+  }
+
+  for (auto& qtag : qtags) {
+    size += sizeof(qtag) + qtag.size();
+  }
+
+  return size;
+}
+
+// Documents are only split into segments of at least this size, so that smaller documents are parsed on one thread.
+static const size_t PARALLEL_MIN_SEGMENT_SIZE = 256 * 1024;
+
+// Parse a large document on up to `threads` threads. The document is split into segments at paragraph boundaries, and
+// each segment is parsed by a new parser as if it were a document of its own. A segment's output is only used if the
+// parser of the segment before it caught up with the segment's parser at the start of the segment (see
+// sync_block_start), since the segment was then parsed exactly as it would have been by one parser; otherwise, the
+// parser of the segment before it carries on through it. Either way, the output is the same as parse_dtext.
+StateMachine::ParseResult StateMachine::parse_parallel(const std::string_view dtext, const DTextOptions options, unsigned int threads, ParallelStats * stats) {
+  std::vector<size_t> starts = { 0 };
+  size_t segment_size = std::max(dtext.size() / std::max(threads, 1u), PARALLEL_MIN_SEGMENT_SIZE);
+
+  while (starts.size() < threads && starts.back() + segment_size < dtext.size()) {
+    size_t start = next_paragraph(dtext, starts.back() + segment_size);
+
+    if (start == std::string_view::npos) {
+      break;
+    }
+
+    starts.push_back(start);
+  }
+
+  if (starts.size() == 1 || options.max_visible_chars) {
+    return parse_dtext(dtext, options);
+  }
+
+  g_probe(parse__start, dtext.size(), options.flags());
+
+  struct Segment {
+    std::string html;
+    std::unique_ptr<StateMachine> sm;
+    std::exception_ptr error;
+  };
+
+  std::vector<Segment> segments(starts.size());
+  starts.push_back(dtext.size());
+  auto deadline = std::chrono::steady_clock::now() + options.timeout;
+
+  // Parse each segment up to and including the first character of the next one.
+  auto parse_segment = [&](size_t i) {
+    auto& segment = segments[i];
+
+    try {
+      segment.sm = std::make_unique<StateMachine>(options, [&segment](std::string_view output) { segment.html += output; });
+      segment.sm->deadline = deadline;
+
+      if (i + 1 < segments.size()) {
+        segment.sm->feed(dtext.substr(starts[i], starts[i + 1] + 1 - starts[i]));
+      } else {
+        segment.sm->feed(dtext.substr(starts[i]));
+        segment.sm->finish();
+      }
+    } catch (...) {
+      // Errors are only raised if the segment's output is used, since they may not happen in a serial parse.
+      segment.error = std::current_exception();
+    }
+  };
+
+  std::vector<std::thread> workers;
+  for (size_t i = 1; i < segments.size(); i++) {
+    workers.emplace_back(parse_segment, i);
+  }
+
+  parse_segment(0);
+
+  for (auto& worker : workers) {
+    worker.join();
+  }
+
+  ParseResult result;
+  auto& [html, creators, posts, qtags, truncated] = result;
+
+  // The output of the next segment's parser that's already in the output of the segment before it.
+  BlockStart skip;
+
+  for (size_t i = 0, next; i < segments.size(); i = next) {
+    auto& segment = segments[i];
+    BlockStart segment_skip = skip;
+    skip = {};
+
+    if (segment.error) {
+      std::rethrow_exception(segment.error);
+    }
+
+    for (next = i + 1; next < segments.size(); next++) {
+      BlockStart start;
+
+      if (segment.sm->sync_block_start(dtext.substr(starts[next]), start)) {
+        skip = start;
+        break;
+      }
+
+      size_t pos = starts[next] + start.length;
+
+      if (next + 1 < segments.size()) {
+        segment.sm->feed(dtext.substr(pos, starts[next + 1] + 1 - pos));
+      } else {
+        segment.sm->feed(dtext.substr(pos));
+        segment.sm->finish();
+      }
+    }
+
+    if (stats && next < segments.size()) {
+      stats->reused++;
+    }
+
+    html.append(segment.html, segment_skip.html_size);
+    creators.merge(segment.sm->creators);
+    posts.insert(posts.end(), segment.sm->posts.begin() + segment_skip.posts_size, segment.sm->posts.end());
+    qtags.insert(qtags.end(), segment.sm->qtags.begin() + segment_skip.qtags_size, segment.sm->qtags.end());
+
+    if (options.max_output_bytes && html.size() > options.max_output_bytes) {
+      g_probe(limit, "output too large", dtext.size(), html.size(), options.flags());
+      throw DTextLimitExceeded("output too large");
+    }
+  }
+
+  if (stats) {
+    stats->segments += segments.size() - 1;
+  }
+
+  g_probe(parse__done, dtext.size(), html.size(), options.flags());
+  return result;
+}
+
+// Collects the visible text of a document, with runs of whitespace (and the breaks between blocks) collapsed to a single
+// space.
+class PlainTextRenderer : public DTextEventHandler {
+public:
+  std::string text;
+  bool spoilers;
+
+  PlainTextRenderer(bool spoilers) : spoilers(spoilers) {}
+
+  void on_open(element_t element, const std::map<std::string_view, std::string_view>& attributes) override {
+    if (element == BLOCK_SPOILER || element == INLINE_SPOILER) {
+      spoiler_depth++;
+    }
+
+    if (element < INLINE) {
+      pending_space = true;
+    }
+  }
+
+  void on_close(element_t element) override {
+    if (element == BLOCK_SPOILER || element == INLINE_SPOILER) {
+      spoiler_depth--;
+    }
+
+    if (element < INLINE) {
+      pending_space = true;
+    }
+  }
+
+  void on_text(const std::string_view string) override {
+    if (spoilers || spoiler_depth == 0) {
+      append(string);
+    }
+  }
+
+  void on_link(link_t kind, const std::string_view url, const std::string_view title) override {
+    on_text(title);
+  }
+
+  void on_qtag(const std::string_view name) override {
+    if (spoilers || spoiler_depth == 0) {
+      append("#");
+      append(name);
+    }
+  }
+
+private:
+  int spoiler_depth = 0;
+  bool pending_space = false;
+
+  void append(const std::string_view string) {
+    for (const char c : string) {
+      if (c == ' ' || c == '\n' || c == '\t' || c == '\r') {
+        pending_space = true;
+      } else {
+        if (pending_space && !text.empty()) {
+          text += ' ';
+        }
+
+        pending_space = false;
+        text += c;
+      }
+    }
+  }
+};
+
+// Return the visible text of the document, without any markup (used for search indexing). Text inside spoilers is
+// only included if `spoilers` is true.
+std::string StateMachine::plain_text(const std::string_view dtext, const DTextOptions options, bool spoilers) {
+  PlainTextRenderer renderer(spoilers);
+  StateMachine sm(dtext, dtext_en_main, options);
+  sm.events = &renderer;
+  sm.discard_output = true;
+  sm.parse();
+
+  return std::move(renderer.text);
+}
+
+static const std::string_view IR_MAGIC = "DTIR";
+
+static void append_varint(std::string& ir, size_t n) {
+  while (n >= 0x80) {
+    ir += static_cast<char>((n & 0x7F) | 0x80);
+    n >>= 7;
+  }
+
+  ir += static_cast<char>(n);
+}
+
+// Reads the ops written by StateMachine::compile.
+struct IRReader {
+  std::string_view ir;
+
+  bool done() const {
+    return ir.empty();
+  }
+
+  unsigned char byte() {
+    if (ir.empty()) {
+      throw DTextError("invalid IR");
+    }
+
+    unsigned char c = ir.front();
+    ir.remove_prefix(1);
+    return c;
+  }
+
+  size_t varint() {
+    size_t n = 0;
+
+    for (int shift = 0; shift < 64; shift += 7) {
+      unsigned char c = byte();
+      n |= static_cast<size_t>(c & 0x7F) << shift;
+
+      if (!(c & 0x80)) {
+        return n;
+      }
+    }
+
+    throw DTextError("invalid IR");
+  }
+
+  std::string_view string() {
+    size_t size = varint();
+
+    if (size > ir.size()) {
+      throw DTextError("invalid IR");
+    }
+
+    auto string = ir.substr(0, size);
+    ir.remove_prefix(size);
+    return string;
+  }
+};
+
+// Switch the kind of output being appended while compiling. The output collected so far is written out as one op.
+void StateMachine::ir_begin(ir_op_t op) {
+  if (op != ir_segment) {
+    ir_flush();
+    ir_segment = op;
+  }
+}
+
+void StateMachine::ir_flush() {
+  if (!output.empty()) {
+    ir += ir_segment;
+    append_varint(ir, output.size());
+    ir += output;
+    output.clear();
+  }
+}
+
+// Write an op whose output depends on the render options, to be rendered later.
+void StateMachine::ir_emit(ir_op_t op, std::initializer_list<std::string_view> operands) {
+  ir_flush();
+  ir += op;
+
+  for (auto operand : operands) {
+    append_varint(ir, operand.size());
+    ir += operand;
+  }
+}
+
+// Parse the input into IR that can be rendered many times with render(). The IR is the HTML, except that the parts
+// that depend on base_url, domain, internal_domains or f_inline are left to be filled in when it's rendered. f_qtags and
+// f_allow_color change how the input is parsed, so they're fixed when the IR is compiled.
+std::string StateMachine::compile(const std::string_view dtext, const DTextOptions options) {
+  StateMachine sm(dtext, dtext_en_main, options);
+  sm.compiling = true;
+
+  sm.ir.reserve(dtext.size() * 1.5);
+  sm.ir += IR_MAGIC;
+  append_varint(sm.ir, DTEXT_IR_VERSION);
+  sm.ir += static_cast<char>((options.f_qtags ? 1 : 0) | (options.f_allow_color ? 2 : 0));
+
+  sm.parse();
+  sm.ir_flush();
+
+  return sm.ir;
+}
+
+// Render IR from compile(). Only base_url, domain, internal_domains, f_inline and the output limits are used.
+StateMachine::ParseResult StateMachine::render(const std::string_view ir, const DTextOptions options) {
+  StateMachine sm(std::string_view(), dtext_en_main, options);
+  IRReader reader { ir };
+
+  if (!ir.starts_with(IR_MAGIC)) {
+    throw DTextError("invalid IR");
+  }
+
+  reader.ir.remove_prefix(IR_MAGIC.size());
+
+  if (reader.varint() != DTEXT_IR_VERSION) {
+    throw DTextStaleIR("IR was compiled by a different version of DText");
+  }
+
+  reader.byte(); // f_qtags and f_allow_color
+  sm.output.reserve(ir.size());
+
+  while (!reader.done()) {
+    switch (reader.byte()) {
+      case IR_TEXT: sm.append(reader.string()); break;
+      case IR_BLOCK: sm.append_block(reader.string()); break;
+      case IR_INLINE: {
+        auto text = reader.string();
+
+        if (options.f_inline) {
+          sm.append(text);
+        }
+
+        break;
+      }
+      case IR_BASE_URL: {
+        if (!options.base_url.empty()) {
+          sm.append_html_escaped(options.base_url);
+        }
+
+        break;
+      }
+      case IR_UNNAMED_URL: sm.append_unnamed_url(reader.string()); break;
+      case IR_NAMED_URL: {
+        auto url = reader.string();
+        auto title = reader.string();
+        auto parsed_title = reader.string();
+        sm.append_named_url(url, title, parsed_title);
+        break;
+      }
+      case IR_POST: {
+        auto id = reader.string();
+        long post_id = 0;
+        std::from_chars(id.data(), id.data() + id.size(), post_id);
+        sm.posts.push_back(post_id);
+        break;
+      }
+      case IR_CREATOR: sm.creators.insert(std::string(reader.string())); break;
+      case IR_QTAG: sm.qtags.push_back(std::string(reader.string())); break;
+      default: throw DTextError("invalid IR");
+    }
+  }
+
+  return { sm.output, sm.creators, sm.posts, sm.qtags, false };
+}
+
+// The layout of a shared render cache file: the Header, then the table of Slots, then the arena.
+struct SharedRenderCache::Header {
+  char magic[8];
+  uint64_t seed;       // The version of the parser that created the file. A file from another version is replaced.
+  uint64_t size;       // The size of the whole file.
+  uint64_t slot_count; // A power of two.
+  uint64_t arena_size;
+  uint64_t head;       // The number of bytes ever appended to the arena; the next entry goes at head % arena_size.
+};
+
+// A slot of the hash table. The fields are only valid if `seq` is even and hasn't changed while they were read.
+struct SharedRenderCache::Slot {
+  uint64_t seq;        // Odd while the slot is being written (see shared_lock).
+  uint64_t key_lo;
+  uint64_t key_hi;
+  uint64_t position;   // Where the entry was appended to the arena (as in Header::head).
+  uint64_t length;     // 0 if the slot is empty.
+};
+
+// Each entry in the arena is an entry header followed by the input and options fingerprint it was parsed from (which
+// are compared on every hit, since the key is only a hash of them) and the serialized ParseResult.
+struct SharedEntryHeader {
+  uint64_t key_lo;
+  uint64_t key_hi;
+  uint64_t checksum;
+  uint64_t length;     // Including this header.
+};
+
+static const char SHARED_CACHE_MAGIC[8] = { 'D', 'T', 'S', 'H', 'C', 'A', 'C', '2' };
+static const size_t SHARED_CACHE_PROBES = 8;            // How many slots a key can be in.
+static const size_t SHARED_CACHE_BYTES_PER_SLOT = 1024; // The table has one slot for every this many bytes of the file.
+static const uint64_t SHARED_CACHE_LOCK_TIMEOUT = 10;   // Seconds after which a slot that's still locked is taken over.
+
+static uint64_t shared_load(uint64_t& field, std::memory_order order = std::memory_order_relaxed) {
+  return std::atomic_ref(field).load(order);
+}
+
+static void shared_store(uint64_t& field, uint64_t value, std::memory_order order = std::memory_order_relaxed) {
+  std::atomic_ref(field).store(value, order);
+}
+
+// The time a slot is locked at, in seconds. It's compared between processes, so it's the wall clock.
+static uint64_t shared_lock_time() {
+  return std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+// A slot is locked for writing by setting its seq to an odd value holding the time it was locked at, and unlocked by
+// setting it to the next even value. A process that crashes while it's writing a slot leaves it locked, so a lock
+// that's older than SHARED_CACHE_LOCK_TIMEOUT (or too far in the future, after the clock was set back) is stale and can
+// be taken over. If that ever takes over a live writer's lock, the slot may end up with fields from both, which find()
+// treats as a miss like any other damaged slot.
+static bool shared_lock_stale(uint64_t seq, uint64_t now) {
+  uint64_t locked_at = seq >> 1;
+  return (seq & 1) && (locked_at + SHARED_CACHE_LOCK_TIMEOUT < now || locked_at > now + SHARED_CACHE_LOCK_TIMEOUT);
+}
+
+// Lock a slot whose seq was `seq`, if it hasn't changed since and it's unlocked or stale. Returns the value to unlock it
+// with, or 0 if it couldn't be locked.
+static uint64_t shared_lock(uint64_t& field, uint64_t seq, uint64_t now) {
+  if ((seq & 1) && !shared_lock_stale(seq, now)) {
+    return 0;
+  }
+
+  uint64_t lock = (now << 1) | 1;
+  if (!std::atomic_ref(field).compare_exchange_strong(seq, lock, std::memory_order_acq_rel)) {
+    return 0;
+  }
+
+  return (seq & 1) ? lock + 1 : seq + 2;
+}
+
+static void append_shared_string(std::string& out, const std::string_view string) {
+  append_varint(out, string.size());
+  out += string;
+}
+
+// A mapped cache file. The layout is copied from the header when the file is attached, and only the copies are used
+// after that, since another process could rewrite the header at any time.
+struct SharedRenderCache::Mapping {
+  std::string path;
+  void* addr;
+  size_t size;
+  uint64_t seed;
+  Header* header;
+  Slot* slots;
+  char* arena;
+  size_t slot_count;
+  size_t arena_size;
+
+  ~Mapping() { munmap(addr, size); }
+};
+
+SharedRenderCache::SharedRenderCache() = default;
+SharedRenderCache::~SharedRenderCache() = default;
+
+// Map the cache file, if it was created by this version of the parser with the configured size.
+std::unique_ptr<SharedRenderCache::Mapping> SharedRenderCache::attach(int fd, const std::string& path, size_t size, uint64_t seed) {
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size != size) {
+    return nullptr;
+  }
+
+  void* addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (addr == MAP_FAILED) {
+    return nullptr;
+  }
+
+  auto map = std::unique_ptr<Mapping>(new Mapping { path, addr, size, seed, static_cast<Header*>(addr), nullptr, nullptr, 0, 0 });
+  auto h = map->header;
+  Header copy;
+  memcpy(&copy, h, sizeof(copy));
+
+  if (memcmp(copy.magic, SHARED_CACHE_MAGIC, sizeof(copy.magic)) != 0 || copy.seed != seed || copy.size != size
+    || !std::has_single_bit(copy.slot_count) || copy.slot_count > size / sizeof(Slot) || copy.arena_size < MIN_SIZE / 2
+    || sizeof(Header) + copy.slot_count * sizeof(Slot) + copy.arena_size != size) {
+    return nullptr;
+  }
+
+  map->slot_count = copy.slot_count;
+  map->arena_size = copy.arena_size;
+  map->slots = reinterpret_cast<Slot*>(h + 1);
+  map->arena = reinterpret_cast<char*>(map->slots + map->slot_count);
+  return map;
+}
+
+// Open the cache file at `path`, creating it if it doesn't exist. If the file was created by another version of the
+// parser, or with another size, or is damaged, it's replaced by a new, empty file. Processes that still have the old
+// file open keep using it until they open the new one.
+void SharedRenderCache::open(const std::string& path, size_t size, const std::string_view version) {
+  std::lock_guard lock(mutex);
+  size = std::max(size, MIN_SIZE) & ~size_t(4095);
+  uint64_t seed = hash128(version, DTEXT_IR_VERSION).lo;
+
+  // If two processes replace the file at the same time, the one that loses the race opens the winner's file next time.
+  for (int attempt = 0; attempt < 3; attempt++) {
+    int fd = ::open(path.c_str(), O_RDWR | O_CLOEXEC);
+
+    if (fd >= 0) {
+      auto map = attach(fd, path, size, seed);
+      ::close(fd);
+
+      if (map) {
+        mapping = std::shared_ptr<Mapping>(std::move(map));
+        opened = true;
+        return;
+      }
+    } else if (errno != ENOENT) {
+      throw DTextError(path + ": " + strerror(errno));
+    }
+
+    // The temporary file must be a new file, so that a symlink or a file planted at its name isn't written through.
+    // A name that's taken (e.g. by a file left behind by a crashed process with the same pid) is skipped.
+    static std::atomic<uint64_t> temp_files = 0;
+    std::string temp_path;
+
+    do {
+      temp_path = path + "." + std::to_string(getpid()) + "." + std::to_string(temp_files++) + ".tmp";
+      fd = ::open(temp_path.c_str(), O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0644);
+    } while (fd < 0 && errno == EEXIST);
+
+    if (fd < 0) {
+      throw DTextError(temp_path + ": " + strerror(errno));
+    }
+
+    Header h = {};
+    memcpy(h.magic, SHARED_CACHE_MAGIC, sizeof(h.magic));
+    h.seed = seed;
+    h.size = size;
+    h.slot_count = std::bit_floor(size / SHARED_CACHE_BYTES_PER_SLOT);
+    h.arena_size = size - sizeof(Header) - h.slot_count * sizeof(Slot);
+
+    // The new file is filled in before it's renamed into place, so other processes never see it half-written.
+    bool written = ftruncate(fd, size) == 0 && pwrite(fd, &h, sizeof(h), 0) == sizeof(h);
+    int error = errno;
+    ::close(fd);
+
+    if (!written || rename(temp_path.c_str(), path.c_str()) != 0) {
+      error = written ? errno : error;
+      unlink(temp_path.c_str());
+      throw DTextError(path + ": " + strerror(error));
+    }
+  }
+
+  throw DTextError(path + ": couldn't open shared render cache");
+}
+
+void SharedRenderCache::close() {
+  std::lock_guard lock(mutex);
+  opened = false;
+  mapping = std::shared_ptr<Mapping>();
+}
+
+size_t SharedRenderCache::capacity() const {
+  auto map = mapping.load();
+  return map ? map->size : 0;
+}
+
+std::string SharedRenderCache::filename() const {
+  auto map = mapping.load();
+  return map ? map->path : "";
+}
+
+// Parse the document, or return its cached output.
+StateMachine::ParseResult SharedRenderCache::parse(const std::string_view dtext, const DTextOptions& options) {
+  auto map = mapping.load();
+  if (!map) {
+    return StateMachine::parse_dtext(dtext, options);
+  }
+
+  auto fingerprint = options.fingerprint();
+  auto key = render_cache_key(dtext, fingerprint, map->seed);
+  StateMachine::ParseResult result;
+
+  if (find(*map, key, dtext, fingerprint, result)) {
+    hits++;
+
+    if (options.max_output_bytes && std::get<0>(result).size() > options.max_output_bytes) {
+      g_probe(limit, "output too large", dtext.size(), std::get<0>(result).size(), options.flags());
+      throw DTextLimitExceeded("output too large");
+    }
+
+    return result;
+  }
+
+  misses++;
+  result = StateMachine::parse_dtext(dtext, options);
+  insert(*map, key, dtext, fingerprint, result);
+  return result;
+}
+
+bool SharedRenderCache::find(const Mapping& map, const RenderCache::Key& key, const std::string_view dtext, const std::string_view fingerprint, StateMachine::ParseResult& result) {
+  auto [header, slots, arena, arena_size] = std::tuple(map.header, map.slots, map.arena, map.arena_size);
+  size_t mask = map.slot_count - 1;
+
+  for (size_t i = 0; i < SHARED_CACHE_PROBES; i++) {
+    Slot& slot = slots[(key.lo + i) & mask];
+    uint64_t seq = shared_load(slot.seq, std::memory_order_acquire);
+    uint64_t key_lo = shared_load(slot.key_lo);
+    uint64_t key_hi = shared_load(slot.key_hi);
+    uint64_t position = shared_load(slot.position);
+    uint64_t length = shared_load(slot.length);
+    std::atomic_thread_fence(std::memory_order_acquire);
+
+    if ((seq & 1) || shared_load(slot.seq) != seq) {
+      continue;
+    } else if (length == 0) {
+      return false;
+    } else if (key_lo != key.lo || key_hi != key.hi) {
+      continue;
+    }
+
+    // The entry is gone if the arena has wrapped around past it since it was written. It's checked again after it's
+    // copied, in case it was overwritten while it was being copied.
+    auto overwritten = [&]() { return shared_load(header->head, std::memory_order_acquire) > position + arena_size; };
+    if (length < sizeof(SharedEntryHeader) || length > arena_size || position % arena_size + length > arena_size || overwritten()) {
+      return false;
+    }
+
+    std::string entry(length, '\0');
+    memcpy(entry.data(), arena + position % arena_size, length);
+    std::atomic_thread_fence(std::memory_order_acquire);
+
+    SharedEntryHeader entry_header;
+    memcpy(&entry_header, entry.data(), sizeof(entry_header));
+    std::string_view payload = std::string_view(entry).substr(sizeof(entry_header));
+
+    if (overwritten() || entry_header.key_lo != key.lo || entry_header.key_hi != key.hi || entry_header.length != length || entry_header.checksum != hash128(payload, key.lo).lo) {
+      return false;
+    }
+
+    try {
+      IRReader reader = { payload };
+      auto& [html, creators, posts, qtags, truncated] = result;
+
+      if (reader.string() != dtext || reader.string() != fingerprint) {
+        return false;
+      }
+
+      html = reader.string();
+      truncated = reader.byte();
+
+      for (size_t n = reader.varint(); n > 0; n--) {
+        creators.insert(std::string(reader.string()));
+      }
+
+      for (size_t n = reader.varint(); n > 0; n--) {
+        posts.push_back(reader.varint());
+      }
+
+      for (size_t n = reader.varint(); n > 0; n--) {
+        qtags.push_back(std::string(reader.string()));
+      }
+
+      return true;
+    } catch (DTextError&) {
+      result = {};
+      return false;
+    }
+  }
+
+  return false;
+}
+
+void SharedRenderCache::insert(const Mapping& map, const RenderCache::Key& key, const std::string_view dtext, const std::string_view fingerprint, const StateMachine::ParseResult& result) {
+  auto [header, slots, arena, arena_size] = std::tuple(map.header, map.slots, map.arena, map.arena_size);
+  auto& [html, creators, posts, qtags, truncated] = result;
+
+  std::string payload;
+  append_shared_string(payload, dtext);
+  append_shared_string(payload, fingerprint);
+  append_shared_string(payload, html);
+  payload += static_cast<char>(truncated);
+
+  append_varint(payload, creators.size());
+  for (auto& creator : creators) {
+    append_shared_string(payload, creator);
+  }
+
+  append_varint(payload, posts.size());
+  for (long post : posts) {
+    append_varint(payload, post);
+  }
+
+  append_varint(payload, qtags.size());
+  for (auto& qtag : qtags) {
+    append_shared_string(payload, qtag);
+  }
+
+  SharedEntryHeader entry_header = { key.lo, key.hi, hash128(payload, key.lo).lo, sizeof(SharedEntryHeader) + payload.size() };
+  size_t length = (entry_header.length + 7) & ~size_t(7);
+
+  if (length > arena_size / 16) {
+    return;
+  }
+
+  // An entry that would run past the end of the arena isn't written; the next one starts at the beginning again.
+  uint64_t position = std::atomic_ref(header->head).fetch_add(length, std::memory_order_acq_rel);
+  if (position % arena_size + length > arena_size) {
+    return;
+  }
+
+  memcpy(arena + position % arena_size, &entry_header, sizeof(entry_header));
+  memcpy(arena + position % arena_size + sizeof(entry_header), payload.data(), payload.size());
+
+  // Use the first empty slot (or stale locked slot), or the slot already holding this key, or else the slot holding the
+  // oldest entry.
+  size_t mask = map.slot_count - 1;
+  uint64_t now = shared_lock_time();
+  Slot* victim = nullptr;
+  uint64_t victim_seq = 0, victim_position = 0;
+
+  for (size_t i = 0; i < SHARED_CACHE_PROBES; i++) {
+    Slot& slot = slots[(key.lo + i) & mask];
+    uint64_t seq = shared_load(slot.seq, std::memory_order_acquire);
+    uint64_t key_lo = shared_load(slot.key_lo);
+    uint64_t key_hi = shared_load(slot.key_hi);
+    uint64_t slot_position = shared_load(slot.position);
+    uint64_t slot_length = shared_load(slot.length);
+    std::atomic_thread_fence(std::memory_order_acquire);
+
+    if (shared_lock_stale(seq, now)) {
+      victim = &slot;
+      victim_seq = seq;
+      break;
+    } else if ((seq & 1) || shared_load(slot.seq) != seq) {
+      continue;
+    } else if (slot_length == 0 || (key_lo == key.lo && key_hi == key.hi)) {
+      victim = &slot;
+      victim_seq = seq;
+      break;
+    } else if (!victim || slot_position < victim_position) {
+      victim = &slot;
+      victim_seq = seq;
+      victim_position = slot_position;
+    }
+  }
+
+  // If another process is writing the same slot, this entry is dropped rather than waiting for it.
+  uint64_t unlock = victim ? shared_lock(victim->seq, victim_seq, now) : 0;
+  if (!unlock) {
+    return;
+  }
+
+  std::atomic_thread_fence(std::memory_order_release);
+  shared_store(victim->key_lo, key.lo);
+  shared_store(victim->key_hi, key.hi);
+  shared_store(victim->position, position);
+  shared_store(victim->length, entry_header.length);
+  shared_store(victim->seq, unlock, std::memory_order_release);
+  inserts++;
+}
+
+// Empty the table, for every process using the file.
+void SharedRenderCache::clear() {
+  auto map = mapping.load();
+  uint64_t now = shared_lock_time();
+
+  for (size_t i = 0; map && i < map->slot_count; i++) {
+    Slot& slot = map->slots[i];
+
+    if (uint64_t unlock = shared_lock(slot.seq, shared_load(slot.seq, std::memory_order_acquire), now)) {
+      std::atomic_thread_fence(std::memory_order_release);
+      shared_store(slot.length, 0);
+      shared_store(slot.seq, unlock, std::memory_order_release);
+    }
+  }
+}
+
+// The number of entries in the table and the number of bytes of the arena in use.
+std::pair<size_t, size_t> SharedRenderCache::size() const {
+  auto map = mapping.load();
+  if (!map) {
+    return { 0, 0 };
+  }
+
+  size_t entries = 0;
+  for (size_t i = 0; i < map->slot_count; i++) {
+    entries += shared_load(map->slots[i].length) != 0;
+  }
+
+  return { entries, std::min<size_t>(shared_load(map->header->head), map->arena_size) };
+}
+
+ParseStats::ParseStats() : shards(new Shard[SHARDS]) {}
+
+size_t ParseStats::bucket(uint64_t ns) {
+  ns = std::min<uint64_t>(ns, (uint64_t(1) << MAX_LATENCY_BITS) - 1);
+
+  // Latencies below 2^(SUB_BUCKET_BITS + 1) ns get a bucket each; above that, each power of two is split into
+  // 2^SUB_BUCKET_BITS buckets, by the bits after the leading one.
+  if (ns < (1 << (SUB_BUCKET_BITS + 1))) {
+    return ns;
+  }
+
+  size_t exponent = std::bit_width(ns) - 1;
+  size_t mantissa = ns >> (exponent - SUB_BUCKET_BITS);
+  return ((exponent - SUB_BUCKET_BITS + 1) << SUB_BUCKET_BITS) + mantissa - (1 << SUB_BUCKET_BITS);
+}
+
+uint64_t ParseStats::bucket_floor(size_t bucket) {
+  size_t group = bucket >> SUB_BUCKET_BITS;
+  uint64_t mantissa = bucket & ((1 << SUB_BUCKET_BITS) - 1);
+  return group == 0 ? mantissa : ((1 << SUB_BUCKET_BITS) + mantissa) << (group - 1);
+}
+
+double ParseStats::Histogram::percentile(double p) const {
+  if (count == 0) {
+    return 0;
+  }
+
+  uint64_t rank = std::max<uint64_t>(1, std::ceil(p * count));
+  uint64_t seen = 0;
+
+  for (size_t i = 0; i < BUCKETS; i++) {
+    seen += buckets[i];
+
+    if (seen >= rank) {
+      // The middle of the bucket, which is within half a bucket's width of any latency in it.
+      double middle = (bucket_floor(i) + (i + 1 < BUCKETS ? bucket_floor(i + 1) : bucket_floor(i))) / 2.0;
+      return std::min<double>(middle, max_ns);
+    }
+  }
+
+  return max_ns;
+}
+
+void ParseStats::Histogram::merge(const Histogram& other) {
+  count += other.count;
+  sum_ns += other.sum_ns;
+  max_ns = std::max(max_ns, other.max_ns);
+
+  for (size_t i = 0; i < BUCKETS; i++) {
+    buckets[i] += other.buckets[i];
+  }
+}
+
+ParseStats::Counters& ParseStats::counters(const DTextOptions& options, size_t bytes_in, std::chrono::nanoseconds latency) {
+  static std::atomic<size_t> next_shard = 0;
+  thread_local size_t shard = next_shard++ % SHARDS;
+
+  size_t size_class = std::find_if(std::begin(SIZE_CLASS_MAX_BYTES), std::end(SIZE_CLASS_MAX_BYTES), [&](size_t max) { return bytes_in <= max; }) - std::begin(SIZE_CLASS_MAX_BYTES);
+  Counters& counters = shards[shard].series[size_class * OPTION_SETS + options.flags()];
+
+  uint64_t ns = std::max<int64_t>(latency.count(), 0);
+  counters.buckets[bucket(ns)].fetch_add(1, std::memory_order_relaxed);
+  counters.sum_ns.fetch_add(ns, std::memory_order_relaxed);
+  counters.bytes_in.fetch_add(bytes_in, std::memory_order_relaxed);
+  counters.parses.fetch_add(1, std::memory_order_relaxed);
+
+  uint64_t max = counters.max_ns.load(std::memory_order_relaxed);
+  while (ns > max && !counters.max_ns.compare_exchange_weak(max, ns, std::memory_order_relaxed)) {}
+
+  return counters;
+}
+
+void ParseStats::record(const DTextOptions& options, size_t bytes_in, size_t bytes_out, std::chrono::nanoseconds latency) {
+  counters(options, bytes_in, latency).bytes_out.fetch_add(bytes_out, std::memory_order_relaxed);
+}
+
+void ParseStats::record_error(const DTextOptions& options, size_t bytes_in, std::string_view error, std::chrono::nanoseconds latency) {
+  counters(options, bytes_in, latency).errors.fetch_add(1, std::memory_order_relaxed);
+
+  std::lock_guard lock(mutex);
+  auto it = errors.find(std::string(error));
+
+  if (it != errors.end()) {
+    it->second++;
+  } else if (errors.size() < MAX_ERROR_MESSAGES) {
+    errors.emplace(error, 1);
+  } else {
+    errors["other"]++;
+  }
+}
+
+ParseStats::Snapshot ParseStats::snapshot() const {
+  Snapshot snapshot;
+
+  for (size_t i = 0; i < SIZE_CLASSES * OPTION_SETS; i++) {
+    Series series;
+    series.size_class = i / OPTION_SETS;
+    series.option_set = i % OPTION_SETS;
+
+    for (size_t shard = 0; shard < SHARDS; shard++) {
+      const Counters& counters = shards[shard].series[i];
+      series.parses += counters.parses.load(std::memory_order_relaxed);
+      series.errors += counters.errors.load(std::memory_order_relaxed);
+      series.bytes_in += counters.bytes_in.load(std::memory_order_relaxed);
+      series.bytes_out += counters.bytes_out.load(std::memory_order_relaxed);
+      series.latency.sum_ns += counters.sum_ns.load(std::memory_order_relaxed);
+      series.latency.max_ns = std::max(series.latency.max_ns, counters.max_ns.load(std::memory_order_relaxed));
+
+      for (size_t bucket = 0; bucket < BUCKETS; bucket++) {
+        uint64_t n = counters.buckets[bucket].load(std::memory_order_relaxed);
+        series.latency.buckets[bucket] += n;
+        series.latency.count += n;
+      }
+    }
+
+    if (series.parses == 0) {
+      continue;
+    }
+
+    snapshot.parses += series.parses;
+    snapshot.errors += series.errors;
+    snapshot.bytes_in += series.bytes_in;
+    snapshot.bytes_out += series.bytes_out;
+    snapshot.latency.merge(series.latency);
+    snapshot.series.push_back(std::move(series));
+  }
+
+  std::lock_guard lock(mutex);
+  snapshot.errors_by_message = errors;
+  return snapshot;
+}
+
+void ParseStats::clear() {
+  for (size_t shard = 0; shard < SHARDS; shard++) {
+    for (auto& counters : shards[shard].series) {
+      for (auto* counter : { &counters.parses, &counters.errors, &counters.bytes_in, &counters.bytes_out, &counters.sum_ns, &counters.max_ns }) {
+        counter->store(0, std::memory_order_relaxed);
+      }
+
+      for (auto& bucket : counters.buckets) {
+        bucket.store(0, std::memory_order_relaxed);
+      }
+    }
+  }
+
+  std::lock_guard lock(mutex);
+  errors.clear();
+}
+
+SlowSamples::SlowSamples() {
+  for (size_t i = 0; i < CAPACITY; i++) {
+    cells[i].sequence.store(i, std::memory_order_relaxed);
+  }
+}
+
+SlowSamples::~SlowSamples() {
+  while (Sample* sample = pop()) {
+    delete sample;
+  }
+}
+
+void SlowSamples::configure(std::chrono::nanoseconds min_latency, double min_expansion, size_t max_input_bytes) {
+  this->min_latency_ns.store(min_latency.count(), std::memory_order_relaxed);
+  this->min_expansion.store(min_expansion, std::memory_order_relaxed);
+  this->max_input_bytes.store(max_input_bytes, std::memory_order_relaxed);
+}
+
+void SlowSamples::record(std::string_view dtext, const DTextOptions& options, std::chrono::nanoseconds latency, size_t bytes_out, std::string_view error) {
+  int64_t min_latency = min_latency_ns.load(std::memory_order_relaxed);
+  double expansion = min_expansion.load(std::memory_order_relaxed);
+  bool slow = min_latency > 0 && latency.count() >= min_latency;
+  bool expanded = expansion > 0 && bytes_out >= expansion * std::max<size_t>(dtext.size(), 1);
+  bool limited = !error.empty() && (min_latency > 0 || expansion > 0);
+
+  if (!slow && !expanded && !limited) {
+    return;
+  }
+
+  // Check before copying the input, so that a flood of slow parses doesn't copy inputs only to drop them.
+  if (tail.load(std::memory_order_relaxed) - head.load(std::memory_order_relaxed) >= CAPACITY) {
+    dropped.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+
+  size_t max_bytes = std::min(max_input_bytes.load(std::memory_order_relaxed), dtext.size());
+
+  // Don't cut a UTF-8 character in half, so that the sample stays valid input.
+  while (max_bytes > 0 && max_bytes < dtext.size() && (dtext[max_bytes] & 0xC0) == 0x80) {
+    max_bytes--;
+  }
+
+  auto sample = std::make_unique<Sample>();
+  sample->dtext = dtext.substr(0, max_bytes);
+  sample->truncated = dtext.size() > max_bytes;
+  sample->options = options;
+  sample->latency = latency;
+  sample->bytes_in = dtext.size();
+  sample->bytes_out = bytes_out;
+  sample->error = error;
+  sample->time = std::chrono::system_clock::now();
+
+  if (push(sample.get())) {
+    sample.release();
+    captured.fetch_add(1, std::memory_order_relaxed);
+  } else {
+    dropped.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+std::vector<std::unique_ptr<SlowSamples::Sample>> SlowSamples::drain() {
+  std::vector<std::unique_ptr<Sample>> samples;
+
+  while (Sample* sample = pop()) {
+    samples.emplace_back(sample);
+  }
+
+  return samples;
+}
+
+bool SlowSamples::push(Sample* sample) {
+  size_t position = tail.load(std::memory_order_relaxed);
+
+  while (true) {
+    Cell& cell = cells[position % CAPACITY];
+    intptr_t diff = (intptr_t)cell.sequence.load(std::memory_order_acquire) - (intptr_t)position;
+
+    if (diff == 0) {
+      if (tail.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+        cell.sample = sample;
+        cell.sequence.store(position + 1, std::memory_order_release);
+        return true;
+      }
+    } else if (diff < 0) {
+      return false; // Full: the cell hasn't been popped since the last lap.
+    } else {
+      position = tail.load(std::memory_order_relaxed);
+    }
+  }
+}
+
+SlowSamples::Sample* SlowSamples::pop() {
+  size_t position = head.load(std::memory_order_relaxed);
+
+  while (true) {
+    Cell& cell = cells[position % CAPACITY];
+    intptr_t diff = (intptr_t)cell.sequence.load(std::memory_order_acquire) - (intptr_t)(position + 1);
+
+    if (diff == 0) {
+      if (head.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+        Sample* sample = cell.sample;
+        cell.sequence.store(position + CAPACITY, std::memory_order_release);
+        return sample;
+      }
+    } else if (diff < 0) {
+      return nullptr; // Empty: the cell hasn't been pushed to in this lap.
+    } else {
+      position = head.load(std::memory_order_relaxed);
+    }
+  }
+}
+
+// Parse the whole input, and return the output (which stays owned by the state machine).
+std::string& StateMachine::parse() {
+  g_debug("parse '%.*s'", (int)(input.size() - 2), input.c_str() + 1);
+
+  %% write init nocs;
+
+  try {
+    scan();
+  } catch (DTextTruncated&) {
+    g_debug("truncated at %zu visible characters", visible_chars);
+    truncated = true;
+
+    // Put the ellipsis before any closing tags at the end, so that it's inside the element the text was cut off in
+    // (but after a link, rather than inside it).
+    size_t end = output.size();
+    while (end > 0 && output[end - 1] == '>') {
+      size_t start = output.rfind("</", end - 1);
+
+      if (start == std::string::npos || output.find('<', start + 1) < end || output.compare(start, end - start, "</a>") == 0) {
+        break;
+      }
+
+      end = start;
+    }
+
+    output.insert(end, "\u2026");
+
+    if (in_inline_code) {
+      append("</span>");
+    }
+  }
+
+  g_debug("EOF; closing stray blocks");
+  dstack_close_all();
+
+  if (events) {
+    flush_text();
+  }
+
+  g_debug("done");
+
+  return output;
+}
+
+void StateMachine::scan_window() {
+  g_profile_start();
+  %% write exec;
 }
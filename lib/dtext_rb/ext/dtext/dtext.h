@@ -3,9 +3,19 @@
 
 #include "url.h"
 
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <initializer_list>
+#include <list>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <stdexcept>
 #include <string>
+#include <unordered_map>
 #include <unordered_set>
 #include <vector>
 
@@ -89,10 +99,51 @@ static const char* element_names[] = {
 };
 #endif
 
+// The kinds of links reported to DTextEventHandler::on_link.
+typedef enum link_t {
+  LINK_EXTERNAL,    // "title":https://example.com, https://example.com. The URL is the link's URL.
+  LINK_INTERNAL,    // "title":/posts, or a URL on DTextOptions::domain. The URL is the link's URL.
+  LINK_ID,          // post #1234, topic #1234/p2, etc. The URL is the relative (or external) URL the ID links to.
+  LINK_CREATOR,     // [[name]]. The URL is the normalized creator name.
+  LINK_POST_SEARCH, // {{search}}. The URL is the search.
+  LINK_ANCHOR,      // [[#anchor]]. The URL is "#anchor".
+} link_t;
+
+// The version of the IR written by StateMachine::compile. Bump this whenever the grammar or the HTML it produces
+// changes, so that stored IR from an older version is detected and recompiled.
+#define DTEXT_IR_VERSION 2
+
+// IR ops. Each op is a byte followed by its operands, which are varint-prefixed strings.
+typedef enum ir_op_t : char {
+  IR_TEXT,         // HTML.
+  IR_BLOCK,        // HTML that's omitted in inline mode.
+  IR_INLINE,       // HTML that's only included in inline mode.
+  IR_BASE_URL,     // No operands; the base_url, if one is given.
+  IR_UNNAMED_URL,  // url
+  IR_NAMED_URL,    // url, title, title HTML
+  IR_POST,         // post id
+  IR_CREATOR,      // creator name
+  IR_QTAG,         // qtag name
+} ir_op_t;
+
 class DTextError : public std::runtime_error {
   using std::runtime_error::runtime_error;
 };
 
+// Raised when rendering IR compiled by a different version of the parser.
+class DTextStaleIR : public DTextError {
+  using DTextError::DTextError;
+};
+
+// Raised when a parse goes over one of the resource limits in DTextOptions.
+class DTextLimitExceeded : public DTextError {
+  using DTextError::DTextError;
+};
+
+// Thrown to stop parsing once DTextOptions::max_visible_chars is reached. It's caught by the parser, and never seen by
+// callers.
+struct DTextTruncated {};
+
 struct DTextOptions {
   // If false, strip block-level elements (used for displaying DText in small spaces).
   bool f_inline = false;
@@ -111,11 +162,118 @@ struct DTextOptions {
 
   // Links to these domains are converted to shortlinks (used so links to https://danbooru.donmai.us/posts/1234 are converted to post #1234).
   std::unordered_set<std::string> internal_domains;
+
+  // If nonzero, abort once the output grows past this many bytes (used to stop untrusted input from amplifying output).
+  size_t max_output_bytes = 0;
+
+  // If nonzero, abort once more than this many elements are open at the same time.
+  size_t max_dstack_depth = 0;
+
+  // If nonzero, abort once parsing has taken longer than this (used to stop untrusted input from starving a worker).
+  std::chrono::microseconds timeout{0};
+
+  // If nonzero, stop once the document has this many characters of visible text, close any open elements, and add an
+  // ellipsis (used for rendering excerpts of long documents).
+  size_t max_visible_chars = 0;
+
+  std::string fingerprint() const;
+
+  // f_inline, f_qtags and f_allow_color as bits 0, 1 and 2 (used to label stats and probes).
+  unsigned int flags() const {
+    return f_inline | f_qtags << 1 | f_allow_color << 2;
+  }
+};
+
+// Receives the structure of a document as it's parsed, without having to parse the HTML output again. Elements are
+// opened and closed in the same order as the HTML tags, and text is the unescaped text of the document.
+class DTextEventHandler {
+public:
+  virtual ~DTextEventHandler() = default;
+
+  virtual void on_open(element_t element, const std::map<std::string_view, std::string_view>& attributes) {}
+  virtual void on_close(element_t element) {}
+  virtual void on_text(const std::string_view text) {}
+  virtual void on_link(link_t kind, const std::string_view url, const std::string_view title) {}
+  virtual void on_qtag(const std::string_view name) {}
+};
+
+// Where a parser caught up with a new parser that started at the start of a block (see
+// StateMachine::sync_block_start): the number of characters of the block both had read, and how much output the new
+// parser had produced then (which is already in the first parser's output).
+struct BlockStart {
+  size_t length = 0;
+  size_t html_size = 0;
+  size_t posts_size = 0;
+  size_t qtags_size = 0;
+};
+
+// A bounded LRU cache of rendered blocks, used by StateMachine::parse_cached to avoid parsing the unchanged parts of a
+// document again (used to re-render live previews after a small edit).
+class BlockCache {
+public:
+  static const size_t MAX_BLOCKS_PER_KEY = 8; // Blocks that start with the same paragraph, e.g. after a common header.
+
+  struct Block {
+    size_t options_hash;
+    std::string text; // The block's DText, followed by the start of the next block (`next.length` characters).
+    BlockStart next;
+    std::string html;
+    std::vector<std::string> creators;
+    std::vector<long> posts;
+    std::vector<std::string> qtags;
+  };
+
+  const size_t max_bytes;
+  std::atomic<size_t> hits = 0;
+  std::atomic<size_t> misses = 0;
+
+  BlockCache(size_t max_bytes) : max_bytes(max_bytes) {}
+  std::shared_ptr<const Block> find(size_t key, size_t options_hash, const std::string_view text);
+  void insert(size_t key, Block block);
+  void clear();
+  std::pair<size_t, size_t> size();
+
+private:
+  struct Entry {
+    size_t key;
+    std::shared_ptr<const Block> block;
+    uint64_t last_used;
+  };
+
+  std::mutex mutex;
+  size_t bytes = 0;
+  uint64_t clock = 0;
+  std::list<Entry> lru; // Most recently used first.
+  std::unordered_multimap<size_t, decltype(lru)::iterator> index;
+
+  void evict(decltype(lru)::iterator it);
+};
+
+// The buffers used by a parse, kept between parses by a long-running caller (like a worker thread in dtextd) so that
+// they don't have to be allocated again for each document. StateMachine::parse_dtext(dtext, options, buffers) leaves
+// the result in output, creators, posts, qtags and truncated, which the next parse overwrites.
+struct ParseBuffers {
+  std::string input;
+  std::string output;
+  std::vector<int> stack;
+  std::vector<element_t> dstack;
+  std::unordered_set<std::string> creators;
+  std::vector<long> posts;
+  std::vector<std::string> qtags;
+  bool truncated = false;
+};
+
+// Counts of how StateMachine::parse_parallel split documents: the number of segments after the first, and how many of
+// them were parsed on their own thread and used as is (rather than parsed again by the parser of the segment before).
+struct ParallelStats {
+  std::atomic<size_t> segments = 0;
+  std::atomic<size_t> reused = 0;
 };
 
 class StateMachine {
 public:
   using TagAttributes = std::map<std::string_view, std::string_view>;
+  using Sink = std::function<void(std::string_view)>;
 
   const DTextOptions options;
 
@@ -144,17 +302,43 @@ public:
   const char * g2 = NULL;
   bool header_mode = false;
   TagAttributes tag_attributes;
+  std::chrono::steady_clock::time_point deadline;
+  unsigned int steps = 0;
+  Sink sink;
+  size_t flushed = 0; // The number of output bytes already passed to the sink.
+  bool pending_cr = false;
+  size_t visible_chars = 0; // The number of characters of visible text so far, if max_visible_chars is set.
+  bool truncated = false;
+  bool in_inline_code = false; // Inside `inline code`, which isn't on the dstack.
+  DTextEventHandler * events = NULL;
+  std::string event_text; // Text that hasn't been passed to the event handler yet.
+  bool discard_output = false; // If true, only the events are produced, not the HTML.
+  bool compiling = false;
+  ir_op_t ir_segment = IR_TEXT; // The kind of output currently being collected while compiling.
+  std::string ir;
 
   std::string input;
   std::string output;
   std::vector<int> stack;
   std::vector<element_t> dstack;
+  std::array<size_t, INLINE_NODTEXT + 1> dstack_counts = {}; // The number of times each element is open on the dstack.
   std::unordered_set<std::string> creators;
   std::vector<long> posts;
   std::vector<std::string> qtags;
 
-  using ParseResult = std::tuple<std::string, decltype(creators), decltype(posts), decltype(qtags)>;
-  static ParseResult parse_dtext(const std::string_view dtext, const DTextOptions options);
+  using ParseResult = std::tuple<std::string, decltype(creators), decltype(posts), decltype(qtags), bool>;
+  static ParseResult parse_dtext(const std::string_view dtext, const DTextOptions options, DTextEventHandler * events = NULL);
+  static void parse_dtext(const std::string_view dtext, const DTextOptions options, ParseBuffers& buffers);
+  static Sink fd_sink(int fd);
+  static std::string compile(const std::string_view dtext, const DTextOptions options);
+  static ParseResult render(const std::string_view ir, const DTextOptions options);
+  static std::string plain_text(const std::string_view dtext, const DTextOptions options, bool spoilers);
+  static ParseResult parse_cached(const std::string_view dtext, const DTextOptions options, BlockCache& cache);
+  static ParseResult parse_parallel(const std::string_view dtext, const DTextOptions options, unsigned int threads, ParallelStats * stats = NULL);
+
+  StateMachine(const DTextOptions options, Sink sink);
+  void feed(const std::string_view chunk);
+  void finish();
 
   std::string parse_inline(const std::string_view dtext);
   std::string parse_basic_inline(const std::string_view dtext);
@@ -175,6 +359,7 @@ public:
   bool dstack_close_element(element_t type, const std::string_view tag_name);
   void dstack_close_leaf_blocks();
 
+  void check_limits();
   void append(const auto c);
   void append(const std::string_view string);
   void append_html_escaped(char s);
@@ -183,19 +368,29 @@ public:
   void append_relative_url(const auto url);
   void append_block(const auto s);
   void append_block_html_escaped(const std::string_view string);
+  void append_text(const char c);
+  void append_text(const std::string_view text);
+  void append_line_break();
+  void append_inline_text(const char c);
+  void append_block_text(const std::string_view text);
+  void flush_text();
+  size_t count_visible_chars(const std::string_view text);
+  void emit_link(link_t kind, const std::string_view url, const std::string_view title);
 
   void append_header(char header, const std::string_view id);
   void append_qtag(const std::string_view name);
   void append_id_link(const char *title, const char *id_name, const char *url, const std::string_view id);
+  void append_thumb_link(const std::string_view id);
   void append_bare_unnamed_url(const std::string_view url);
   void append_unnamed_url(const std::string_view url);
   void append_internal_url(const DText::URL &url);
   void append_named_url(const std::string_view url, const std::string_view title);
+  void append_named_url(const std::string_view url, const std::string_view title, const std::string_view parsed_title);
   void append_bare_named_url(const std::string_view url, std::string_view title);
   void append_absolute_link(const std::string_view url, const std::string_view title, bool internal_url = false, bool escape_title = true);
   void append_post_search_link(const std::string_view prefix, const std::string_view search, const std::string_view title, const std::string_view suffix);
   void append_section(const std::string_view summary, bool initially_open);
-  void append_creator_link(const std::string_view prefix, const std::string_view tag, const std::string_view anchor, const std::string_view title, const std::string_view suffix);
+  void append_creator_link(const std::string_view prefix, const std::string_view tag, std::string_view anchor, const std::string_view title, const std::string_view suffix);
   void append_internal_anchor_link(const std::string_view prefix, const std::string_view anchor, const std::string_view title, const std::string_view suffix);
   void append_paged_link(const char *title, const std::string_view id, const char *tag, const char *href, const char *param, const std::string_view page);
   void append_dmail_key_link(const std::string_view dmail_id, const std::string_view dmail_key);
@@ -212,8 +407,292 @@ public:
   std::tuple<std::string_view, std::string_view> trim_url(const std::string_view url);
 
 private:
-  StateMachine(const auto string, int initial_state, const DTextOptions = {});
-  std::string parse();
+  // The parts of the parser's state that decide how the rest of the input is parsed: two parsers in the same state
+  // produce the same output from then on, given the same input. Pointers are offsets from the start of the current
+  // token (which is kept), or -1 if they belong to a token that has already ended. `act` is left out, since it's only
+  // read after it has been set by the current token, and the same token is scanned the same way by both parsers.
+  struct ScanState {
+    int cs = -1;
+    std::vector<int> stack;
+    std::vector<element_t> dstack;
+    std::string token;
+    std::array<std::ptrdiff_t, 15> pointers = {};
+    std::vector<std::pair<std::string, std::string>> tag_attributes;
+    bool header_mode = false;
+    bool in_inline_code = false;
+    bool pending_cr = false;
+
+    bool operator==(const ScanState&) const = default;
+  };
+
+  StateMachine(const auto string, int initial_state, const DTextOptions = {}, ParseBuffers * buffers = NULL);
+  std::string& parse();
+  void swap_buffers(ParseBuffers& buffers);
+  void scan();
+  void scan_window();
+  void buffer_input(const std::string_view chunk, bool last);
+  void buffer_chunk(std::string_view chunk, bool last);
+  void flush();
+  bool sync_block_start(const std::string_view block, BlockStart& start);
+  ScanState scan_state() const;
+  void ir_begin(ir_op_t op);
+  void ir_flush();
+  void ir_emit(ir_op_t op, std::initializer_list<std::string_view> operands);
 };
 
+// A cache of parse results, for short strings that are rendered over and over (e.g. common mod action texts). It's split
+// into shards with their own lock and LRU list, so that threads parsing different strings rarely wait for each other.
+class SharedRenderCache;
+
+class RenderCache {
+public:
+  static const size_t SHARDS = 16;
+  static const size_t MAX_INPUT_SIZE = 4096; // Longer strings aren't cached, since they're rarely the same twice.
+
+  struct Key {
+    uint64_t lo;
+    uint64_t hi;
+    bool operator==(const Key&) const = default;
+  };
+
+  std::atomic<size_t> hits = 0;
+  std::atomic<size_t> misses = 0;
+  std::atomic<size_t> evictions = 0;
+
+  void configure(size_t max_bytes, const std::string_view version);
+  bool enabled() const { return max_bytes > 0; }
+  StateMachine::ParseResult parse(const std::string_view dtext, const DTextOptions& options, SharedRenderCache* shared = nullptr);
+  void clear();
+  std::pair<size_t, size_t> size();
+  size_t capacity() const { return max_bytes; }
+
+private:
+  struct KeyHash {
+    size_t operator()(const Key& key) const { return key.hi; }
+  };
+
+  // The input and options are kept to be compared on every hit, since the key is only a hash of them.
+  struct Entry {
+    Key key;
+    std::string dtext;
+    std::string fingerprint;
+    StateMachine::ParseResult result;
+  };
+
+  struct Shard {
+    std::mutex mutex;
+    std::list<Entry> lru; // Most recently used first.
+    std::unordered_map<Key, decltype(lru)::iterator, KeyHash> index;
+    size_t bytes = 0;
+  };
+
+  std::atomic<size_t> max_bytes = 0;
+  std::atomic<uint64_t> seed = 0;
+  std::array<Shard, SHARDS> shards;
+
+  static size_t entry_size(const Entry& entry);
+};
+
+// A cache of the parse results of short strings in a memory-mapped file, shared by every process that opens the same
+// file (e.g. all the workers of a server). The file holds a fixed-size hash table of entries and an arena that the
+// rendered output is appended to; once the arena is full, it wraps around and overwrites the oldest output.
+//
+// Nothing in the file is trusted. Readers don't take locks: each slot of the table is a seqlock, and every entry in the
+// arena carries its key, its input and a checksum, so a read that races with a write (or that finds a slot pointing at
+// output that has since been overwritten, or a file left half-written by a crashed process) is treated as a miss.
+class SharedRenderCache {
+public:
+  static const size_t MAX_INPUT_SIZE = RenderCache::MAX_INPUT_SIZE;
+  static constexpr size_t MIN_SIZE = 1024 * 1024;
+
+  std::atomic<size_t> hits = 0;
+  std::atomic<size_t> misses = 0;
+  std::atomic<size_t> inserts = 0;
+
+  SharedRenderCache();
+  ~SharedRenderCache();
+
+  void open(const std::string& path, size_t size, const std::string_view version);
+  void close();
+  bool enabled() const { return opened; }
+  StateMachine::ParseResult parse(const std::string_view dtext, const DTextOptions& options);
+  void clear();
+  std::pair<size_t, size_t> size() const;
+  size_t capacity() const;
+  std::string filename() const;
+
+private:
+  struct Header;
+  struct Slot;
+  struct Mapping;
+
+  // The file in use, if any. Threads hold a reference to the file while they read it, so a file that's closed or
+  // replaced is unmapped when the last of them is done with it.
+  std::atomic<std::shared_ptr<Mapping>> mapping;
+  std::atomic<bool> opened = false; // Whether there's a file in use, checked without taking a reference to it.
+  std::mutex mutex;                 // Held while opening or closing a file.
+
+  static std::unique_ptr<Mapping> attach(int fd, const std::string& path, size_t size, uint64_t seed);
+  static bool find(const Mapping& map, const RenderCache::Key& key, const std::string_view dtext, const std::string_view fingerprint, StateMachine::ParseResult& result);
+  void insert(const Mapping& map, const RenderCache::Key& key, const std::string_view dtext, const std::string_view fingerprint, const StateMachine::ParseResult& result);
+};
+
+// Counters and latency histograms for every parse, cheap enough to leave on in production (used by DText.stats). Parses
+// are broken down by the size of the input and by the set of options, and each breakdown has a log-linear latency
+// histogram with 8 buckets per power of two, so percentiles are accurate to within about 6%. The counters are split into
+// shards, with each thread recording into its own shard, so that threads rarely write to the same cache lines.
+class ParseStats {
+public:
+  static const size_t SHARDS = 8;
+  static const size_t SIZE_CLASSES = 4;  // Inputs of up to 1 KB, 16 KB, 256 KB, and larger.
+  static const size_t OPTION_SETS = 8;   // Each combination of f_inline, f_qtags and f_allow_color.
+  static const size_t SUB_BUCKET_BITS = 3;
+  static const size_t MAX_LATENCY_BITS = 40; // Latencies are clamped to 2^40 ns (about 18 minutes).
+  static const size_t BUCKETS = (MAX_LATENCY_BITS - SUB_BUCKET_BITS + 1) << SUB_BUCKET_BITS;
+  static const size_t MAX_ERROR_MESSAGES = 64; // Later messages are counted under "other".
+  static constexpr size_t SIZE_CLASS_MAX_BYTES[SIZE_CLASSES] = { 1024, 16 * 1024, 256 * 1024, SIZE_MAX };
+
+  struct Histogram {
+    uint64_t count = 0;
+    uint64_t sum_ns = 0;
+    uint64_t max_ns = 0;
+    std::array<uint64_t, BUCKETS> buckets = {};
+
+    double percentile(double p) const; // In nanoseconds.
+    void merge(const Histogram& other);
+  };
+
+  struct Series {
+    size_t size_class;
+    unsigned int option_set; // DTextOptions::flags().
+    uint64_t parses = 0;
+    uint64_t errors = 0;
+    uint64_t bytes_in = 0;
+    uint64_t bytes_out = 0;
+    Histogram latency;
+  };
+
+  struct Snapshot {
+    uint64_t parses = 0;
+    uint64_t errors = 0;
+    uint64_t bytes_in = 0;
+    uint64_t bytes_out = 0;
+    Histogram latency;
+    std::vector<Series> series; // Only the series that had any parses.
+    std::map<std::string, uint64_t> errors_by_message;
+  };
+
+  ParseStats();
+
+  // Record a parse of bytes_in bytes that took latency, and either produced bytes_out bytes or failed with error.
+  void record(const DTextOptions& options, size_t bytes_in, size_t bytes_out, std::chrono::nanoseconds latency);
+  void record_error(const DTextOptions& options, size_t bytes_in, std::string_view error, std::chrono::nanoseconds latency);
+  Snapshot snapshot() const;
+  void clear();
+
+  static size_t bucket(uint64_t ns);
+  static uint64_t bucket_floor(size_t bucket); // The smallest latency in the bucket, in nanoseconds.
+
+private:
+  struct Counters {
+    std::atomic<uint64_t> parses = 0, errors = 0, bytes_in = 0, bytes_out = 0, sum_ns = 0, max_ns = 0;
+    std::array<std::atomic<uint64_t>, BUCKETS> buckets = {};
+  };
+
+  struct alignas(64) Shard {
+    std::array<Counters, SIZE_CLASSES * OPTION_SETS> series;
+  };
+
+  std::unique_ptr<Shard[]> shards;
+  mutable std::mutex mutex; // Guards errors, which are rare enough not to need sharding.
+  std::map<std::string, uint64_t> errors;
+
+  Counters& counters(const DTextOptions& options, size_t bytes_in, std::chrono::nanoseconds latency);
+};
+
+// A bounded, lock-free queue of the inputs of parses that were slow or that expanded a lot, so that outliers seen in
+// production can be reproduced (used by DText.slow_samples). It's lossy: parses that go over a threshold while the
+// queue is full aren't captured, so a burst of slow parses never blocks the threads parsing them.
+class SlowSamples {
+public:
+  static const size_t CAPACITY = 64; // A power of two.
+
+  struct Sample {
+    std::string dtext; // The input, cut off at max_input_bytes.
+    bool truncated = false;
+    DTextOptions options;
+    std::chrono::nanoseconds latency;
+    size_t bytes_in = 0;
+    size_t bytes_out = 0;
+    std::string error; // The message of the DTextLimitExceeded the parse failed with, if it did.
+    std::chrono::system_clock::time_point time;
+  };
+
+  SlowSamples();
+  ~SlowSamples();
+
+  // Capture parses that take at least min_latency, or whose output is at least min_expansion times the size of their
+  // input. Zero disables a threshold.
+  void configure(std::chrono::nanoseconds min_latency, double min_expansion, size_t max_input_bytes);
+
+  // Capture a parse if it went over a threshold, or went over one of the limits in DTextOptions (given as error).
+  void record(std::string_view dtext, const DTextOptions& options, std::chrono::nanoseconds latency, size_t bytes_out, std::string_view error = {});
+
+  // Remove and return the captured samples, oldest first.
+  std::vector<std::unique_ptr<Sample>> drain();
+
+  std::atomic<uint64_t> captured = 0;
+  std::atomic<uint64_t> dropped = 0; // Parses that went over a threshold while the queue was full.
+
+private:
+  // A bounded MPMC queue (after Dmitry Vyukov's): each cell's sequence says whether it's ready to be pushed to or popped
+  // from in the current lap, so pushes and pops only contend on the head or tail index.
+  struct Cell {
+    std::atomic<size_t> sequence;
+    Sample* sample = nullptr;
+  };
+
+  std::array<Cell, CAPACITY> cells;
+  alignas(64) std::atomic<size_t> head = 0; // The next cell to pop.
+  alignas(64) std::atomic<size_t> tail = 0; // The next cell to push.
+  std::atomic<int64_t> min_latency_ns = 0;
+  std::atomic<double> min_expansion = 0;
+  std::atomic<size_t> max_input_bytes = 0;
+
+  bool push(Sample* sample);
+  Sample* pop();
+};
+
+#ifdef DTEXT_PROFILE
+// Per-rule counters for the scanner, compiled in with DTEXT_PROFILE=1 (or DTEXT_PROFILE=cycles, which also counts the
+// cycles spent in each rule). Every scanner action counts a hit and the bytes of the token it matched, in counters kept
+// per thread, so that profiling a busy server doesn't add contention between its threads.
+class ScannerProfile {
+public:
+  static const size_t MAX_RULES = 256;
+
+  struct Rule {
+    std::string name; // The scanner and the pattern of the rule, e.g. "inline open_b".
+    uint64_t hits = 0;
+    uint64_t bytes = 0;
+    uint64_t cycles = 0; // From the end of the previous action to the end of this one, so it includes the scanning.
+  };
+
+  // Counts a hit of a rule when it's created, and the cycles up to the end of its action when it's destroyed.
+  class Hit {
+  public:
+    Hit(size_t rule, size_t bytes);
+    ~Hit();
+
+  private:
+    size_t rule;
+  };
+
+  static size_t rule(std::string_view name); // Returns the index of the rule's counters.
+  static void start();                       // Called when the scanner starts, so that cycles between parses aren't counted.
+  static std::vector<Rule> snapshot();       // The rules that were hit, with their counters summed over all threads.
+  static void reset();
+};
+#endif
+
 #endif
@@ -0,0 +1,822 @@
+// dtextd: a daemon that renders DText for other processes on the same host over a Unix domain socket, so that services
+// that can't load the Ruby extension (or would rather not) can share one warm parser. Built with `bin/rake dtextd` or by
+// CMake; run `bin/dtextd.exe --help` for usage and the protocol, and see dtextd_load.cpp for the load-test client.
+//
+// The main thread does all the socket I/O with epoll: it reads requests from every connection, and queues all the
+// requests it read in one pass of the event loop at once. Worker threads take requests off the queue in batches, render
+// them with buffers that each thread keeps between requests, and hand the responses back to the main thread (waking it
+// once per batch), which writes them out in the order each connection sent its requests.
+
+#include "dtext.h"
+#include "libdtext.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <iterator>
+#include <map>
+#include <mutex>
+#include <new>
+#include <string>
+#include <string_view>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+static const char* USAGE = R"(Usage: dtextd [OPTIONS]
+
+Render DText for clients connected to a Unix domain socket, until SIGINT or SIGTERM.
+
+Options:
+  --socket=PATH            The socket to listen on (default: dtextd.sock). A stale socket left at PATH is replaced,
+                           but not one that another daemon is still listening on.
+  --threads=N              The number of worker threads (default: the number of CPUs).
+  --max-batch=N            The most requests a worker takes off the queue at once (default: 32).
+  --max-request-bytes=N    Close connections that send a request larger than this (default: 16777216).
+  --max-in-flight=N        Stop reading from a connection while this many of its requests haven't been answered yet
+                           (default: 1024).
+  --max-pending-bytes=N    Stop reading from a connection while this many bytes of its responses are waiting to be
+                           sent (default: 16777216).
+
+Parser options (as in DText.parse; inline, qtags and allow_color are set per request):
+  --base-url=URL           --domain=DOMAIN             --internal-domain=DOMAIN (repeatable)
+  --max-output-bytes=N     --max-dstack-depth=N        --timeout=SECONDS
+  --max-visible-chars=N
+
+Protocol:
+  Each request and response is a frame: a 4-byte big-endian length, followed by that many bytes. A client can send
+  several requests without waiting for their responses, which come back in the same order.
+
+  A request starts with a type byte. 0 renders DText: it's followed by a flags byte (inline = 1, qtags = 2,
+  allow_color = 4, metadata = 8) and the DText. 1 asks for the daemon's stats, and has no body.
+
+  A response starts with a status byte (as in libdtext.h: 0 OK, 1 invalid input, 2 limit exceeded, 3 out of memory,
+  4 error). If the status is OK, it's followed by the HTML, or with the metadata flag by a JSON object with "html",
+  "creators", "post_ids", "qtags" and "truncated"; otherwise by the error message. Stats are a JSON object.
+)";
+
+enum RequestType : uint8_t {
+  REQUEST_RENDER = 0,
+  REQUEST_STATS = 1,
+};
+
+static const uint8_t FLAG_METADATA = 8; // The other flags are DTextOptions::flags().
+
+struct Config {
+  std::string socket = "dtextd.sock";
+  unsigned int threads = std::max(std::thread::hardware_concurrency(), 1u);
+  size_t max_batch = 32;
+  size_t max_request_bytes = 16 * 1024 * 1024;
+  size_t max_in_flight = 1024;
+  size_t max_pending_bytes = 16 * 1024 * 1024;
+  DTextOptions options;
+};
+
+struct Request {
+  uint64_t connection;
+  uint64_t sequence; // The request's position on its connection, so that responses can be put back in order.
+  std::string body;  // The frame, after the length.
+  std::chrono::steady_clock::time_point received;
+};
+
+struct Response {
+  uint64_t connection;
+  uint64_t sequence;
+  std::string frame;
+};
+
+struct Connection {
+  uint64_t id;
+  int fd;
+  std::string input;
+  size_t input_offset = 0; // The start of the first request in input that hasn't been queued yet.
+  std::string output;
+  size_t output_offset = 0;
+  uint64_t next_request = 0;
+  uint64_t next_response = 0;
+  std::map<uint64_t, std::string> finished; // Responses that were rendered before the ones ahead of them.
+  size_t finished_bytes = 0;
+  bool reading = true;    // Whether epoll is waiting for input, which it doesn't while the client is too far ahead.
+  bool writing = false;   // Whether epoll is waiting for the socket to be writable.
+  bool closing = false;   // Whether the client has stopped sending, so it can be closed once every response is sent.
+};
+
+[[noreturn]] static void die(const std::string& message) {
+  fprintf(stderr, "dtextd: %s\n", message.c_str());
+  exit(2);
+}
+
+static size_t parse_number(const std::string_view option, const std::string_view value) {
+  size_t n = 0;
+  auto [end, error] = std::from_chars(value.data(), value.data() + value.size(), n);
+
+  if (error != std::errc() || end != value.data() + value.size()) {
+    die("invalid number for " + std::string(option) + ": " + std::string(value));
+  }
+
+  return n;
+}
+
+static Config parse_args(int argc, char** argv) {
+  Config config;
+
+  for (int i = 1; i < argc; i++) {
+    std::string_view arg = argv[i];
+    std::string_view name = arg.substr(0, arg.find('='));
+    std::string_view value = arg.find('=') == std::string_view::npos ? "" : arg.substr(arg.find('=') + 1);
+
+    if (arg == "-h" || arg == "--help") {
+      fputs(USAGE, stdout);
+      exit(0);
+    } else if (name == "--socket") {
+      config.socket = value;
+    } else if (name == "--threads") {
+      config.threads = std::max<size_t>(parse_number(name, value), 1);
+    } else if (name == "--max-batch") {
+      config.max_batch = std::max<size_t>(parse_number(name, value), 1);
+    } else if (name == "--max-request-bytes") {
+      config.max_request_bytes = parse_number(name, value);
+    } else if (name == "--max-in-flight") {
+      config.max_in_flight = std::max<size_t>(parse_number(name, value), 1);
+    } else if (name == "--max-pending-bytes") {
+      config.max_pending_bytes = std::max<size_t>(parse_number(name, value), 1);
+    } else if (name == "--base-url") {
+      config.options.base_url = value;
+    } else if (name == "--domain") {
+      config.options.domain = value;
+    } else if (name == "--internal-domain") {
+      config.options.internal_domains.insert(std::string(value));
+    } else if (name == "--max-output-bytes") {
+      config.options.max_output_bytes = parse_number(name, value);
+    } else if (name == "--max-dstack-depth") {
+      config.options.max_dstack_depth = parse_number(name, value);
+    } else if (name == "--timeout") {
+      config.options.timeout = std::chrono::microseconds(static_cast<long>(strtod(std::string(value).c_str(), nullptr) * 1'000'000));
+    } else if (name == "--max-visible-chars") {
+      config.options.max_visible_chars = parse_number(name, value);
+    } else {
+      die("unknown option: " + std::string(arg) + " (see --help)");
+    }
+  }
+
+  return config;
+}
+
+static void append_json_string(std::string& out, const std::string_view string) {
+  out += '"';
+
+  for (unsigned char c : string) {
+    if (c == '"' || c == '\\') {
+      out += '\\';
+      out += c;
+    } else if (c < 0x20) {
+      char escape[8];
+      snprintf(escape, sizeof(escape), "\\u%04x", c);
+      out += escape;
+    } else {
+      out += c;
+    }
+  }
+
+  out += '"';
+}
+
+static void append_latency_json(std::string& out, const ParseStats::Histogram& latency) {
+  char json[256];
+  snprintf(json, sizeof(json), "{\"count\":%llu,\"p50\":%.9g,\"p90\":%.9g,\"p99\":%.9g,\"p999\":%.9g,\"max\":%.9g}",
+    static_cast<unsigned long long>(latency.count), latency.percentile(0.5) / 1e9, latency.percentile(0.9) / 1e9,
+    latency.percentile(0.99) / 1e9, latency.percentile(0.999) / 1e9, latency.max_ns / 1e9);
+  out += json;
+}
+
+static void record_latency(ParseStats::Histogram& histogram, std::chrono::nanoseconds latency) {
+  uint64_t ns = std::max<int64_t>(latency.count(), 0);
+  histogram.count++;
+  histogram.sum_ns += ns;
+  histogram.max_ns = std::max(histogram.max_ns, ns);
+  histogram.buckets[ParseStats::bucket(ns)]++;
+}
+
+class Server {
+public:
+  Server(Config config);
+  ~Server();
+  void run();
+
+private:
+  const Config config;
+  std::array<DTextOptions, ParseStats::OPTION_SETS> option_sets; // The configured options with each set of flags.
+  const std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+
+  int listen_fd = -1;
+  int epoll_fd = -1;
+  int wake_fd = -1;   // An eventfd that workers write to once they've finished a batch.
+  int signal_fd = -1;
+
+  std::unordered_map<uint64_t, Connection> connections;
+  uint64_t next_connection = 1;
+  std::vector<Request> received; // The requests read in this pass of the event loop, not queued yet.
+
+  std::mutex queue_mutex;
+  std::condition_variable queue_ready;
+  std::deque<Request> queue;
+  bool stopping = false;
+
+  std::mutex done_mutex;
+  std::vector<Response> done;
+
+  std::vector<std::thread> workers;
+
+  // Stats, written by the main thread or (for the parses) by the workers.
+  ParseStats parse_stats;
+  std::atomic<uint64_t> connections_total = 0;
+  std::atomic<uint64_t> requests = 0;
+  std::atomic<uint64_t> protocol_errors = 0;
+  std::atomic<uint64_t> batches = 0;
+  std::atomic<uint64_t> batched_requests = 0;
+  std::atomic<uint64_t> max_batch_seen = 0;
+  std::atomic<uint64_t> throttled = 0; // How many times a connection stopped being read because it was too far ahead.
+  std::atomic<size_t> open_connections = 0;
+  std::mutex latency_mutex;
+  ParseStats::Histogram request_latency; // From reading a request to handing its response to the main thread.
+
+  void work();
+  std::string handle(const Request& request, ParseBuffers& buffers);
+  std::string stats_json();
+
+  void accept_connections();
+  void read_requests(Connection& connection);
+  bool take_requests(Connection& connection);
+  void queue_requests();
+  void send_responses();
+  void write_responses(Connection& connection);
+  void close_connection(Connection& connection);
+  bool backlogged(const Connection& connection) const;
+  void watch(Connection& connection);
+};
+
+static std::string frame(uint8_t status, const std::string_view body) {
+  uint32_t length = body.size() + 1;
+  std::string frame;
+
+  frame.reserve(length + 4);
+  frame += static_cast<char>(length >> 24);
+  frame += static_cast<char>(length >> 16);
+  frame += static_cast<char>(length >> 8);
+  frame += static_cast<char>(length);
+  frame += static_cast<char>(status);
+  frame += body;
+
+  return frame;
+}
+
+Server::Server(Config config) : config(std::move(config)) {
+  for (unsigned int flags = 0; flags < option_sets.size(); flags++) {
+    option_sets[flags] = this->config.options;
+    option_sets[flags].f_inline = flags & 1;
+    option_sets[flags].f_qtags = flags & 2;
+    option_sets[flags].f_allow_color = flags & 4;
+  }
+
+  struct sockaddr_un address = {};
+  address.sun_family = AF_UNIX;
+
+  if (this->config.socket.size() >= sizeof(address.sun_path)) {
+    die("socket path too long: " + this->config.socket);
+  }
+
+  strcpy(address.sun_path, this->config.socket.c_str());
+
+  // Replace a socket left behind by a daemon that didn't exit cleanly, but nothing else: not a file that isn't a socket,
+  // and not the socket of a daemon that's still running, which is found by connecting to it.
+  struct stat st;
+  if (lstat(address.sun_path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    bool listening = fd >= 0 && connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0;
+    int error = errno;
+
+    if (fd >= 0) {
+      close(fd);
+    }
+
+    if (listening) {
+      die(this->config.socket + ": another daemon is already listening on this socket");
+    } else if (error == ECONNREFUSED) {
+      unlink(address.sun_path);
+    }
+  }
+
+  listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (listen_fd < 0 || bind(listen_fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0 || listen(listen_fd, SOMAXCONN) < 0) {
+    die(this->config.socket + ": " + strerror(errno));
+  }
+
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  sigprocmask(SIG_BLOCK, &signals, nullptr); // Before starting the workers, so that they inherit the mask.
+  signal(SIGPIPE, SIG_IGN);
+
+  epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  signal_fd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+
+  if (epoll_fd < 0 || wake_fd < 0 || signal_fd < 0) {
+    die(std::string("can't set up the event loop: ") + strerror(errno));
+  }
+
+  // Connections are registered by their id, which can't collide with these (ids start at 1).
+  for (auto [fd, id] : { std::pair{ listen_fd, 0ul }, std::pair{ wake_fd, ~0ul }, std::pair{ signal_fd, ~1ul } }) {
+    struct epoll_event event = { .events = EPOLLIN, .data = { .u64 = id } };
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event);
+  }
+
+  for (unsigned int i = 0; i < this->config.threads; i++) {
+    workers.emplace_back(&Server::work, this);
+  }
+}
+
+Server::~Server() {
+  {
+    std::lock_guard lock(queue_mutex);
+    stopping = true;
+  }
+
+  queue_ready.notify_all();
+
+  for (auto& worker : workers) {
+    worker.join();
+  }
+
+  for (auto& [id, connection] : connections) {
+    close(connection.fd);
+  }
+
+  close(listen_fd);
+  close(epoll_fd);
+  close(wake_fd);
+  close(signal_fd);
+  unlink(config.socket.c_str());
+}
+
+void Server::run() {
+  fprintf(stderr, "dtextd: listening on %s with %u threads\n", config.socket.c_str(), config.threads);
+  std::vector<struct epoll_event> events(256);
+
+  for (;;) {
+    int count = epoll_wait(epoll_fd, events.data(), events.size(), -1);
+
+    if (count < 0 && errno != EINTR) {
+      die(std::string("epoll_wait: ") + strerror(errno));
+    }
+
+    for (int i = 0; i < count; i++) {
+      uint64_t id = events[i].data.u64;
+
+      if (id == 0) {
+        accept_connections();
+      } else if (id == ~0ul) {
+        send_responses();
+      } else if (id == ~1ul) {
+        fprintf(stderr, "dtextd: stopping\n%s\n", stats_json().c_str());
+        return;
+      } else if (auto it = connections.find(id); it != connections.end()) {
+        if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+          read_requests(it->second);
+        }
+
+        if (it->second.fd >= 0 && (events[i].events & EPOLLOUT)) {
+          write_responses(it->second);
+        }
+
+        if (it->second.fd < 0) {
+          connections.erase(it);
+        }
+      }
+    }
+
+    queue_requests();
+  }
+}
+
+void Server::accept_connections() {
+  for (;;) {
+    int fd = accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+    if (fd < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNABORTED && errno != EINTR) {
+        fprintf(stderr, "dtextd: accept: %s\n", strerror(errno));
+      }
+
+      if (errno != ECONNABORTED && errno != EINTR) {
+        return;
+      }
+
+      continue;
+    }
+
+    uint64_t id = next_connection++;
+    struct epoll_event event = { .events = EPOLLIN | EPOLLRDHUP, .data = { .u64 = id } };
+    connections.emplace(id, Connection{ .id = id, .fd = fd });
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event);
+    connections_total++;
+    open_connections++;
+  }
+}
+
+// Read what the client has sent, and collect the complete requests in `received`. Reading stops once the client is too
+// far ahead (see backlogged), and resumes once its responses have been sent; until then, its requests wait in the
+// socket, and once the socket's buffer is full, the client blocks.
+void Server::read_requests(Connection& connection) {
+  char buffer[64 * 1024];
+
+  while (!backlogged(connection)) {
+    ssize_t n = read(connection.fd, buffer, sizeof(buffer));
+
+    if (n > 0) {
+      connection.input.append(buffer, n);
+
+      if (!take_requests(connection)) {
+        return;
+      }
+
+      continue;
+    } else if (n < 0 && errno == EINTR) {
+      continue;
+    } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      break;
+    } else if (n < 0) {
+      close_connection(connection);
+      return;
+    }
+
+    connection.closing = true;
+    break;
+  }
+
+  if (connection.closing && connection.next_response == connection.next_request) {
+    close_connection(connection);
+  } else {
+    // Stop waiting for input if the client has stopped sending (which would wake epoll_wait over and over), or is too
+    // far ahead.
+    watch(connection);
+  }
+}
+
+// Move the complete requests at the start of the connection's input to `received`. Only the request still being sent
+// stays in the input, so it never holds much more than max_request_bytes. Returns false if the connection was closed
+// because of a request that's too large.
+bool Server::take_requests(Connection& connection) {
+  std::string_view input(connection.input);
+  auto now = std::chrono::steady_clock::now();
+
+  while (input.size() - connection.input_offset >= 4) {
+    const unsigned char* header = reinterpret_cast<const unsigned char*>(input.data() + connection.input_offset);
+    size_t length = static_cast<size_t>(header[0]) << 24 | header[1] << 16 | header[2] << 8 | header[3];
+
+    if (length == 0 || length > config.max_request_bytes) {
+      protocol_errors++;
+      close_connection(connection);
+      return false;
+    } else if (input.size() - connection.input_offset - 4 < length) {
+      break;
+    }
+
+    received.push_back({ connection.id, connection.next_request++, std::string(input.substr(connection.input_offset + 4, length)), now });
+    connection.input_offset += 4 + length;
+  }
+
+  connection.input.erase(0, connection.input_offset);
+  connection.input_offset = 0;
+  return true;
+}
+
+// Queue the requests read in this pass of the event loop all at once, so that concurrent requests are picked up as
+// one batch rather than waking a worker for each.
+void Server::queue_requests() {
+  if (received.empty()) {
+    return;
+  }
+
+  size_t count = received.size();
+  requests += count;
+
+  {
+    std::lock_guard lock(queue_mutex);
+    std::move(received.begin(), received.end(), std::back_inserter(queue));
+  }
+
+  received.clear();
+
+  if (count >= config.max_batch) {
+    queue_ready.notify_all();
+  } else {
+    queue_ready.notify_one();
+  }
+}
+
+void Server::work() {
+  ParseBuffers buffers;
+  std::vector<Request> batch;
+  std::vector<Response> responses;
+  std::vector<std::chrono::nanoseconds> latencies;
+
+  for (;;) {
+    {
+      std::unique_lock lock(queue_mutex);
+      queue_ready.wait(lock, [&] { return stopping || !queue.empty(); });
+
+      if (stopping) {
+        return;
+      }
+
+      // Share a burst between the workers rather than letting the first one take all of it.
+      size_t count = std::clamp<size_t>(queue.size() / config.threads, 1, config.max_batch);
+      std::move(queue.begin(), queue.begin() + count, std::back_inserter(batch));
+      queue.erase(queue.begin(), queue.begin() + count);
+
+      if (!queue.empty()) {
+        queue_ready.notify_one();
+      }
+    }
+
+    for (auto& request : batch) {
+      responses.push_back({ request.connection, request.sequence, handle(request, buffers) });
+      latencies.push_back(std::chrono::steady_clock::now() - request.received);
+    }
+
+    {
+      std::lock_guard lock(done_mutex);
+      std::move(responses.begin(), responses.end(), std::back_inserter(done));
+    }
+
+    {
+      std::lock_guard lock(latency_mutex);
+
+      for (auto latency : latencies) {
+        record_latency(request_latency, latency);
+      }
+    }
+
+    uint64_t one = 1;
+    [[maybe_unused]] ssize_t ignored = write(wake_fd, &one, sizeof(one));
+
+    batches++;
+    batched_requests += batch.size();
+    uint64_t size = batch.size(), max = max_batch_seen.load();
+    while (size > max && !max_batch_seen.compare_exchange_weak(max, size)) {}
+
+    batch.clear();
+    responses.clear();
+    latencies.clear();
+  }
+}
+
+// Render a request into a response frame.
+std::string Server::handle(const Request& request, ParseBuffers& buffers) {
+  std::string_view body(request.body);
+  uint8_t type = body[0];
+
+  if (type == REQUEST_STATS) {
+    return frame(DTEXT_OK, stats_json());
+  } else if (type != REQUEST_RENDER || body.size() < 2) {
+    protocol_errors++;
+    return frame(DTEXT_INVALID_INPUT, "invalid request");
+  }
+
+  uint8_t flags = body[1];
+  std::string_view dtext = body.substr(2);
+  const DTextOptions& options = option_sets[flags & (ParseStats::OPTION_SETS - 1)];
+
+  if (const char* reason = dtext_validate(dtext.data(), dtext.size())) {
+    return frame(DTEXT_INVALID_INPUT, reason);
+  }
+
+  auto start = std::chrono::steady_clock::now();
+
+  try {
+    StateMachine::parse_dtext(dtext, options, buffers);
+    parse_stats.record(options, dtext.size(), buffers.output.size(), std::chrono::steady_clock::now() - start);
+  } catch (const std::exception& e) {
+    parse_stats.record_error(options, dtext.size(), e.what(), std::chrono::steady_clock::now() - start);
+    dtext_status status = dynamic_cast<const DTextLimitExceeded*>(&e) ? DTEXT_LIMIT_EXCEEDED : dynamic_cast<const std::bad_alloc*>(&e) ? DTEXT_OUT_OF_MEMORY : DTEXT_ERROR;
+    return frame(status, e.what());
+  }
+
+  if (!(flags & FLAG_METADATA)) {
+    return frame(DTEXT_OK, buffers.output);
+  }
+
+  std::string json = "{\"html\":";
+  append_json_string(json, buffers.output);
+
+  json += ",\"creators\":[";
+  for (const auto& creator : buffers.creators) {
+    append_json_string(json, creator);
+    json += ',';
+  }
+
+  if (json.back() == ',') json.pop_back();
+  json += "],\"post_ids\":[";
+  for (long post : buffers.posts) {
+    json += std::to_string(post);
+    json += ',';
+  }
+
+  if (json.back() == ',') json.pop_back();
+  json += "],\"qtags\":[";
+  for (const auto& qtag : buffers.qtags) {
+    append_json_string(json, qtag);
+    json += ',';
+  }
+
+  if (json.back() == ',') json.pop_back();
+  json += "],\"truncated\":";
+  json += buffers.truncated ? "true}" : "false}";
+
+  return frame(DTEXT_OK, json);
+}
+
+std::string Server::stats_json() {
+  auto snapshot = parse_stats.snapshot();
+  size_t queued;
+
+  {
+    std::lock_guard lock(queue_mutex);
+    queued = queue.size();
+  }
+
+  char json[512];
+  snprintf(json, sizeof(json),
+    "{\"uptime\":%.3f,\"threads\":%u,\"connections\":%zu,\"connections_total\":%llu,\"requests\":%llu,\"protocol_errors\":%llu,"
+    "\"queued\":%zu,\"batches\":%llu,\"batch_size_mean\":%.2f,\"batch_size_max\":%llu,\"throttled\":%llu,\"parses\":%llu,\"errors\":%llu,\"bytes_in\":%llu,\"bytes_out\":%llu,",
+    std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count(), config.threads, open_connections.load(),
+    static_cast<unsigned long long>(connections_total.load()), static_cast<unsigned long long>(requests.load()),
+    static_cast<unsigned long long>(protocol_errors.load()), queued, static_cast<unsigned long long>(batches.load()),
+    batches ? static_cast<double>(batched_requests.load()) / batches : 0.0, static_cast<unsigned long long>(max_batch_seen.load()),
+    static_cast<unsigned long long>(throttled.load()), static_cast<unsigned long long>(snapshot.parses),
+    static_cast<unsigned long long>(snapshot.errors), static_cast<unsigned long long>(snapshot.bytes_in),
+    static_cast<unsigned long long>(snapshot.bytes_out));
+
+  std::string out = json;
+  out += "\"errors_by_message\":{";
+
+  for (const auto& [message, count] : snapshot.errors_by_message) {
+    append_json_string(out, message);
+    out += ':' + std::to_string(count) + ',';
+  }
+
+  if (out.back() == ',') out.pop_back();
+  out += "},\"parse_latency\":";
+  append_latency_json(out, snapshot.latency);
+
+  out += ",\"request_latency\":";
+  {
+    std::lock_guard lock(latency_mutex);
+    append_latency_json(out, request_latency);
+  }
+
+  out += '}';
+  return out;
+}
+
+// Take the responses the workers have finished, and send each one once the responses ahead of it on its connection
+// have been sent.
+void Server::send_responses() {
+  uint64_t count;
+  [[maybe_unused]] ssize_t ignored = read(wake_fd, &count, sizeof(count));
+  std::vector<Response> responses;
+
+  {
+    std::lock_guard lock(done_mutex);
+    responses.swap(done);
+  }
+
+  std::vector<uint64_t> touched;
+
+  for (auto& response : responses) {
+    auto it = connections.find(response.connection);
+
+    if (it == connections.end()) {
+      continue; // The client went away before its response was ready.
+    }
+
+    Connection& connection = it->second;
+
+    if (response.sequence == connection.next_response) {
+      connection.output += response.frame;
+      connection.next_response++;
+
+      for (auto next = connection.finished.begin(); next != connection.finished.end() && next->first == connection.next_response; next = connection.finished.erase(next)) {
+        connection.output += next->second;
+        connection.finished_bytes -= next->second.size();
+        connection.next_response++;
+      }
+
+      touched.push_back(response.connection);
+    } else {
+      connection.finished_bytes += response.frame.size();
+      connection.finished.emplace(response.sequence, std::move(response.frame));
+    }
+  }
+
+  // Write each connection's responses with one write() per batch, rather than one per response.
+  std::sort(touched.begin(), touched.end());
+  touched.erase(std::unique(touched.begin(), touched.end()), touched.end());
+
+  for (uint64_t id : touched) {
+    auto it = connections.find(id);
+    write_responses(it->second);
+
+    if (it->second.fd < 0) {
+      connections.erase(it);
+    }
+  }
+}
+
+void Server::write_responses(Connection& connection) {
+  while (connection.output_offset < connection.output.size()) {
+    ssize_t n = write(connection.fd, connection.output.data() + connection.output_offset, connection.output.size() - connection.output_offset);
+
+    if (n >= 0) {
+      connection.output_offset += n;
+    } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      break;
+    } else if (errno != EINTR) {
+      close_connection(connection);
+      return;
+    }
+  }
+
+  if (connection.output_offset == connection.output.size()) {
+    connection.output.clear();
+    connection.output_offset = 0;
+  }
+
+  if (connection.closing && connection.output.empty() && connection.next_response == connection.next_request) {
+    close_connection(connection);
+  } else {
+    watch(connection);
+  }
+}
+
+// Whether the client is too far ahead of the daemon: it has too many requests that haven't been answered yet, or too
+// many bytes of responses that it hasn't read yet.
+bool Server::backlogged(const Connection& connection) const {
+  size_t in_flight = connection.next_request - connection.next_response;
+  size_t pending_bytes = connection.output.size() - connection.output_offset + connection.finished_bytes;
+  return in_flight >= config.max_in_flight || pending_bytes >= config.max_pending_bytes;
+}
+
+// Wait for input unless the client has stopped sending or is too far ahead, and for the socket to be writable while
+// there's output that couldn't be written yet.
+void Server::watch(Connection& connection) {
+  bool reading = !connection.closing && !backlogged(connection);
+  bool writing = !connection.output.empty();
+
+  if (reading == connection.reading && writing == connection.writing) {
+    return;
+  }
+
+  if (connection.reading && !reading && !connection.closing) {
+    throttled++;
+  }
+
+  struct epoll_event event = { .events = (reading ? EPOLLIN | EPOLLRDHUP : 0u) | (writing ? EPOLLOUT : 0u), .data = { .u64 = connection.id } };
+  epoll_ctl(epoll_fd, EPOLL_CTL_MOD, connection.fd, &event);
+  connection.reading = reading;
+  connection.writing = writing;
+}
+
+// Close the socket; the connection is removed from the map by the caller, once it's done with it. Responses still being
+// rendered for it are dropped when they're finished.
+void Server::close_connection(Connection& connection) {
+  if (connection.fd >= 0) {
+    close(connection.fd);
+    connection.fd = -1;
+    open_connections--;
+  }
+}
+
+int main(int argc, char** argv) {
+  Server server(parse_args(argc, argv));
+  server.run();
+  return 0;
+}
@@ -0,0 +1,339 @@
+// dtextd_load: a load-test client for dtextd. It sends render requests over several connections at once for a while,
+// and reports the throughput and latency percentiles seen by the clients (used by `bin/rake bench:daemon`). Run
+// `bin/dtextd_load.exe --help` for usage.
+
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <string_view>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+static const char* USAGE = R"(Usage: dtextd_load [OPTIONS] [FILE...]
+
+Send each FILE (or a few sample documents) to dtextd over and over, from several connections at once, and report the
+throughput and the latency of each request as seen by the client.
+
+Options:
+  --socket=PATH            The daemon's socket (default: dtextd.sock).
+  --connections=N          The number of connections, each on its own thread (default: 4).
+  --pipeline=N             The number of requests each connection keeps in flight (default: 1).
+  --time=SECONDS           How long to send requests for (default: 5).
+  --inline                 --qtags                     --allow-color
+  --metadata               Ask for the creators, post IDs and qtags as well as the HTML.
+  --json                   Write the results as JSON (latencies in seconds).
+  --stats                  Print the daemon's stats afterwards.
+)";
+
+static const char* SAMPLE_DOCUMENTS[] = {
+  "hello [b]world[/b]",
+  "h4. Notes\n\nSee [[tag_name|the wiki]] and \"this link\":https://example.com/posts?tags=foo, or post #1234.\n\n* one\n* two\n** three",
+  "[quote]\nuser said:\n\n[i]Quoted[/i] text with [spoiler]a spoiler[/spoiler].\n[/quote]\n\nA reply.",
+  "[table]\n[thead][tr][th]a[/th][th]b[/th][/tr][/thead]\n[tbody][tr][td]1[/td][td]2[/td][/tr][/tbody]\n[/table]",
+  "[code]\nint main() { return 0; }\n[/code]\n\n`inline code` and [expand=More]hidden [u]text[/u][/expand]",
+};
+
+struct Config {
+  std::string socket = "dtextd.sock";
+  unsigned int connections = 4;
+  unsigned int pipeline = 1;
+  double time = 5;
+  uint8_t flags = 0;
+  bool json = false;
+  bool stats = false;
+};
+
+struct ClientResult {
+  std::vector<double> latencies; // In microseconds.
+  size_t errors = 0;
+  size_t bytes_in = 0;  // The DText sent.
+  size_t bytes_out = 0; // The responses received.
+  std::string failure;  // Why the connection failed, if it did.
+};
+
+[[noreturn]] static void die(const std::string& message) {
+  fprintf(stderr, "dtextd_load: %s\n", message.c_str());
+  exit(2);
+}
+
+static size_t parse_number(const std::string_view option, const std::string_view value) {
+  size_t n = 0;
+  auto [end, error] = std::from_chars(value.data(), value.data() + value.size(), n);
+
+  if (error != std::errc() || end != value.data() + value.size()) {
+    die("invalid number for " + std::string(option) + ": " + std::string(value));
+  }
+
+  return n;
+}
+
+static Config parse_args(int argc, char** argv, std::vector<std::string>& files) {
+  Config config;
+
+  for (int i = 1; i < argc; i++) {
+    std::string_view arg = argv[i];
+    std::string_view name = arg.substr(0, arg.find('='));
+    std::string_view value = arg.find('=') == std::string_view::npos ? "" : arg.substr(arg.find('=') + 1);
+
+    if (arg == "-h" || arg == "--help") {
+      fputs(USAGE, stdout);
+      exit(0);
+    } else if (name == "--socket") {
+      config.socket = value;
+    } else if (name == "--connections") {
+      config.connections = std::max<size_t>(parse_number(name, value), 1);
+    } else if (name == "--pipeline") {
+      config.pipeline = std::max<size_t>(parse_number(name, value), 1);
+    } else if (name == "--time") {
+      config.time = strtod(std::string(value).c_str(), nullptr);
+    } else if (arg == "--inline") {
+      config.flags |= 1;
+    } else if (arg == "--qtags") {
+      config.flags |= 2;
+    } else if (arg == "--allow-color") {
+      config.flags |= 4;
+    } else if (arg == "--metadata") {
+      config.flags |= 8;
+    } else if (arg == "--json") {
+      config.json = true;
+    } else if (arg == "--stats") {
+      config.stats = true;
+    } else if (arg.starts_with("-")) {
+      die("unknown option: " + std::string(arg) + " (see --help)");
+    } else {
+      files.push_back(std::string(arg));
+    }
+  }
+
+  return config;
+}
+
+// A request frame: the length, the type and flags, and the body (see dtextd --help).
+static std::string frame(uint8_t type, uint8_t flags, const std::string_view dtext) {
+  uint32_t length = dtext.size() + (type == 0 ? 2 : 1);
+  std::string frame;
+
+  frame += static_cast<char>(length >> 24);
+  frame += static_cast<char>(length >> 16);
+  frame += static_cast<char>(length >> 8);
+  frame += static_cast<char>(length);
+  frame += static_cast<char>(type);
+
+  if (type == 0) {
+    frame += static_cast<char>(flags);
+  }
+
+  frame += dtext;
+  return frame;
+}
+
+static int connect_to(const std::string& path) {
+  struct sockaddr_un address = {};
+  address.sun_family = AF_UNIX;
+
+  if (path.size() >= sizeof(address.sun_path)) {
+    die("socket path too long: " + path);
+  }
+
+  strcpy(address.sun_path, path.c_str());
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+  if (fd < 0 || connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0) {
+    die(path + ": " + strerror(errno));
+  }
+
+  return fd;
+}
+
+static bool write_all(int fd, const std::string_view data) {
+  for (size_t written = 0; written < data.size();) {
+    ssize_t n = send(fd, data.data() + written, data.size() - written, MSG_NOSIGNAL);
+
+    if (n < 0 && errno == EINTR) {
+      continue;
+    } else if (n <= 0) {
+      return false;
+    }
+
+    written += n;
+  }
+
+  return true;
+}
+
+static bool read_all(int fd, char* buffer, size_t size) {
+  for (size_t done = 0; done < size;) {
+    ssize_t n = read(fd, buffer + done, size - done);
+
+    if (n < 0 && errno == EINTR) {
+      continue;
+    } else if (n <= 0) {
+      return false;
+    }
+
+    done += n;
+  }
+
+  return true;
+}
+
+// Read a response frame into `body` (the status byte and what follows it).
+static bool read_response(int fd, std::string& body) {
+  unsigned char header[4];
+
+  if (!read_all(fd, reinterpret_cast<char*>(header), sizeof(header))) {
+    return false;
+  }
+
+  size_t length = static_cast<size_t>(header[0]) << 24 | header[1] << 16 | header[2] << 8 | header[3];
+  body.resize(length);
+  return length > 0 && read_all(fd, body.data(), length);
+}
+
+// Send requests until the deadline, keeping `pipeline` of them in flight, then wait for the rest of the responses.
+static void client(const Config& config, const std::vector<std::string>& documents, size_t first, std::chrono::steady_clock::time_point deadline, ClientResult& result) {
+  using clock = std::chrono::steady_clock;
+  int fd = connect_to(config.socket);
+  std::deque<clock::time_point> in_flight;
+  std::vector<std::string> frames;
+  std::string response;
+
+  for (auto& document : documents) {
+    frames.push_back(frame(0, config.flags, document));
+  }
+
+  for (size_t next = first;;) {
+    while (in_flight.size() < config.pipeline && clock::now() < deadline) {
+      const std::string& request = frames[next++ % frames.size()];
+
+      if (!write_all(fd, request)) {
+        result.failure = strerror(errno);
+        close(fd);
+        return;
+      }
+
+      in_flight.push_back(clock::now());
+      result.bytes_in += request.size() - 6; // Just the DText, without the length, type and flags.
+    }
+
+    if (in_flight.empty()) {
+      break;
+    }
+
+    if (!read_response(fd, response)) {
+      result.failure = "connection closed by the daemon";
+      close(fd);
+      return;
+    }
+
+    result.latencies.push_back(std::chrono::duration<double, std::micro>(clock::now() - in_flight.front()).count());
+    result.errors += response[0] != 0;
+    result.bytes_out += response.size() - 1;
+    in_flight.pop_front();
+  }
+
+  close(fd);
+}
+
+static std::string daemon_stats(const Config& config) {
+  int fd = connect_to(config.socket);
+  std::string response;
+
+  if (!write_all(fd, frame(1, 0, "")) || !read_response(fd, response)) {
+    die("can't get the daemon's stats");
+  }
+
+  close(fd);
+  return response.substr(1);
+}
+
+static std::vector<std::string> read_documents(const std::vector<std::string>& files) {
+  std::vector<std::string> documents;
+
+  for (auto& file : files) {
+    std::ifstream stream(file, std::ios::binary);
+
+    if (!stream) {
+      die(file + ": " + strerror(errno));
+    }
+
+    documents.emplace_back(std::istreambuf_iterator<char>(stream), std::istreambuf_iterator<char>());
+  }
+
+  if (documents.empty()) {
+    documents.assign(std::begin(SAMPLE_DOCUMENTS), std::end(SAMPLE_DOCUMENTS));
+  }
+
+  return documents;
+}
+
+int main(int argc, char** argv) {
+  std::vector<std::string> files;
+  Config config = parse_args(argc, argv, files);
+  std::vector<std::string> documents = read_documents(files);
+
+  std::vector<ClientResult> results(config.connections);
+  std::vector<std::thread> threads;
+  auto start = std::chrono::steady_clock::now();
+  auto deadline = start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(config.time));
+
+  for (unsigned int i = 0; i < config.connections; i++) {
+    // Start each connection at a different document, so that they don't all send the same one at the same time.
+    threads.emplace_back(client, std::cref(config), std::cref(documents), i, deadline, std::ref(results[i]));
+  }
+
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  std::vector<double> latencies;
+  size_t errors = 0, bytes_in = 0, bytes_out = 0;
+
+  for (auto& result : results) {
+    if (!result.failure.empty()) {
+      die(result.failure);
+    }
+
+    latencies.insert(latencies.end(), result.latencies.begin(), result.latencies.end());
+    errors += result.errors;
+    bytes_in += result.bytes_in;
+    bytes_out += result.bytes_out;
+  }
+
+  size_t requests = latencies.size();
+
+  if (requests == 0) {
+    die("no requests were sent");
+  }
+
+  std::sort(latencies.begin(), latencies.end());
+  auto percentile = [&](double p) { return latencies[std::min(requests - 1, static_cast<size_t>(p * requests))]; };
+
+  if (config.json) {
+    printf("{\"connections\":%u,\"pipeline\":%u,\"requests\":%zu,\"errors\":%zu,\"elapsed\":%.9g,\"requests_per_second\":%.9g,\"throughput\":%.9g,\"p50\":%.9g,\"p90\":%.9g,\"p99\":%.9g,\"p999\":%.9g,\"max\":%.9g}\n",
+      config.connections, config.pipeline, requests, errors, elapsed, requests / elapsed, bytes_in / elapsed, percentile(0.5) / 1e6,
+      percentile(0.9) / 1e6, percentile(0.99) / 1e6, percentile(0.999) / 1e6, latencies.back() / 1e6);
+  } else {
+    printf("requests:     %zu (%zu errors), %u connections, pipeline %u, %.1f s\n", requests, errors, config.connections, config.pipeline, elapsed);
+    printf("throughput:   %.0f requests/s, %.2f MB/s in, %.2f MB/s out\n", requests / elapsed, bytes_in / elapsed / 1e6, bytes_out / elapsed / 1e6);
+    printf("latency (us): p50 %.1f, p90 %.1f, p99 %.1f, p99.9 %.1f, max %.1f\n", percentile(0.5), percentile(0.9), percentile(0.99), percentile(0.999), latencies.back());
+  }
+
+  if (config.stats) {
+    printf("%s\n", daemon_stats(config).c_str());
+  }
+
+  return 0;
+}
@@ -9,4 +9,45 @@ if ENV["DTEXT_DEBUG"]
   $CXXFLAGS << " -g3 -fsanitize=undefined,leak -DDEBUG -D_GLIBCXX_DEBUG -D_GLIBCXX_DEBUG_PEDANTIC -D_GLIBCXX_SANITIZE_VECTOR -D_FORTIFY_SOURCE=3"
 end
 
+# Per-rule scanner counters for DText.profile_snapshot. DTEXT_PROFILE=cycles also counts the cycles spent in each rule.
+if ENV["DTEXT_PROFILE"]
+  $CXXFLAGS << " -DDTEXT_PROFILE"
+  $CXXFLAGS << " -DDTEXT_PROFILE_CYCLES" if ENV["DTEXT_PROFILE"] == "cycles"
+end
+
+have_func "rb_ext_ractor_safe", "ruby.h"
+
+# DTEXT_PGO=1 builds with profile-guided and link-time optimization. First, the parser is built into a copy of cdtext
+# instrumented with -fprofile-generate, which renders the training corpus (pgo_corpus.ndjson, written by
+# test/pgo_corpus.rb from the inputs of test_dtext.rb and the documents of bench_dtext.rb) with each set of options.
+# Then the extension is built with -fprofile-use, which lays out the scanner's branches for the paths the corpus took,
+# and with -flto. The instrumented dtext.o is compiled here, in the build directory, with the same flags as the Makefile
+# uses, so that -fprofile-use finds its profile (dtext.gcda) when the Makefile compiles dtext.o again.
+if ENV["DTEXT_PGO"]
+  require "fileutils"
+
+  cxx = "#{RbConfig::CONFIG["CXX"]} #{RbConfig::CONFIG["CCDLFLAGS"]} #{$CXXFLAGS} #{$ARCH_FLAG} -fprofile-generate"
+  corpus = File.join($srcdir, "pgo_corpus.ndjson")
+  option_sets = [
+    [], %w[--inline], %w[--qtags], %w[--allow-color], %w[--max-visible-chars=200],
+    %w[--base-url=https://example.com --domain=example.com --internal-domain=example.com],
+  ]
+
+  FileUtils.rm_f(Dir["*.gcda"])
+  trained = xsystem("#{cxx} -o dtext.o -c #{$srcdir}/dtext.cpp") &&
+    xsystem("#{cxx} -o pgo_train dtext.o #{$srcdir}/libdtext.cpp #{$srcdir}/cdtext.cpp -pthread") &&
+    option_sets.all? { |options| system("./pgo_train", "--ndjson", "--bench=20", *options, in: corpus, out: File::NULL) }
+  abort "DTEXT_PGO: training the profile failed" unless trained && File.exist?("dtext.gcda")
+  FileUtils.rm_f(["dtext.o", "pgo_train", *Dir["pgo_train-*.gcda"]])
+
+  # -fprofile-partial-training keeps the code the corpus didn't reach optimized for speed rather than for size.
+  $CXXFLAGS << " -fprofile-use -fprofile-partial-training -Wno-missing-profile -flto=auto"
+  $LDFLAGS << " -flto=auto -O2"
+end
+
+# cdtext.cpp is the command-line frontend (bin/cdtext.exe), fuzz_dtext.cpp the fuzzer (bin/fuzz_dtext.exe), dtextd.cpp
+# and dtextd_load.cpp the render daemon and its load-test client (bin/dtextd.exe), and libdtext.cpp the C API (built by
+# CMakeLists.txt); none of them are part of the extension.
+$srcs = %w[dtext.cpp rb_dtext.cpp]
+
 create_makefile "dtext/dtext"
@@ -0,0 +1,489 @@
+// fuzz_dtext: a fuzzer that looks for inputs that are expensive to parse rather than inputs that crash the parser.
+//
+// Each input is a short unit that's repeated until it's INPUT_BYTES long, the same way bench_pathological.rb builds
+// its inputs, and its cost is the work the parser does per input byte. Units that cost more per byte are kept and
+// mutated further, so the search drifts toward inputs that make the scanner rescan or backtrack.
+//
+// It builds in two ways:
+//
+// * As a standalone program (the default), with its own mutation loop. dtext.cpp must be built with
+//   `-fsanitize-coverage=trace-pc` and this file with -DDTEXT_FUZZ_TRACE_PC (see `bin/rake fuzz`), so that the cost is
+//   the number of basic blocks the parser executes, which is deterministic. Like PerfFuzz, a unit is kept if it's the
+//   most expensive per byte so far either in total or in any single basic block, so that the search doesn't collapse
+//   onto the first expensive rule it finds. At the end of the run it measures how the kept units scale with the input
+//   size, shrinks the superlinear ones to a minimal unit, and prints them as JSON lines. test/fuzz_pathological.rb
+//   runs it and adds the new units to test/files/pathological/.
+// * With -DDTEXT_LIBFUZZER, as a libFuzzer (or AFL++) target. The cost is the CPU time of the parse, reported through
+//   libFuzzer's extra counters as one counter per power-of-two bucket of nanoseconds per byte, so inputs that reach a
+//   new bucket are kept in the corpus. The corpus can then be passed to the standalone program to be minimized.
+
+#include "dtext.h"
+
+#include <algorithm>
+#include <array>
+#include <charconv>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <fstream>
+#include <iterator>
+#include <random>
+#include <set>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#if !defined(DTEXT_LIBFUZZER) && !defined(DTEXT_FUZZ_TRACE_PC)
+#error "the standalone fuzzer needs dtext.cpp built with -fsanitize-coverage=trace-pc and -DDTEXT_FUZZ_TRACE_PC"
+#endif
+
+static const size_t INPUT_BYTES = 1024;  // The size of the input a unit is repeated to when measuring its cost.
+static const size_t MAX_UNIT_BYTES = 64; // Longer units are truncated.
+static const size_t BLOCK_SLOTS = 4096;  // Basic blocks are counted in this many slots, by a hash of their address.
+
+#ifdef DTEXT_FUZZ_TRACE_PC
+static uint64_t basic_blocks = 0;
+static std::array<uint32_t, BLOCK_SLOTS> block_hits; // The hits of each slot during the last call to cost().
+
+// Called by the instrumentation in dtext.cpp at the start of every basic block.
+extern "C" void __sanitizer_cov_trace_pc() {
+  uintptr_t address = reinterpret_cast<uintptr_t>(__builtin_return_address(0));
+  block_hits[(address * 0x9E3779B97F4A7C15ull) >> 52]++;
+  basic_blocks++;
+}
+
+static uint64_t cost_counter() {
+  return basic_blocks;
+}
+#else
+static uint64_t cost_counter() {
+  timespec time;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &time);
+  return time.tv_sec * 1'000'000'000ull + time.tv_nsec;
+}
+#endif
+
+// Repeat the (non-empty) unit until the input is at least `size` bytes (and at least one unit long).
+static std::string repeat(const std::string_view unit, const size_t size) {
+  std::string input;
+  input.reserve(size + unit.size());
+
+  do {
+    input += unit;
+  } while (input.size() + unit.size() <= size);
+
+  return input;
+}
+
+// The parser's cost for the unit repeated to `size` bytes. Errors (like hitting the timeout) still count, since the work
+// done before failing is what's being measured.
+static uint64_t cost(const std::string_view unit, const size_t size) {
+  DTextOptions options;
+  options.f_allow_color = false;
+  options.timeout = std::chrono::seconds(1);
+
+  std::string input = repeat(unit, size);
+#ifdef DTEXT_FUZZ_TRACE_PC
+  block_hits.fill(0);
+#endif
+  uint64_t start = cost_counter();
+
+  try {
+    StateMachine::parse_dtext(input, options);
+  } catch (const DTextError&) {
+  } catch (const std::exception& e) {
+    // Any other exception is a bug in the parser; report it, but carry on looking for slow inputs.
+    fprintf(stderr, "fuzz_dtext: %s: %s\n", std::string(unit).c_str(), e.what());
+  }
+
+  return cost_counter() - start;
+}
+
+static double cost_per_byte(const std::string_view unit, const size_t size = INPUT_BYTES) {
+  return static_cast<double>(cost(unit, size)) / repeat(unit, size).size();
+}
+
+// How the cost grows with the input size, as the exponent of a power law fitted between size and 4 * size (1.0 is
+// linear, 2.0 is quadratic).
+static double exponent(const std::string_view unit, const size_t size = INPUT_BYTES) {
+  double small = cost(unit, size), large = cost(unit, size * 4);
+  double ratio = static_cast<double>(repeat(unit, size * 4).size()) / repeat(unit, size).size();
+
+  return small > 0 ? std::log(large / small) / std::log(ratio) : 0;
+}
+
+// Units must be valid DText input: no null bytes, and (since units are only built from ASCII and dictionary tokens)
+// no partial UTF-8 sequences at the ends.
+static std::string sanitize(std::string_view data) {
+  std::string unit;
+
+  for (char c : data.substr(0, MAX_UNIT_BYTES)) {
+    if (c > 0 && c != '\r') {
+      unit += c;
+    }
+  }
+
+  return unit;
+}
+
+#ifdef DTEXT_LIBFUZZER
+
+// One counter per power-of-two bucket of nanoseconds per byte; libFuzzer treats a counter that's set for the first time as
+// new coverage.
+__attribute__((section("__libfuzzer_extra_counters"))) static uint8_t cost_buckets[64];
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+  std::string unit = sanitize(std::string_view(reinterpret_cast<const char*>(data), size));
+
+  if (unit.empty()) {
+    return 0;
+  }
+
+  double per_byte = cost_per_byte(unit);
+  cost_buckets[std::clamp(static_cast<int>(std::log2(per_byte + 1)), 0, 63)] = 1;
+
+  return 0;
+}
+
+#else
+
+static const char* USAGE = R"(Usage: fuzz_dtext [OPTIONS] [UNIT_FILE...]
+
+Search for short units of DText that are expensive to parse per byte when repeated, then print the ones whose cost
+grows faster than linearly with the input size, minimized, as JSON lines on stdout. Each UNIT_FILE (for example, a
+libFuzzer corpus) is used as a starting point for the search. The cost is the number of basic blocks executed by the
+parser per byte of a 1 KB input.
+
+Options:
+    -dict=FILE              Read tokens to insert from FILE, in libFuzzer/AFL dictionary format (name="value").
+    -max_total_time=SECS    Search for this many seconds. Default: 60.
+    -runs=N                 Stop the search after N mutations.
+    -seed=N                 The random seed. Default: the current time.
+    -min_exponent=X         Only print units whose cost scales at least as fast as n^X. Default: 1.3.
+    -ignore=FILE            Don't print units that contain, or are contained in, the units in FILE (in dictionary
+                            format), like the families that are already known to be superlinear.
+    -top=N                  Minimize and print at most N units. Default: 16.
+    -h, --help              Show this help.
+)";
+
+struct Config {
+  std::vector<std::string> dictionary;
+  double max_total_time = 60;
+  size_t runs = SIZE_MAX;
+  unsigned int seed = std::random_device()();
+  double min_exponent = 1.3;
+  size_t top = 16;
+  std::vector<std::string> ignore;
+};
+
+struct Candidate {
+  std::string unit;
+  double cost_per_byte;
+};
+
+// The units kept so far, and for each block slot (plus one for the total cost), the most hits per byte of any unit and
+// the index of that unit.
+struct Corpus {
+  std::vector<Candidate> units;
+  std::array<double, BLOCK_SLOTS + 1> best{};
+  std::array<size_t, BLOCK_SLOTS + 1> champion;
+  std::vector<size_t> slots; // The slots that have a champion.
+  std::set<std::string> seen;
+};
+
+[[noreturn]] static void die(const std::string& message) {
+  fprintf(stderr, "fuzz_dtext: %s\n", message.c_str());
+  exit(2);
+}
+
+static double parse_number(const std::string_view option, const std::string_view value) {
+  double n = 0;
+  auto [end, error] = std::from_chars(value.data(), value.data() + value.size(), n);
+
+  if (error != std::errc() || end != value.data() + value.size()) {
+    die("invalid number for " + std::string(option) + ": " + std::string(value));
+  }
+
+  return n;
+}
+
+static std::string read_file(const std::string& path) {
+  std::ifstream file(path, std::ios::binary);
+
+  if (!file) {
+    die("can't read " + path);
+  }
+
+  return std::string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+}
+
+// Parse a dictionary in the libFuzzer/AFL format: one `name="value"` per line, with \\, \" and \xNN escapes.
+static std::vector<std::string> read_dictionary(const std::string& path) {
+  std::vector<std::string> tokens;
+  std::istringstream lines(read_file(path));
+
+  for (std::string line; std::getline(lines, line);) {
+    size_t start = line.find('"'), end = line.rfind('"');
+
+    if (line.starts_with("#") || start == std::string::npos || end <= start) {
+      continue;
+    }
+
+    std::string token;
+    for (size_t i = start + 1; i < end; i++) {
+      if (line[i] == '\\' && i + 1 < end && line[i + 1] == 'x' && i + 3 < end) {
+        token += static_cast<char>(std::stoi(line.substr(i + 2, 2), nullptr, 16));
+        i += 3;
+      } else if (line[i] == '\\' && i + 1 < end) {
+        token += line[++i];
+      } else {
+        token += line[i];
+      }
+    }
+
+    if (!token.empty()) {
+      tokens.push_back(token);
+    }
+  }
+
+  return tokens;
+}
+
+static Config parse_args(int argc, char** argv, std::vector<std::string>& files) {
+  Config config;
+
+  for (int i = 1; i < argc; i++) {
+    std::string_view arg = argv[i];
+    std::string_view name = arg.substr(0, arg.find('='));
+    std::string_view value = arg.find('=') == std::string_view::npos ? "" : arg.substr(arg.find('=') + 1);
+
+    if (arg == "-h" || arg == "--help") {
+      fputs(USAGE, stdout);
+      exit(0);
+    } else if (name == "-dict") {
+      config.dictionary = read_dictionary(std::string(value));
+    } else if (name == "-max_total_time") {
+      config.max_total_time = parse_number(name, value);
+    } else if (name == "-runs") {
+      config.runs = parse_number(name, value);
+    } else if (name == "-seed") {
+      config.seed = parse_number(name, value);
+    } else if (name == "-min_exponent") {
+      config.min_exponent = parse_number(name, value);
+    } else if (name == "-ignore") {
+      config.ignore = read_dictionary(std::string(value));
+    } else if (name == "-top") {
+      config.top = std::max<size_t>(parse_number(name, value), 1);
+    } else if (arg.starts_with("-")) {
+      die("unknown option: " + std::string(arg) + " (see --help)");
+    } else {
+      files.push_back(std::string(arg));
+    }
+  }
+
+  return config;
+}
+
+// Apply one random edit to the unit: insert a dictionary token, insert, replace or delete a character, duplicate a
+// slice, or splice in part of another unit.
+static std::string mutate(std::string unit, const std::vector<Candidate>& units, const std::vector<std::string>& dictionary, std::mt19937& random) {
+  static const std::string_view CHARACTERS = "abc ABC 019 []{}()<>\"':|=#/.-_*@!?&%,;\\\n\t";
+  auto below = [&](size_t n) { return std::uniform_int_distribution<size_t>(0, n - 1)(random); };
+  size_t position = below(unit.size() + 1);
+
+  switch (below(6)) {
+    case 0:
+      if (!dictionary.empty()) {
+        unit.insert(position, dictionary[below(dictionary.size())]);
+        break;
+      }
+      [[fallthrough]];
+    case 1:
+      unit.insert(position, 1, CHARACTERS[below(CHARACTERS.size())]);
+      break;
+    case 2:
+      if (position < unit.size()) {
+        unit[position] = CHARACTERS[below(CHARACTERS.size())];
+      }
+      break;
+    case 3:
+      if (unit.size() > 1) {
+        unit.erase(std::min(position, unit.size() - 1), 1 + below(std::min<size_t>(unit.size() - 1, 4)));
+      }
+      break;
+    case 4:
+      if (!unit.empty()) {
+        size_t start = below(unit.size());
+        unit.insert(position, unit.substr(start, 1 + below(unit.size() - start)));
+      }
+      break;
+    case 5:
+      const std::string& other = units[below(units.size())].unit;
+      unit.insert(position, other.substr(below(other.size())));
+      break;
+  }
+
+  return sanitize(unit);
+}
+
+// Measure the unit and keep it if it's the most expensive unit per byte so far, in total or in any block slot.
+static bool admit(Corpus& corpus, const std::string& unit) {
+  if (unit.empty() || !corpus.seen.insert(unit).second) {
+    return false;
+  }
+
+  double bytes = repeat(unit, INPUT_BYTES).size();
+  double total = cost(unit, INPUT_BYTES) / bytes;
+  size_t index = corpus.units.size();
+  bool kept = false;
+
+  for (size_t slot = 0; slot <= BLOCK_SLOTS; slot++) {
+    double per_byte = slot < BLOCK_SLOTS ? block_hits[slot] / bytes : total;
+
+    if (per_byte > corpus.best[slot]) {
+      if (corpus.best[slot] == 0) {
+        corpus.slots.push_back(slot);
+      }
+
+      corpus.best[slot] = per_byte;
+      corpus.champion[slot] = index;
+      kept = true;
+    }
+  }
+
+  if (kept) {
+    corpus.units.push_back({ unit, total });
+  }
+
+  return kept;
+}
+
+// Shrink the unit by deleting runs of characters for as long as it stays superlinear, then replace the characters that
+// don't matter with `a`, so that variants of the same unit minimize to the same thing.
+static std::string minimize(std::string unit, const double min_exponent) {
+  for (bool shrunk = true; shrunk;) {
+    shrunk = false;
+
+    for (size_t length = std::max<size_t>(unit.size() / 2, 1); length >= 1 && !shrunk; length /= 2) {
+      for (size_t start = 0; start + length <= unit.size() && unit.size() > length; start++) {
+        std::string smaller = unit.substr(0, start) + unit.substr(start + length);
+
+        if (!smaller.empty() && exponent(smaller) >= min_exponent) {
+          unit = smaller;
+          shrunk = true;
+          break;
+        }
+      }
+    }
+  }
+
+  for (char& c : unit) {
+    char original = std::exchange(c, 'a');
+
+    if (exponent(unit) < min_exponent) {
+      c = original;
+    }
+  }
+
+  return unit;
+}
+
+static std::string json_string(const std::string_view string) {
+  std::string json = "\"";
+
+  for (unsigned char c : string) {
+    if (c == '"' || c == '\\') {
+      json += '\\';
+      json += c;
+    } else if (c < 0x20) {
+      char escape[8];
+      snprintf(escape, sizeof(escape), "\\u%04x", c);
+      json += escape;
+    } else {
+      json += c;
+    }
+  }
+
+  return json + "\"";
+}
+
+// Whether either unit contains the other, or a rotation of it (since `ab` repeated is `ba` repeated, give or take a
+// character at the ends).
+static bool overlaps(const std::string& unit, const std::vector<std::string>& units) {
+  return std::any_of(units.begin(), units.end(), [&](auto& other) {
+    return (unit + unit).find(other) != std::string::npos || (other + other).find(unit) != std::string::npos;
+  });
+}
+
+int main(int argc, char** argv) {
+  std::vector<std::string> files;
+  Config config = parse_args(argc, argv, files);
+  std::mt19937 random(config.seed);
+  Corpus corpus;
+
+  std::vector<std::string> seeds = config.dictionary;
+  seeds.push_back("lorem ipsum ");
+  for (const auto& file : files) {
+    seeds.push_back(read_file(file));
+  }
+
+  for (const auto& seed : seeds) {
+    admit(corpus, sanitize(seed));
+  }
+
+  if (corpus.units.empty()) {
+    die("no usable seeds");
+  }
+
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::duration<double>(config.max_total_time);
+  size_t runs = 0;
+
+  for (; runs < config.runs && std::chrono::steady_clock::now() < deadline; runs++) {
+    // Mutate the champion of a random slot, so that units that are the most expensive for a rare block get as many
+    // chances as the ones that are the most expensive for common blocks.
+    size_t slot = corpus.slots[random() % corpus.slots.size()];
+    admit(corpus, mutate(corpus.units[corpus.champion[slot]].unit, corpus.units, config.dictionary, random));
+  }
+
+  std::set<size_t> indexes;
+  for (size_t slot : corpus.slots) {
+    indexes.insert(corpus.champion[slot]);
+  }
+
+  std::vector<Candidate> champions;
+  for (size_t index : indexes) {
+    champions.push_back(corpus.units[index]);
+  }
+
+  std::sort(champions.begin(), champions.end(), [](auto& a, auto& b) { return a.cost_per_byte > b.cost_per_byte; });
+
+  fprintf(stderr, "fuzz_dtext: %zu runs, %zu units kept, best: %.1f basic blocks per byte (seed %u)\n", runs, corpus.units.size(), champions.front().cost_per_byte, config.seed);
+
+  // Minimize the most expensive superlinear units, skipping units that contain one that's already been found (or is
+  // ignored), since they're most likely slow for the same reason.
+  std::vector<std::string> found = config.ignore;
+  for (size_t printed = 0; const auto& candidate : champions) {
+    if (printed >= config.top || overlaps(candidate.unit, found) || exponent(candidate.unit) < config.min_exponent) {
+      continue;
+    }
+
+    std::string unit = minimize(candidate.unit, config.min_exponent);
+    if (overlaps(unit, found)) {
+      continue;
+    }
+
+    found.push_back(unit);
+    printed++;
+    printf("{\"unit\":%s,\"cost_per_byte\":%.2f,\"exponent\":%.2f}\n", json_string(unit).c_str(), cost_per_byte(unit), exponent(unit));
+    fflush(stdout);
+  }
+
+  return 0;
+}
+
+#endif
@@ -0,0 +1,196 @@
+// The C API in libdtext.h, on top of StateMachine::parse_dtext.
+
+#include "libdtext.h"
+#include "dtext.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <string>
+#include <string_view>
+
+#ifndef DTEXT_VERSION
+#define DTEXT_VERSION "unknown"
+#endif
+
+// Whether the caller's options struct is new enough to have the field (see dtext_options::size).
+#define HAS_OPTION(options, field) ((options)->size >= offsetof(dtext_options, field) + sizeof((options)->field))
+
+static DTextOptions convert_options(const dtext_options* options) {
+  DTextOptions result;
+  result.f_allow_color = false;
+
+  if (!options) {
+    return result;
+  }
+
+  if (HAS_OPTION(options, f_qtags)) {
+    result.f_inline = options->f_inline;
+    result.f_allow_color = options->f_allow_color;
+    result.f_qtags = options->f_qtags;
+  }
+
+  if (HAS_OPTION(options, internal_domains_count)) {
+    result.base_url = options->base_url ? options->base_url : "";
+    result.domain = options->domain ? options->domain : "";
+
+    for (size_t i = 0; i < options->internal_domains_count; i++) {
+      result.internal_domains.insert(options->internal_domains[i]);
+    }
+  }
+
+  if (HAS_OPTION(options, max_visible_chars)) {
+    result.max_output_bytes = options->max_output_bytes;
+    result.max_dstack_depth = options->max_dstack_depth;
+    result.timeout = std::chrono::microseconds(options->timeout_us);
+    result.max_visible_chars = options->max_visible_chars;
+  }
+
+  return result;
+}
+
+// Copy the string into a null-terminated malloc'd string, or throw std::bad_alloc.
+static char* copy_string(const std::string_view string) {
+  char* copy = static_cast<char*>(malloc(string.size() + 1));
+
+  if (!copy) {
+    throw std::bad_alloc();
+  }
+
+  memcpy(copy, string.data(), string.size());
+  copy[string.size()] = '\0';
+
+  return copy;
+}
+
+template <typename T>
+static T* allocate_array(const size_t count) {
+  T* array = static_cast<T*>(calloc(count ? count : 1, sizeof(T)));
+
+  if (!array) {
+    throw std::bad_alloc();
+  }
+
+  return array;
+}
+
+// Fail with the given status and message. The message is left NULL if it can't be copied.
+static dtext_status fail(dtext_result* result, const dtext_status status, const char* message) {
+  dtext_result_free(result);
+  result->error = strdup(message);
+  return status;
+}
+
+void dtext_options_init(dtext_options* options) {
+  *options = dtext_options{};
+  options->size = sizeof(dtext_options);
+}
+
+dtext_status dtext_parse(const char* dtext, size_t length, const dtext_options* options, dtext_result* result) {
+  if (!result) {
+    return DTEXT_INVALID_INPUT;
+  }
+
+  *result = dtext_result{};
+
+  if (!dtext && length > 0) {
+    return fail(result, DTEXT_INVALID_INPUT, "input is NULL");
+  } else if (const char* reason = dtext_validate(dtext, length)) {
+    return fail(result, DTEXT_INVALID_INPUT, reason);
+  }
+
+  try {
+    auto [html, creators, posts, qtags, truncated] = StateMachine::parse_dtext(std::string_view(dtext, length), convert_options(options));
+
+    result->html = copy_string(html);
+    result->html_length = html.size();
+    result->truncated = truncated;
+
+    result->creators = allocate_array<char*>(creators.size());
+    for (const auto& creator : creators) {
+      result->creators[result->creators_count++] = copy_string(creator);
+    }
+
+    result->post_ids = allocate_array<long>(posts.size());
+    std::copy(posts.begin(), posts.end(), result->post_ids);
+    result->post_ids_count = posts.size();
+
+    result->qtags = allocate_array<char*>(qtags.size());
+    for (const auto& qtag : qtags) {
+      result->qtags[result->qtags_count++] = copy_string(qtag);
+    }
+
+    return DTEXT_OK;
+  } catch (const std::bad_alloc&) {
+    return fail(result, DTEXT_OUT_OF_MEMORY, "out of memory");
+  } catch (const DTextLimitExceeded& e) {
+    return fail(result, DTEXT_LIMIT_EXCEEDED, e.what());
+  } catch (const std::exception& e) {
+    return fail(result, DTEXT_ERROR, e.what());
+  }
+}
+
+void dtext_result_free(dtext_result* result) {
+  if (!result) {
+    return;
+  }
+
+  for (size_t i = 0; i < result->creators_count; i++) {
+    free(result->creators[i]);
+  }
+
+  for (size_t i = 0; i < result->qtags_count; i++) {
+    free(result->qtags[i]);
+  }
+
+  free(result->html);
+  free(result->creators);
+  free(result->post_ids);
+  free(result->qtags);
+  free(result->error);
+
+  *result = dtext_result{};
+}
+
+// The same checks as DText.parse: no null bytes, and valid UTF-8 (no overlong encodings, surrogates or codepoints past
+// U+10FFFF).
+const char* dtext_validate(const char* dtext, size_t length) {
+  std::string_view text(dtext ? dtext : "", dtext ? length : 0);
+
+  if (text.find('\0') != std::string_view::npos) {
+    return "input contains null byte";
+  }
+
+  for (size_t i = 0; i < text.size();) {
+    unsigned char c = text[i];
+    size_t char_length = c < 0x80 ? 1 : (c >> 5) == 0x6 ? 2 : (c >> 4) == 0xE ? 3 : (c >> 3) == 0x1E ? 4 : 0;
+    uint32_t codepoint = char_length == 1 ? c : char_length == 2 ? c & 0x1F : char_length == 3 ? c & 0x0F : c & 0x07;
+
+    if (char_length == 0 || i + char_length > text.size()) {
+      return "input contains invalid UTF-8";
+    }
+
+    for (size_t j = 1; j < char_length; j++) {
+      if ((text[i + j] & 0xC0) != 0x80) {
+        return "input contains invalid UTF-8";
+      }
+
+      codepoint = (codepoint << 6) | (text[i + j] & 0x3F);
+    }
+
+    static const uint32_t min_codepoint[] = { 0, 0, 0x80, 0x800, 0x10000 };
+    if (codepoint < min_codepoint[char_length] || codepoint > 0x10FFFF || (codepoint >= 0xD800 && codepoint <= 0xDFFF)) {
+      return "input contains invalid UTF-8";
+    }
+
+    i += char_length;
+  }
+
+  return NULL;
+}
+
+const char* dtext_version(void) {
+  return DTEXT_VERSION;
+}
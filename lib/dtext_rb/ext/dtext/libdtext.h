@@ -0,0 +1,102 @@
+#ifndef LIBDTEXT_H
+#define LIBDTEXT_H
+
+// libdtext: the DText parser as a C library, for programs that want to render DText without Ruby. It's built by the
+// CMakeLists.txt at the root of the gem as libdtext.a and libdtext.so. Only the functions in this file are exported
+// from libdtext.so; its soname changes whenever they or the structs below change incompatibly.
+//
+//   dtext_options options;
+//   dtext_result result;
+//
+//   dtext_options_init(&options);
+//   options.f_qtags = true;
+//
+//   if (dtext_parse(input, length, &options, &result) == DTEXT_OK) {
+//     fwrite(result.html, 1, result.html_length, stdout);
+//   } else {
+//     fprintf(stderr, "%s\n", result.error);
+//   }
+//
+//   dtext_result_free(&result);
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(_WIN32)
+#define DTEXT_API __declspec(dllexport)
+#else
+#define DTEXT_API __attribute__((visibility("default")))
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum dtext_status {
+  DTEXT_OK = 0,
+  DTEXT_INVALID_INPUT,   // The input contains a null byte or invalid UTF-8, or an argument is NULL.
+  DTEXT_LIMIT_EXCEEDED,  // The parse went over max_output_bytes, max_dstack_depth or timeout_us.
+  DTEXT_OUT_OF_MEMORY,
+  DTEXT_ERROR,           // Any other error; see dtext_result.error.
+} dtext_status;
+
+typedef struct dtext_options {
+  // The size of this struct, set by dtext_options_init. Fields added in later versions go at the end, and the library
+  // uses their defaults for callers compiled against an older, smaller struct.
+  size_t size;
+
+  bool f_inline;       // If true, strip block-level elements (for displaying DText in small spaces).
+  bool f_allow_color;  // If true, allow [color] tags.
+  bool f_qtags;        // If true, parse #qtags.
+
+  const char* base_url; // If not NULL, convert relative URLs to absolute URLs.
+  const char* domain;   // If not NULL, links to this domain are internal links rather than external links.
+
+  // Links to these domains are converted to shortlinks (for example, post #1234 instead of a link to /posts/1234).
+  const char* const* internal_domains;
+  size_t internal_domains_count;
+
+  size_t max_output_bytes;  // If nonzero, fail with DTEXT_LIMIT_EXCEEDED once the output grows past this many bytes.
+  size_t max_dstack_depth;  // If nonzero, fail once more than this many elements are open at the same time.
+  uint64_t timeout_us;      // If nonzero, fail once parsing has taken longer than this many microseconds.
+  size_t max_visible_chars; // If nonzero, stop after this many characters of visible text and set truncated.
+} dtext_options;
+
+// Everything in a dtext_result is owned by the library and freed by dtext_result_free. Strings are null-terminated.
+typedef struct dtext_result {
+  char* html;
+  size_t html_length;
+
+  char** creators;       // The creator names mentioned in [[creator]] links, in no particular order.
+  size_t creators_count;
+  long* post_ids;        // The ids of the posts embedded with `thumb #1234`, in order.
+  size_t post_ids_count;
+  char** qtags;          // The #qtags, in order (only if f_qtags is set).
+  size_t qtags_count;
+
+  bool truncated;        // Whether the output was cut short by max_visible_chars.
+  char* error;           // If dtext_parse failed, why (or NULL if it ran out of memory); otherwise NULL.
+} dtext_result;
+
+// Set the options to their defaults (the same as DText.parse's): no flags, no limits.
+DTEXT_API void dtext_options_init(dtext_options* options);
+
+// Parse `length` bytes of DText into `result`, which must be freed with dtext_result_free whether or not the parse
+// succeeded. `options` may be NULL to use the defaults. Safe to call from multiple threads at once.
+DTEXT_API dtext_status dtext_parse(const char* dtext, size_t length, const dtext_options* options, dtext_result* result);
+
+// Free everything in the result and reset it to empty. Safe to call on an empty result.
+DTEXT_API void dtext_result_free(dtext_result* result);
+
+// Return why the input can't be parsed (it contains a null byte or invalid UTF-8), or NULL if it can.
+DTEXT_API const char* dtext_validate(const char* dtext, size_t length);
+
+// The version of the parser, like "1.15.9".
+DTEXT_API const char* dtext_version(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
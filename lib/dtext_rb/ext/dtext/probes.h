@@ -0,0 +1,14 @@
+#ifndef DTEXT_PROBES_H
+#define DTEXT_PROBES_H
+
+// USDT probes for SystemTap and bpftrace, in the `dtext` provider (see the README for the list). They're compiled in
+// when sys/sdt.h is available (it's in systemtap-sdt-dev), and each one is a single nop unless it's being traced, so
+// they're left in release builds. Build with -DDTEXT_NO_PROBES to leave them out anyway.
+#if __has_include(<sys/sdt.h>) && !defined(DTEXT_NO_PROBES)
+#include <sys/sdt.h>
+#define g_probe(name, ...) STAP_PROBEV(dtext, name, __VA_ARGS__)
+#else
+#define g_probe(name, ...)
+#endif
+
+#endif
@@ -1,46 +1,187 @@
 #include "dtext.h"
 
+#include <algorithm>
+#include <memory>
 #include <ruby.h>
 #include <ruby/encoding.h>
 
 static VALUE cDText = Qnil;
 static VALUE cDTextError = Qnil;
+static VALUE cDTextLimitExceeded = Qnil;
+static VALUE cDTextStaleIR = Qnil;
+static VALUE cDTextStream = Qnil;
 
-static void validate_dtext(VALUE string) {
+// Rendered blocks shared by all parses with `cache_blocks: true`.
+static BlockCache block_cache(16 * 1024 * 1024);
+
+// How the documents parsed with `threads:` were split, returned by DText.parallel_stats.
+static ParallelStats parallel_stats;
+
+// Parse results of short strings, if enabled with DText.render_cache_max_bytes=.
+static RenderCache render_cache;
+
+// Parse results of short strings shared with other processes, if enabled with DText.open_shared_render_cache.
+static SharedRenderCache shared_render_cache;
+
+// Counters and latency histograms of every DText.parse, returned by DText.stats.
+static ParseStats parse_stats;
+
+// The inputs of slow DText.parse calls, if enabled with DText.capture_slow_samples.
+static SlowSamples slow_samples;
+
+// A streaming parse. The output of each chunk is collected in `html` until it's returned to Ruby.
+struct DTextStream {
+  std::unique_ptr<StateMachine> sm;
+  std::string html;
+  std::string partial_char; // An incomplete UTF-8 character at the end of the last chunk.
+};
+
+// Return why the string isn't valid DText input, or NULL if it is.
+static const char * invalid_dtext_reason(VALUE string) {
   // if input.encoding != Encoding::UTF_8 || input.encoding != Encoding::USASCII
   int encoding = rb_enc_get_index(string);
   if (encoding != rb_usascii_encindex() && encoding != rb_utf8_encindex()) {
-    rb_raise(cDTextError, "input must be US-ASCII or UTF-8");
+    return "input must be US-ASCII or UTF-8";
   }
 
   // if !input.valid_encoding?
   // https://github.com/ruby/ruby/blob/2d9812713171097eb4a3f38e49d9be39d90da2f6/string.c#L10847
   if (rb_enc_str_coderange(string) == ENC_CODERANGE_BROKEN) {
-    rb_raise(cDTextError, "input contains invalid UTF-8");
+    return "input contains invalid UTF-8";
   }
 
   if (memchr(RSTRING_PTR(string), 0, RSTRING_LEN(string))) {
-    rb_raise(cDTextError, "input contains null byte");
+    return "input contains null byte";
+  }
+
+  return NULL;
+}
+
+static void validate_dtext(VALUE string) {
+  if (const char * reason = invalid_dtext_reason(string)) {
+    rb_raise(cDTextError, "%s", reason);
   }
 }
 
-static auto parse_dtext(VALUE input, DTextOptions options = {}) {
+// Thrown when the block passed to DText.each_event raises (or breaks), so the parser can unwind before the jump is
+// resumed with rb_jump_tag.
+struct RubyJump {
+  int state;
+};
+
+// Yields parse events to the block passed to DText.each_event.
+class RubyEventHandler : public DTextEventHandler {
+public:
+  void on_open(element_t element, const std::map<std::string_view, std::string_view>& attributes) override {
+    VALUE attrs = rb_hash_new();
+
+    for (auto [name, value] : attributes) {
+      rb_hash_aset(attrs, rb_utf8_str_new(name.data(), name.size()), rb_utf8_str_new(value.data(), value.size()));
+    }
+
+    yield(rb_ary_new_from_args(3, ID2SYM(rb_intern("open")), element_symbol(element), attrs));
+  }
+
+  void on_close(element_t element) override {
+    yield(rb_ary_new_from_args(2, ID2SYM(rb_intern("close")), element_symbol(element)));
+  }
+
+  void on_text(const std::string_view text) override {
+    yield(rb_ary_new_from_args(2, ID2SYM(rb_intern("text")), rb_utf8_str_new(text.data(), text.size())));
+  }
+
+  void on_link(link_t kind, const std::string_view url, const std::string_view title) override {
+    static const char * kinds[] = { "external", "internal", "id", "creator", "post_search", "anchor" };
+    VALUE rb_url = rb_utf8_str_new(url.data(), url.size());
+    VALUE rb_title = rb_utf8_str_new(title.data(), title.size());
+    yield(rb_ary_new_from_args(4, ID2SYM(rb_intern("link")), ID2SYM(rb_intern(kinds[kind])), rb_url, rb_title));
+  }
+
+  void on_qtag(const std::string_view name) override {
+    yield(rb_ary_new_from_args(2, ID2SYM(rb_intern("qtag")), rb_utf8_str_new(name.data(), name.size())));
+  }
+
+private:
+  // BLOCK_P -> :block_p, INLINE_B -> :inline_b
+  static VALUE element_symbol(element_t element) {
+    static const char * names[] = {
+      "dstack_empty", "block_p", "block_note", "block_quote", "block_section", "block_spoiler", "block_nodtext",
+      "block_code", "block_table", "block_colgroup", "block_col", "block_thead", "block_tbody", "block_tr", "block_th",
+      "block_td", "block_ul", "block_li", "block_h1", "block_h2", "block_h3", "block_h4", "block_h5", "block_h6",
+      "inline", "inline_b", "inline_i", "inline_u", "inline_s", "inline_sup", "inline_sub", "inline_color",
+      "inline_note", "inline_code", "inline_spoiler", "inline_nodtext",
+    };
+
+    return ID2SYM(rb_intern(names[element]));
+  }
+
+  static void yield(VALUE event) {
+    int state = 0;
+    rb_protect(rb_yield, event, &state);
+
+    if (state) {
+      throw RubyJump{state};
+    }
+  }
+};
+
+// If stats is given, the parse is recorded in it and in slow_samples (used by DText.parse, for DText.stats and
+// DText.slow_samples).
+static auto parse_dtext(VALUE input, DTextOptions options = {}, DTextEventHandler * events = NULL, BlockCache * cache = NULL, unsigned int threads = 1, ParseStats * stats = NULL) {
+  int state = 0;
+  StringValue(input);
+  auto start = std::chrono::steady_clock::now();
+
   try  {
-    StringValue(input);
-    validate_dtext(input);
+    if (const char * reason = invalid_dtext_reason(input)) {
+      throw DTextError(reason);
+    }
 
+    StateMachine::ParseResult result;
     std::string_view dtext(RSTRING_PTR(input), RSTRING_LEN(input));
-    return StateMachine::parse_dtext(dtext, options);
+
+    if (cache) {
+      result = StateMachine::parse_cached(dtext, options, *cache);
+    } else if (threads > 1) {
+      result = StateMachine::parse_parallel(dtext, options, threads, &parallel_stats);
+    } else if (!events && render_cache.enabled() && dtext.size() <= RenderCache::MAX_INPUT_SIZE) {
+      result = render_cache.parse(dtext, options, shared_render_cache.enabled() ? &shared_render_cache : nullptr);
+    } else if (!events && shared_render_cache.enabled() && dtext.size() <= SharedRenderCache::MAX_INPUT_SIZE) {
+      result = shared_render_cache.parse(dtext, options);
+    } else {
+      result = StateMachine::parse_dtext(dtext, options, events);
+    }
+
+    if (stats) {
+      auto latency = std::chrono::steady_clock::now() - start;
+      stats->record(options, dtext.size(), std::get<0>(result).size(), latency);
+      slow_samples.record(dtext, options, latency, std::get<0>(result).size());
+    }
+
+    return result;
+  } catch (RubyJump& e) {
+    state = e.state;
+  } catch (DTextLimitExceeded& e) {
+    if (stats) {
+      auto latency = std::chrono::steady_clock::now() - start;
+      stats->record_error(options, RSTRING_LEN(input), e.what(), latency);
+      slow_samples.record({ RSTRING_PTR(input), (size_t)RSTRING_LEN(input) }, options, latency, 0, e.what());
+    }
+
+    rb_raise(cDTextLimitExceeded, "%s", e.what());
   } catch (std::exception& e) {
+    if (stats) {
+      auto latency = std::chrono::steady_clock::now() - start;
+      stats->record_error(options, RSTRING_LEN(input), e.what(), latency);
+    }
+
     rb_raise(cDTextError, "%s", e.what());
   }
-}
 
-static VALUE c_parse(VALUE self, VALUE input, VALUE base_url, VALUE domain, VALUE internal_domains, VALUE f_inline, VALUE f_allow_color, VALUE f_qtags) {
-  if (NIL_P(input)) {
-    return Qnil;
-  }
+  rb_jump_tag(state);
+}
 
+static DTextOptions parse_options(VALUE base_url, VALUE domain, VALUE internal_domains, VALUE f_inline, VALUE f_allow_color, VALUE f_qtags, VALUE max_output_bytes, VALUE max_dstack_depth, VALUE timeout) {
   DTextOptions options;
   options.f_inline = RTEST(f_inline);
   options.f_allow_color = RTEST(f_allow_color);
@@ -62,8 +203,25 @@ static VALUE c_parse(VALUE self, VALUE input, VALUE base_url, VALUE domain, VALU
     options.internal_domains.insert(domain);
   }
 
-  auto [dtext, creators, posts, qtags] = parse_dtext(input, options);
-  VALUE retStr = rb_utf8_str_new(dtext.c_str(), dtext.size());
+  if (!NIL_P(max_output_bytes)) {
+    options.max_output_bytes = NUM2SIZET(max_output_bytes);
+  }
+
+  if (!NIL_P(max_dstack_depth)) {
+    options.max_dstack_depth = NUM2SIZET(max_dstack_depth);
+  }
+
+  if (!NIL_P(timeout)) {
+    options.timeout = std::chrono::microseconds(static_cast<long>(NUM2DBL(timeout) * 1'000'000)); // timeout is in seconds.
+  }
+
+  return options;
+}
+
+// The strings in the result are frozen, so the result can be made shareable between Ractors (with
+// Ractor.make_shareable) without copying them. The hash and arrays aren't, since callers often modify them.
+static VALUE build_result(const std::string& dtext, const std::unordered_set<std::string>& creators, const std::vector<long>& posts, const std::vector<std::string>& qtags, bool truncated = false) {
+  VALUE retStr = rb_obj_freeze(rb_utf8_str_new(dtext.c_str(), dtext.size()));
   VALUE retCreators = rb_ary_new_capa(creators.size());
   VALUE retPostIds = rb_ary_new_capa(posts.size());
   VALUE retQtags = rb_ary_new_capa(qtags.size());
@@ -73,24 +231,481 @@ static VALUE c_parse(VALUE self, VALUE input, VALUE base_url, VALUE domain, VALU
   rb_hash_aset(ret, ID2SYM(rb_intern("creators")), retCreators);
   rb_hash_aset(ret, ID2SYM(rb_intern("post_ids")), retPostIds);
   rb_hash_aset(ret, ID2SYM(rb_intern("qtags")), retQtags);
+  rb_hash_aset(ret, ID2SYM(rb_intern("truncated")), truncated ? Qtrue : Qfalse);
+
+  // Sorted, so that the order doesn't depend on how the set was built (e.g. by merging the sets of several threads).
+  std::vector<std::string_view> sorted_creators(creators.begin(), creators.end());
+  std::sort(sorted_creators.begin(), sorted_creators.end());
 
-  for (auto creator : creators) {
-    rb_ary_push(retCreators, rb_str_new(creator.data(), creator.size()));
+  for (auto creator : sorted_creators) {
+    rb_ary_push(retCreators, rb_obj_freeze(rb_str_new(creator.data(), creator.size())));
   }
 
   for (long post_id : posts) {
     rb_ary_push(retPostIds, LONG2FIX(post_id));
   }
 
-  for (std::string qtag : qtags) {
-    rb_ary_push(retQtags, rb_utf8_str_new(qtag.c_str(), qtag.size()));
+  for (const std::string& qtag : qtags) {
+    rb_ary_push(retQtags, rb_obj_freeze(rb_utf8_str_new(qtag.c_str(), qtag.size())));
+  }
+
+  return ret;
+}
+
+static VALUE c_each_event(VALUE self, VALUE input, VALUE base_url, VALUE domain, VALUE internal_domains, VALUE f_inline, VALUE f_allow_color, VALUE f_qtags, VALUE max_output_bytes, VALUE max_dstack_depth, VALUE timeout) {
+  DTextOptions options = parse_options(base_url, domain, internal_domains, f_inline, f_allow_color, f_qtags, max_output_bytes, max_dstack_depth, timeout);
+  RubyEventHandler events;
+  parse_dtext(input, options, &events);
+  return Qnil;
+}
+
+static VALUE c_compile(VALUE self, VALUE input, VALUE f_allow_color, VALUE f_qtags) {
+  DTextOptions options;
+  options.f_allow_color = RTEST(f_allow_color);
+  options.f_qtags = RTEST(f_qtags);
+
+  try {
+    StringValue(input);
+    validate_dtext(input);
+
+    std::string ir = StateMachine::compile({ RSTRING_PTR(input), (size_t)RSTRING_LEN(input) }, options);
+    return rb_str_new(ir.data(), ir.size());
+  } catch (std::exception& e) {
+    rb_raise(cDTextError, "%s", e.what());
+  }
+}
+
+static VALUE c_render(VALUE self, VALUE ir, VALUE base_url, VALUE domain, VALUE internal_domains, VALUE f_inline, VALUE max_output_bytes, VALUE max_dstack_depth, VALUE timeout) {
+  DTextOptions options = parse_options(base_url, domain, internal_domains, f_inline, Qfalse, Qfalse, max_output_bytes, max_dstack_depth, timeout);
+  StringValue(ir);
+
+  try {
+    auto [dtext, creators, posts, qtags, truncated] = StateMachine::render({ RSTRING_PTR(ir), (size_t)RSTRING_LEN(ir) }, options);
+    return build_result(dtext, creators, posts, qtags, truncated);
+  } catch (DTextStaleIR& e) {
+    rb_raise(cDTextStaleIR, "%s", e.what());
+  } catch (DTextLimitExceeded& e) {
+    rb_raise(cDTextLimitExceeded, "%s", e.what());
+  } catch (std::exception& e) {
+    rb_raise(cDTextError, "%s", e.what());
+  }
+}
+
+static VALUE c_to_plain_text(VALUE self, VALUE input, VALUE f_qtags, VALUE f_spoilers) {
+  DTextOptions options;
+  options.f_qtags = RTEST(f_qtags);
+
+  try {
+    StringValue(input);
+    validate_dtext(input);
+
+    std::string text = StateMachine::plain_text({ RSTRING_PTR(input), (size_t)RSTRING_LEN(input) }, options, RTEST(f_spoilers));
+    return rb_utf8_str_new(text.data(), text.size());
+  } catch (std::exception& e) {
+    rb_raise(cDTextError, "%s", e.what());
+  }
+}
+
+static VALUE c_block_cache_stats(VALUE self) {
+  auto [entries, bytes] = block_cache.size();
+
+  VALUE stats = rb_hash_new();
+  rb_hash_aset(stats, ID2SYM(rb_intern("entries")), SIZET2NUM(entries));
+  rb_hash_aset(stats, ID2SYM(rb_intern("bytes")), SIZET2NUM(bytes));
+  rb_hash_aset(stats, ID2SYM(rb_intern("max_bytes")), SIZET2NUM(block_cache.max_bytes));
+  rb_hash_aset(stats, ID2SYM(rb_intern("hits")), SIZET2NUM(block_cache.hits));
+  rb_hash_aset(stats, ID2SYM(rb_intern("misses")), SIZET2NUM(block_cache.misses));
+  return stats;
+}
+
+static VALUE c_clear_block_cache(VALUE self) {
+  block_cache.clear();
+  block_cache.hits = 0;
+  block_cache.misses = 0;
+  return Qnil;
+}
+
+static VALUE c_parallel_stats(VALUE self) {
+  VALUE stats = rb_hash_new();
+  rb_hash_aset(stats, ID2SYM(rb_intern("segments")), SIZET2NUM(parallel_stats.segments));
+  rb_hash_aset(stats, ID2SYM(rb_intern("reused")), SIZET2NUM(parallel_stats.reused));
+  return stats;
+}
+
+static VALUE c_clear_parallel_stats(VALUE self) {
+  parallel_stats.segments = 0;
+  parallel_stats.reused = 0;
+  return Qnil;
+}
+
+static VALUE c_configure_render_cache(VALUE self, VALUE max_bytes, VALUE version) {
+  StringValue(version);
+  render_cache.configure(NUM2SIZET(max_bytes), { RSTRING_PTR(version), (size_t)RSTRING_LEN(version) });
+  return Qnil;
+}
+
+static VALUE c_render_cache_stats(VALUE self) {
+  auto [entries, bytes] = render_cache.size();
+
+  VALUE stats = rb_hash_new();
+  rb_hash_aset(stats, ID2SYM(rb_intern("entries")), SIZET2NUM(entries));
+  rb_hash_aset(stats, ID2SYM(rb_intern("bytes")), SIZET2NUM(bytes));
+  rb_hash_aset(stats, ID2SYM(rb_intern("max_bytes")), SIZET2NUM(render_cache.capacity()));
+  rb_hash_aset(stats, ID2SYM(rb_intern("hits")), SIZET2NUM(render_cache.hits));
+  rb_hash_aset(stats, ID2SYM(rb_intern("misses")), SIZET2NUM(render_cache.misses));
+  rb_hash_aset(stats, ID2SYM(rb_intern("evictions")), SIZET2NUM(render_cache.evictions));
+  return stats;
+}
+
+static VALUE c_clear_render_cache(VALUE self) {
+  render_cache.clear();
+  return Qnil;
+}
+
+static VALUE c_open_shared_render_cache(VALUE self, VALUE path, VALUE max_bytes, VALUE version) {
+  try {
+    shared_render_cache.open(StringValueCStr(path), NUM2SIZET(max_bytes), { StringValuePtr(version), (size_t)RSTRING_LEN(version) });
+  } catch (std::exception& e) {
+    rb_raise(cDTextError, "%s", e.what());
+  }
+
+  return Qnil;
+}
+
+static VALUE c_close_shared_render_cache(VALUE self) {
+  shared_render_cache.close();
+  return Qnil;
+}
+
+static VALUE c_shared_render_cache_stats(VALUE self) {
+  auto [entries, bytes] = shared_render_cache.size();
+
+  VALUE stats = rb_hash_new();
+  rb_hash_aset(stats, ID2SYM(rb_intern("path")), shared_render_cache.enabled() ? rb_str_new_cstr(shared_render_cache.filename().c_str()) : Qnil);
+  rb_hash_aset(stats, ID2SYM(rb_intern("entries")), SIZET2NUM(entries));
+  rb_hash_aset(stats, ID2SYM(rb_intern("bytes")), SIZET2NUM(bytes));
+  rb_hash_aset(stats, ID2SYM(rb_intern("max_bytes")), SIZET2NUM(shared_render_cache.enabled() ? shared_render_cache.capacity() : 0));
+  rb_hash_aset(stats, ID2SYM(rb_intern("hits")), SIZET2NUM(shared_render_cache.hits));
+  rb_hash_aset(stats, ID2SYM(rb_intern("misses")), SIZET2NUM(shared_render_cache.misses));
+  rb_hash_aset(stats, ID2SYM(rb_intern("inserts")), SIZET2NUM(shared_render_cache.inserts));
+  return stats;
+}
+
+static VALUE c_clear_shared_render_cache(VALUE self) {
+  shared_render_cache.clear();
+  return Qnil;
+}
+
+// The count, sum, max and percentiles of a latency histogram, in seconds.
+static VALUE latency_hash(const ParseStats::Histogram& histogram) {
+  VALUE latency = rb_hash_new();
+  rb_hash_aset(latency, ID2SYM(rb_intern("count")), ULL2NUM(histogram.count));
+  rb_hash_aset(latency, ID2SYM(rb_intern("sum")), DBL2NUM(histogram.sum_ns / 1e9));
+  rb_hash_aset(latency, ID2SYM(rb_intern("max")), DBL2NUM(histogram.max_ns / 1e9));
+  rb_hash_aset(latency, ID2SYM(rb_intern("p50")), DBL2NUM(histogram.percentile(0.5) / 1e9));
+  rb_hash_aset(latency, ID2SYM(rb_intern("p90")), DBL2NUM(histogram.percentile(0.9) / 1e9));
+  rb_hash_aset(latency, ID2SYM(rb_intern("p99")), DBL2NUM(histogram.percentile(0.99) / 1e9));
+  rb_hash_aset(latency, ID2SYM(rb_intern("p999")), DBL2NUM(histogram.percentile(0.999) / 1e9));
+  return latency;
+}
+
+static VALUE c_stats(VALUE self) {
+  auto snapshot = parse_stats.snapshot();
+
+  VALUE errors = rb_hash_new();
+  for (auto& [message, count] : snapshot.errors_by_message) {
+    rb_hash_aset(errors, rb_utf8_str_new(message.data(), message.size()), ULL2NUM(count));
+  }
+
+  VALUE series = rb_ary_new_capa(snapshot.series.size());
+  for (auto& s : snapshot.series) {
+    size_t max_bytes = ParseStats::SIZE_CLASS_MAX_BYTES[s.size_class];
+
+    VALUE options = rb_ary_new();
+    if (s.option_set & 1) rb_ary_push(options, ID2SYM(rb_intern("inline")));
+    if (s.option_set & 2) rb_ary_push(options, ID2SYM(rb_intern("qtags")));
+    if (s.option_set & 4) rb_ary_push(options, ID2SYM(rb_intern("allow_color")));
+
+    VALUE hash = rb_hash_new();
+    rb_hash_aset(hash, ID2SYM(rb_intern("max_bytes")), max_bytes == SIZE_MAX ? Qnil : SIZET2NUM(max_bytes));
+    rb_hash_aset(hash, ID2SYM(rb_intern("options")), options);
+    rb_hash_aset(hash, ID2SYM(rb_intern("parses")), ULL2NUM(s.parses));
+    rb_hash_aset(hash, ID2SYM(rb_intern("errors")), ULL2NUM(s.errors));
+    rb_hash_aset(hash, ID2SYM(rb_intern("bytes_in")), ULL2NUM(s.bytes_in));
+    rb_hash_aset(hash, ID2SYM(rb_intern("bytes_out")), ULL2NUM(s.bytes_out));
+    rb_hash_aset(hash, ID2SYM(rb_intern("latency")), latency_hash(s.latency));
+    rb_ary_push(series, hash);
   }
 
+  VALUE stats = rb_hash_new();
+  rb_hash_aset(stats, ID2SYM(rb_intern("parses")), ULL2NUM(snapshot.parses));
+  rb_hash_aset(stats, ID2SYM(rb_intern("errors")), ULL2NUM(snapshot.errors));
+  rb_hash_aset(stats, ID2SYM(rb_intern("bytes_in")), ULL2NUM(snapshot.bytes_in));
+  rb_hash_aset(stats, ID2SYM(rb_intern("bytes_out")), ULL2NUM(snapshot.bytes_out));
+  rb_hash_aset(stats, ID2SYM(rb_intern("latency")), latency_hash(snapshot.latency));
+  rb_hash_aset(stats, ID2SYM(rb_intern("errors_by_message")), errors);
+  rb_hash_aset(stats, ID2SYM(rb_intern("series")), series);
+
+  VALUE samples = rb_hash_new();
+  rb_hash_aset(samples, ID2SYM(rb_intern("captured")), ULL2NUM(slow_samples.captured));
+  rb_hash_aset(samples, ID2SYM(rb_intern("dropped")), ULL2NUM(slow_samples.dropped));
+  rb_hash_aset(stats, ID2SYM(rb_intern("slow_samples")), samples);
+  return stats;
+}
+
+static VALUE c_clear_stats(VALUE self) {
+  parse_stats.clear();
+  return Qnil;
+}
+
+static VALUE c_configure_slow_samples(VALUE self, VALUE latency, VALUE expansion, VALUE max_input_bytes) {
+  auto min_latency = std::chrono::nanoseconds(NIL_P(latency) ? 0 : static_cast<int64_t>(NUM2DBL(latency) * 1e9)); // latency is in seconds.
+  slow_samples.configure(min_latency, NIL_P(expansion) ? 0 : NUM2DBL(expansion), NUM2SIZET(max_input_bytes));
+  return Qnil;
+}
+
+static VALUE string_or_nil(const std::string& string) {
+  return string.empty() ? Qnil : rb_utf8_str_new(string.data(), string.size());
+}
+
+// Each sample's options are the keyword arguments of DText.parse that reproduce it.
+static VALUE c_slow_samples(VALUE self) {
+  auto samples = slow_samples.drain();
+  VALUE array = rb_ary_new_capa(samples.size());
+
+  for (auto& sample : samples) {
+    auto& options = sample->options;
+
+    VALUE internal_domains = rb_ary_new();
+    for (auto& domain : options.internal_domains) {
+      rb_ary_push(internal_domains, rb_utf8_str_new(domain.data(), domain.size()));
+    }
+
+    VALUE rb_options = rb_hash_new();
+    rb_hash_aset(rb_options, ID2SYM(rb_intern("inline")), options.f_inline ? Qtrue : Qfalse);
+    rb_hash_aset(rb_options, ID2SYM(rb_intern("allow_color")), options.f_allow_color ? Qtrue : Qfalse);
+    rb_hash_aset(rb_options, ID2SYM(rb_intern("qtags")), options.f_qtags ? Qtrue : Qfalse);
+    rb_hash_aset(rb_options, ID2SYM(rb_intern("base_url")), string_or_nil(options.base_url));
+    rb_hash_aset(rb_options, ID2SYM(rb_intern("domain")), string_or_nil(options.domain));
+    rb_hash_aset(rb_options, ID2SYM(rb_intern("internal_domains")), internal_domains);
+    rb_hash_aset(rb_options, ID2SYM(rb_intern("max_output_bytes")), options.max_output_bytes ? SIZET2NUM(options.max_output_bytes) : Qnil);
+    rb_hash_aset(rb_options, ID2SYM(rb_intern("max_dstack_depth")), options.max_dstack_depth ? SIZET2NUM(options.max_dstack_depth) : Qnil);
+    rb_hash_aset(rb_options, ID2SYM(rb_intern("timeout")), options.timeout.count() ? DBL2NUM(options.timeout.count() / 1e6) : Qnil);
+    rb_hash_aset(rb_options, ID2SYM(rb_intern("max_visible_chars")), options.max_visible_chars ? SIZET2NUM(options.max_visible_chars) : Qnil);
+
+    auto since_epoch = std::chrono::duration_cast<std::chrono::nanoseconds>(sample->time.time_since_epoch()).count();
+
+    VALUE hash = rb_hash_new();
+    rb_hash_aset(hash, ID2SYM(rb_intern("dtext")), rb_utf8_str_new(sample->dtext.data(), sample->dtext.size()));
+    rb_hash_aset(hash, ID2SYM(rb_intern("truncated")), sample->truncated ? Qtrue : Qfalse);
+    rb_hash_aset(hash, ID2SYM(rb_intern("options")), rb_options);
+    rb_hash_aset(hash, ID2SYM(rb_intern("latency")), DBL2NUM(sample->latency.count() / 1e9));
+    rb_hash_aset(hash, ID2SYM(rb_intern("bytes_in")), SIZET2NUM(sample->bytes_in));
+    rb_hash_aset(hash, ID2SYM(rb_intern("bytes_out")), SIZET2NUM(sample->bytes_out));
+    rb_hash_aset(hash, ID2SYM(rb_intern("error")), string_or_nil(sample->error));
+    rb_hash_aset(hash, ID2SYM(rb_intern("time")), rb_time_nano_new(since_epoch / 1'000'000'000, since_epoch % 1'000'000'000));
+    rb_ary_push(array, hash);
+  }
+
+  return array;
+}
+
+#ifdef DTEXT_PROFILE
+static VALUE c_profile_snapshot(VALUE self) {
+  VALUE profile = rb_hash_new();
+
+  for (auto& rule : ScannerProfile::snapshot()) {
+    VALUE counters = rb_hash_new();
+    rb_hash_aset(counters, ID2SYM(rb_intern("hits")), ULL2NUM(rule.hits));
+    rb_hash_aset(counters, ID2SYM(rb_intern("bytes")), ULL2NUM(rule.bytes));
+#ifdef DTEXT_PROFILE_CYCLES
+    rb_hash_aset(counters, ID2SYM(rb_intern("cycles")), ULL2NUM(rule.cycles));
+#endif
+    rb_hash_aset(profile, rb_str_new(rule.name.data(), rule.name.size()), counters);
+  }
+
+  return profile;
+}
+
+static VALUE c_profile_reset(VALUE self) {
+  ScannerProfile::reset();
+  return Qnil;
+}
+#endif
+
+static VALUE c_parse(VALUE self, VALUE input, VALUE base_url, VALUE domain, VALUE internal_domains, VALUE f_inline, VALUE f_allow_color, VALUE f_qtags, VALUE max_output_bytes, VALUE max_dstack_depth, VALUE timeout, VALUE max_visible_chars, VALUE cache_blocks, VALUE threads) {
+  if (NIL_P(input)) {
+    return Qnil;
+  }
+
+  DTextOptions options = parse_options(base_url, domain, internal_domains, f_inline, f_allow_color, f_qtags, max_output_bytes, max_dstack_depth, timeout);
+
+  if (!NIL_P(max_visible_chars)) {
+    options.max_visible_chars = NUM2SIZET(max_visible_chars);
+  }
+
+  auto [dtext, creators, posts, qtags, truncated] = parse_dtext(input, options, NULL, RTEST(cache_blocks) ? &block_cache : NULL, NIL_P(threads) ? 1 : NUM2UINT(threads), &parse_stats);
+  return build_result(dtext, creators, posts, qtags, truncated);
+}
+
+static void stream_free(void * ptr) {
+  delete static_cast<DTextStream *>(ptr);
+}
+
+static size_t stream_memsize(const void * ptr) {
+  auto stream = static_cast<const DTextStream *>(ptr);
+  size_t size = sizeof(DTextStream) + stream->html.capacity();
+  return stream->sm ? size + sizeof(StateMachine) + stream->sm->input.capacity() + stream->sm->output.capacity() : size;
+}
+
+static const rb_data_type_t stream_type = {
+  .wrap_struct_name = "DText::Stream",
+  .function = { .dmark = NULL, .dfree = stream_free, .dsize = stream_memsize, .dcompact = NULL, .reserved = {} },
+  .parent = NULL,
+  .data = NULL,
+  .flags = RUBY_TYPED_FREE_IMMEDIATELY,
+};
+
+static VALUE c_stream_alloc(VALUE klass) {
+  return TypedData_Wrap_Struct(klass, &stream_type, new DTextStream());
+}
+
+static DTextStream * get_stream(VALUE self) {
+  DTextStream * stream;
+  TypedData_Get_Struct(self, DTextStream, &stream_type, stream);
+
+  if (!stream->sm) {
+    rb_raise(cDTextError, "stream is closed");
+  }
+
+  return stream;
+}
+
+// Return the length of the string up to the start of a UTF-8 character that's cut off at the end of the string.
+static size_t complete_utf8_length(const std::string_view string) {
+  for (size_t i = 1; i <= 3 && i <= string.size(); i++) {
+    unsigned char c = string[string.size() - i];
+
+    if (c >= 0xC2 && c <= 0xF4) {
+      size_t length = c >= 0xF0 ? 4 : c >= 0xE0 ? 3 : 2;
+      return length > i ? string.size() - i : string.size();
+    } else if (c < 0x80 || c > 0xBF) {
+      break;
+    }
+  }
+
+  return string.size();
+}
+
+static VALUE c_stream_initialize(VALUE self, VALUE base_url, VALUE domain, VALUE internal_domains, VALUE f_inline, VALUE f_allow_color, VALUE f_qtags, VALUE max_output_bytes, VALUE max_dstack_depth, VALUE timeout) {
+  DTextStream * stream;
+  TypedData_Get_Struct(self, DTextStream, &stream_type, stream);
+
+  DTextOptions options = parse_options(base_url, domain, internal_domains, f_inline, f_allow_color, f_qtags, max_output_bytes, max_dstack_depth, timeout);
+  stream->sm = std::make_unique<StateMachine>(options, [stream](std::string_view html) { stream->html += html; });
+
+  return self;
+}
+
+// Parse the next chunk of input and return the HTML produced so far. A UTF-8 character split between two chunks is
+// held back until the next chunk.
+static VALUE c_stream_write(VALUE self, VALUE input) {
+  DTextStream * stream = get_stream(self);
+  StringValue(input);
+
+  stream->partial_char.append(RSTRING_PTR(input), RSTRING_LEN(input));
+  size_t length = complete_utf8_length(stream->partial_char);
+  VALUE chunk = rb_str_new(stream->partial_char.data(), length);
+  rb_enc_copy(chunk, input);
+  stream->partial_char.erase(0, length);
+
+  if (const char * reason = invalid_dtext_reason(chunk)) {
+    stream->sm.reset();
+    rb_raise(cDTextError, "%s", reason);
+  }
+
+  try {
+    stream->sm->feed({ RSTRING_PTR(chunk), (size_t)RSTRING_LEN(chunk) });
+  } catch (DTextLimitExceeded& e) {
+    stream->sm.reset();
+    rb_raise(cDTextLimitExceeded, "%s", e.what());
+  } catch (std::exception& e) {
+    stream->sm.reset();
+    rb_raise(cDTextError, "%s", e.what());
+  }
+
+  VALUE html = rb_utf8_str_new(stream->html.data(), stream->html.size());
+  stream->html.clear();
+  return html;
+}
+
+// Finish the parse and return the rest of the HTML, along with the creators, post IDs and qtags for the whole input.
+static VALUE c_stream_close(VALUE self) {
+  DTextStream * stream = get_stream(self);
+
+  if (!stream->partial_char.empty()) {
+    stream->sm.reset();
+    rb_raise(cDTextError, "input contains invalid UTF-8");
+  }
+
+  try {
+    stream->sm->finish();
+  } catch (DTextLimitExceeded& e) {
+    stream->sm.reset();
+    rb_raise(cDTextLimitExceeded, "%s", e.what());
+  } catch (std::exception& e) {
+    stream->sm.reset();
+    rb_raise(cDTextError, "%s", e.what());
+  }
+
+  VALUE ret = build_result(stream->html, stream->sm->creators, stream->sm->posts, stream->sm->qtags);
+  stream->sm.reset();
+  stream->html.clear();
   return ret;
 }
 
 extern "C" void Init_dtext() {
+#ifdef HAVE_RB_EXT_RACTOR_SAFE
+  // The parser has no mutable global state, and the caches are shared by all Ractors (and threads) safely.
+  rb_ext_ractor_safe(true);
+#endif
+
   cDText = rb_define_class("DText", rb_cObject);
   cDTextError = rb_define_class_under(cDText, "Error", rb_eStandardError);
-  rb_define_singleton_method(cDText, "c_parse", c_parse, 7);
+  cDTextLimitExceeded = rb_define_class_under(cDText, "LimitExceeded", cDTextError);
+  cDTextStaleIR = rb_define_class_under(cDText, "StaleIR", cDTextError);
+  rb_define_const(cDText, "IR_VERSION", INT2FIX(DTEXT_IR_VERSION));
+  rb_define_singleton_method(cDText, "c_parse", c_parse, 13);
+  rb_define_singleton_method(cDText, "block_cache_stats", c_block_cache_stats, 0);
+  rb_define_singleton_method(cDText, "clear_block_cache", c_clear_block_cache, 0);
+  rb_define_singleton_method(cDText, "parallel_stats", c_parallel_stats, 0);
+  rb_define_singleton_method(cDText, "clear_parallel_stats", c_clear_parallel_stats, 0);
+  rb_define_singleton_method(cDText, "c_configure_render_cache", c_configure_render_cache, 2);
+  rb_define_singleton_method(cDText, "render_cache_stats", c_render_cache_stats, 0);
+  rb_define_singleton_method(cDText, "clear_render_cache", c_clear_render_cache, 0);
+  rb_define_singleton_method(cDText, "c_open_shared_render_cache", c_open_shared_render_cache, 3);
+  rb_define_singleton_method(cDText, "close_shared_render_cache", c_close_shared_render_cache, 0);
+  rb_define_singleton_method(cDText, "shared_render_cache_stats", c_shared_render_cache_stats, 0);
+  rb_define_singleton_method(cDText, "clear_shared_render_cache", c_clear_shared_render_cache, 0);
+  rb_define_singleton_method(cDText, "stats", c_stats, 0);
+  rb_define_singleton_method(cDText, "clear_stats", c_clear_stats, 0);
+  rb_define_singleton_method(cDText, "c_configure_slow_samples", c_configure_slow_samples, 3);
+  rb_define_singleton_method(cDText, "slow_samples", c_slow_samples, 0);
+#ifdef DTEXT_PROFILE
+  rb_define_singleton_method(cDText, "profile_snapshot", c_profile_snapshot, 0);
+  rb_define_singleton_method(cDText, "profile_reset", c_profile_reset, 0);
+#else
+  rb_define_singleton_method(cDText, "profile_snapshot", rb_f_notimplement, -1);
+  rb_define_singleton_method(cDText, "profile_reset", rb_f_notimplement, -1);
+#endif
+  rb_define_singleton_method(cDText, "c_each_event", c_each_event, 10);
+  rb_define_singleton_method(cDText, "c_compile", c_compile, 3);
+  rb_define_singleton_method(cDText, "c_render", c_render, 8);
+  rb_define_singleton_method(cDText, "c_to_plain_text", c_to_plain_text, 3);
+
+  cDTextStream = rb_define_class_under(cDText, "Stream", rb_cObject);
+  rb_define_alloc_func(cDTextStream, c_stream_alloc);
+  rb_define_private_method(cDTextStream, "c_initialize", c_stream_initialize, 9);
+  rb_define_private_method(cDTextStream, "c_write", c_stream_write, 1);
+  rb_define_private_method(cDTextStream, "c_close", c_stream_close, 0);
 }
@@ -1,8 +1,10 @@
 #ifndef DTEXT_URL_H
 #define DTEXT_URL_H
 
+#include "probes.h"
+
+#include <algorithm>
 #include <string>
-#include <regex>
 #include <vector>
 
 namespace DText {
@@ -16,7 +18,9 @@ class URL {
   std::string_view fragment;
 
   URL(std::string_view url) : url(url) {
+    g_probe(url__start, url.size());
     parse();
+    g_probe(url__done, url.size(), !domain.empty());
   }
 
   const std::vector<std::string_view> path_components() const {
@@ -35,17 +39,71 @@ class URL {
 
  private:
 
+  // Equivalent to matching `^https?://([^/?#:]+)(:[0-9]+)?(?:/([^?#]*))?(?:\?([^#]*))?(?:#(.*))?$` (case-insensitively), but
+  // in a single linear pass. std::regex recurses once per character, so long URLs would overflow the stack.
   void parse() {
     // https://danbooru.donmai.us:443/posts/1234?q=touhou#comment-1234
-    static const std::regex url_regex("^https?://([^/?#:]+)(:[0-9]+)?(?:/([^?#]*))?(?:\\?([^#]*))?(?:#(.*))?$", std::regex_constants::icase | std::regex_constants::optimize);
-    std::match_results<std::string_view::const_iterator> matches;
-
-    if (std::regex_search(url.begin(), url.end(), matches, url_regex)) {
-      domain = { matches[1].first, matches[1].second };
-      path = { matches[3].first, matches[3].second };
-      query = { matches[4].first, matches[4].second };
-      fragment = { matches[5].first, matches[5].second };
+    std::string_view rest = strip_scheme(url);
+    if (rest.data() == nullptr) {
+      return;
+    }
+
+    auto domain = rest.substr(0, rest.find_first_of("/?#:"));
+    if (domain.empty()) {
+      return;
+    }
+    rest.remove_prefix(domain.size());
+
+    if (rest.starts_with(':')) {
+      auto port_end = std::min(rest.find_first_not_of("0123456789", 1), rest.size());
+      if (port_end == 1) {
+        return;
+      }
+      rest.remove_prefix(port_end);
+    }
+
+    std::string_view path, query, fragment;
+
+    if (rest.starts_with('/')) {
+      path = rest.substr(1, rest.find_first_of("?#") - 1);
+      rest.remove_prefix(path.size() + 1);
+    }
+
+    if (rest.starts_with('?')) {
+      query = rest.substr(1, rest.find('#') - 1);
+      rest.remove_prefix(query.size() + 1);
+    }
+
+    if (rest.starts_with('#')) {
+      fragment = rest.substr(1);
+      rest = {};
+    }
+
+    // `.` doesn't match newlines, so neither can the fragment.
+    if (!rest.empty() || fragment.find_first_of("\r\n") != std::string_view::npos) {
+      return;
+    }
+
+    this->domain = domain;
+    this->path = path;
+    this->query = query;
+    this->fragment = fragment;
+  }
+
+ public:
+  // Return the part of the URL after `http://` or `https://` (case-insensitive), or a null string_view if it has neither.
+  static std::string_view strip_scheme(std::string_view url) {
+    auto lowercase_starts_with = [&](std::string_view prefix) {
+      return url.size() >= prefix.size() && std::equal(prefix.begin(), prefix.end(), url.begin(), [](char a, char b) { return a == ((b >= 'A' && b <= 'Z') ? b | 0x20 : b); });
     };
+
+    if (lowercase_starts_with("https://")) {
+      return url.substr(8);
+    } else if (lowercase_starts_with("http://")) {
+      return url.substr(7);
+    } else {
+      return {};
+    }
   }
 };
 
@@ -16,8 +16,140 @@ end
 
 class DText
   class Error < StandardError; end
+  class LimitExceeded < Error; end
+  class StaleIR < Error; end
 
-  def self.parse(str, inline: false, allow_color: false, qtags: false, base_url: nil, domain: nil, internal_domains: [])
-    c_parse(str, base_url, domain, internal_domains, inline, allow_color, qtags)
+  # max_output_bytes, max_dstack_depth and timeout (in seconds) bound the work done for untrusted input; going over
+  # any of them raises DText::LimitExceeded.
+  #
+  # max_visible_chars renders an excerpt: parsing stops once that many characters of text have been output, open tags
+  # are closed, an ellipsis is added, and :truncated is set in the result.
+  #
+  # cache_blocks keeps the HTML of each block (the paragraphs between blank lines) in a shared LRU cache, so that parsing
+  # the same document again after a small edit only parses the blocks that changed. See DText.block_cache_stats.
+  #
+  # threads parses very large documents (over 512 KB) on up to that many threads, by splitting them at blank lines. See
+  # DText.parallel_stats.
+  def self.parse(str, inline: false, allow_color: false, qtags: false, base_url: nil, domain: nil, internal_domains: [], max_output_bytes: nil, max_dstack_depth: nil, timeout: nil, max_visible_chars: nil, cache_blocks: false, threads: nil)
+    c_parse(str, base_url, domain, internal_domains, inline, allow_color, qtags, max_output_bytes, max_dstack_depth, timeout, max_visible_chars, cache_blocks, threads)
+  end
+
+  # Cache the output of short strings (up to 4 KB) that are parsed over and over, in up to max_bytes of memory shared by
+  # all threads. It's disabled by default; 0 disables it again. See DText.render_cache_stats.
+  def self.render_cache_max_bytes=(max_bytes)
+    c_configure_render_cache(max_bytes, VERSION)
+  end
+
+  # Cache the output of short strings in a memory-mapped file of max_bytes at `path`, shared by every process on the host
+  # that opens the same file (e.g. all the workers of a server, if it's opened before they're forked). The in-process
+  # render cache, if enabled, is checked first. The file is created if it doesn't exist, and replaced if it was created
+  # by another version of DText or with another size. See DText.shared_render_cache_stats.
+  def self.open_shared_render_cache(path, max_bytes: 64 * 1024 * 1024)
+    c_open_shared_render_cache(path.to_s, max_bytes, VERSION)
+  end
+
+  # Capture the input, options and timings of DText.parse calls that take at least `latency` seconds, or whose output is
+  # at least `expansion` times the size of their input (nil disables either), so that outliers can be reproduced later.
+  # Inputs are cut off at max_input_bytes. Up to 64 samples are kept until they're taken with DText.slow_samples;
+  # parses that go over a threshold while it's full aren't captured (see DText.stats[:slow_samples]).
+  def self.capture_slow_samples(latency: nil, expansion: nil, max_input_bytes: 1024 * 1024)
+    c_configure_slow_samples(latency, expansion, max_input_bytes)
+  end
+
+  # Compile DText into a compact binary form that can be rendered many times with DText.render, without parsing it
+  # again. qtags and allow_color are fixed when compiling; the other options of DText.parse are given when rendering.
+  # The IR is tied to the parser version (DText::IR_VERSION); rendering IR from a different version raises
+  # DText::StaleIR, in which case it should be compiled again.
+  def self.compile(str, qtags: false, allow_color: false)
+    c_compile(str, allow_color, qtags)
+  end
+
+  # Render IR from DText.compile. Returns the same hash as DText.parse.
+  def self.render(ir, inline: false, base_url: nil, domain: nil, internal_domains: [], max_output_bytes: nil, max_dstack_depth: nil, timeout: nil)
+    c_render(ir, base_url, domain, internal_domains, inline, max_output_bytes, max_dstack_depth, timeout)
+  end
+
+  # Return the visible text of the DText, without markup and with whitespace collapsed, for search indexing and
+  # excerpts. Link titles, list items and quotes are included; spoilers are left out unless spoilers is true.
+  #
+  #   DText.to_plain_text("h1. Title\n\n[b]bold[/b] [[foo_bar|link]] [spoiler]secret[/spoiler]")
+  #   # => "Title bold link"
+  def self.to_plain_text(str, spoilers: false, qtags: false)
+    return nil if str.nil?
+
+    c_to_plain_text(str, qtags, spoilers)
+  end
+
+  # Parse DText and yield its structure as events, instead of returning HTML. Takes the same options as DText.parse.
+  #
+  #   DText.each_event("[b]hi[/b] [[foo]]") { |type, *args| p [type, *args] }
+  #   # [:open, :block_p, {}]
+  #   # [:open, :inline_b, {}]
+  #   # [:text, "hi"]
+  #   # [:close, :inline_b]
+  #   # [:text, " "]
+  #   # [:link, :creator, "foo", "foo"]
+  #   # [:close, :block_p]
+  #
+  # Links are yielded as [:link, kind, url, title], where kind is one of :external, :internal, :id, :creator,
+  # :post_search or :anchor. Qtags are yielded as [:qtag, name]. Returns an Enumerator if no block is given.
+  def self.each_event(str, inline: false, allow_color: false, qtags: false, base_url: nil, domain: nil, internal_domains: [], max_output_bytes: nil, max_dstack_depth: nil, timeout: nil, &block)
+    return enum_for(:each_event, str, inline: inline, allow_color: allow_color, qtags: qtags, base_url: base_url, domain: domain, internal_domains: internal_domains, max_output_bytes: max_output_bytes, max_dstack_depth: max_dstack_depth, timeout: timeout) unless block
+
+    c_each_event(str, base_url, domain, internal_domains, inline, allow_color, qtags, max_output_bytes, max_dstack_depth, timeout, &block)
+  end
+
+  # Parse DText read from an IO in chunks of chunk_size bytes, yielding the HTML as it's produced. Takes the same
+  # options as DText.parse. Returns an Enumerator if no block is given, which can be used as a Rack response body.
+  def self.parse_io(io, chunk_size: 64 * 1024, **options, &block)
+    return enum_for(:parse_io, io, chunk_size: chunk_size, **options) unless block_given?
+
+    stream = Stream.new(**options, &block)
+
+    while (chunk = io.read(chunk_size))
+      stream.write(chunk.force_encoding(Encoding::UTF_8))
+    end
+
+    stream.close
+  end
+
+  # Parses DText given in chunks. The HTML for each chunk is returned by #write, or passed to the block if one is given.
+  # Only the current token is kept in memory, rather than the whole document.
+  #
+  #   stream = DText::Stream.new { |html| response.write(html) }
+  #   stream << "[b]hello"
+  #   stream << " world[/b]"
+  #   stream.close # => { dtext: nil, creators: [], post_ids: [], qtags: [], truncated: false }
+  class Stream
+    def initialize(inline: false, allow_color: false, qtags: false, base_url: nil, domain: nil, internal_domains: [], max_output_bytes: nil, max_dstack_depth: nil, timeout: nil, &block)
+      @block = block
+      c_initialize(base_url, domain, internal_domains, inline, allow_color, qtags, max_output_bytes, max_dstack_depth, timeout)
+    end
+
+    def write(str)
+      emit(c_write(str))
+    end
+
+    def <<(str)
+      write(str)
+      self
+    end
+
+    # Finish parsing and close any open tags. Returns the same hash as DText.parse, where :dtext is the HTML produced
+    # since the last call to #write (or nil if a block was given).
+    def close
+      result = c_close
+      result[:dtext] = emit(result[:dtext])
+      result
+    end
+
+    private
+
+    def emit(html)
+      return html if @block.nil?
+
+      @block.call(html) unless html.empty?
+      nil
+    end
   end
 end
@@ -0,0 +1,69 @@
+# frozen_string_literal: true
+
+# Measures dtextd under load: starts bin/dtextd.exe on a temporary socket with THREADS workers, and runs
+# bin/dtextd_load.exe against it with each of CONNECTIONS connections (each keeping PIPELINE requests in flight) for TIME
+# seconds, sending the corpus of bench_dtext.rb (one document per category). For each, reports the requests per second,
+# the input bytes rendered per second, and the latency percentiles seen by the client; then the daemon's own stats,
+# which show how well requests were batched.
+#
+#   bin/rake bench:daemon
+#   CONNECTIONS=1,8,64 PIPELINE=4 THREADS=4 TIME=5 bin/rake bench:daemon
+
+require_relative "bench_dtext"
+require "etc"
+require "tmpdir"
+
+class DaemonBench
+  DTEXTD = ENV.fetch("DTEXTD", File.expand_path("../bin/dtextd.exe", __dir__))
+  DTEXTD_LOAD = ENV.fetch("DTEXTD_LOAD", File.expand_path("../bin/dtextd_load.exe", __dir__))
+  THREADS = Integer(ENV.fetch("THREADS", Etc.nprocessors.to_s))
+  CONNECTIONS = ENV.fetch("CONNECTIONS", "1,4,16").split(",").map { |n| Integer(n) }
+  PIPELINE = Integer(ENV.fetch("PIPELINE", "1"))
+  TIME = Float(ENV.fetch("TIME", "2"))
+
+  def run
+    [DTEXTD, DTEXTD_LOAD].each do |exe|
+      abort "#{exe} doesn't exist; build it with `bin/rake dtextd`" unless File.executable?(exe)
+    end
+
+    Dir.mktmpdir do |dir|
+      files = DTextBench::CATEGORIES.keys.map do |category|
+        File.join(dir, "#{category}.dtext").tap { |file| File.write(file, DTextBench.new.document(category)) }
+      end
+
+      socket = File.join(dir, "dtextd.sock")
+      daemon = spawn(DTEXTD, "--socket=#{socket}", "--threads=#{THREADS}", err: File::NULL)
+      sleep 0.01 until File.socket?(socket)
+
+      begin
+        puts format("%11s %8s %12s %10s %10s %10s %10s", "connections", "pipeline", "requests/s", "MB/s", "p50 (us)", "p99 (us)", "p99.9 (us)")
+
+        stats = nil
+
+        CONNECTIONS.each_with_index do |connections, i|
+          # The last run also asks for the daemon's stats, which it prints on a second line.
+          stats_flag = i == CONNECTIONS.size - 1 ? ["--stats"] : []
+          result, stats = load(socket, files, "--connections=#{connections}", "--pipeline=#{PIPELINE}", "--time=#{TIME}", "--json", *stats_flag)
+          puts format("%11d %8d %12.0f %10.2f %10.1f %10.1f %10.1f", connections, PIPELINE, result[:requests_per_second],
+            result[:throughput] / 1_000_000.0, result[:p50] * 1e6, result[:p99] * 1e6, result[:p999] * 1e6)
+        end
+
+        puts
+        puts "daemon: #{stats[:requests]} requests in #{stats[:batches]} batches (mean #{stats[:batch_size_mean]}, max #{stats[:batch_size_max]}), " \
+          "request latency p99 #{(stats[:request_latency][:p99] * 1e6).round(1)} us, parse latency p99 #{(stats[:parse_latency][:p99] * 1e6).round(1)} us"
+      ensure
+        Process.kill("TERM", daemon)
+        Process.wait(daemon)
+      end
+    end
+  end
+
+  # Returns the JSON lines that dtextd_load printed: its results, and the daemon's stats if it was asked for them.
+  def load(socket, files, *args)
+    output, status = Open3.capture2(DTEXTD_LOAD, "--socket=#{socket}", *args, *files)
+    abort "#{DTEXTD_LOAD} failed" unless status.success?
+    output.lines.map { |line| JSON.parse(line, symbolize_names: true) }
+  end
+end
+
+DaemonBench.new.run
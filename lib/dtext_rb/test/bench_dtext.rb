@@ -0,0 +1,292 @@
+# frozen_string_literal: true
+
+# Measures DText.parse on a corpus of generated documents, one category of markup at a time, with each of a set of
+# option combinations. This is the baseline for performance changes to the parser: run it before and after.
+#
+# For each category and option combination, reports the iterations per second (with the standard deviation), the
+# input bytes parsed per second, and the Ruby objects allocated per call.
+#
+# `bin/rake bench:record` saves the median time per call and its median absolute deviation (MAD) for each scenario to a
+# baseline file, and `bin/rake bench:compare` runs the scenarios again and fails if any got significantly slower. Each
+# scenario is measured both through DText.parse (ruby/...) and in a native loop with bin/cdtext.exe (native/...), so
+# the overhead of the Ruby extension and of the parser itself are tracked separately.
+#
+#   bin/rake bench
+#   CATEGORIES=prose,links OPTIONS=default,inline TIME=5 bin/rake bench
+#   SIZE=65536 bin/rake bench
+#   bin/rake bench:record
+#   THRESHOLD=0.1 bin/rake bench:compare
+#   BASELINE=tmp/before.json bin/rake bench:record
+
+require "dtext"
+require "benchmark"
+require "benchmark/ips"
+require "fileutils"
+require "json"
+require "open3"
+require "tempfile"
+require "time"
+
+class DTextBench
+  SIZE = Integer(ENV.fetch("SIZE", "16384")) # The approximate size of each document, in bytes.
+  TIME = Float(ENV.fetch("TIME", "1"))
+  WARMUP = Float(ENV.fetch("WARMUP", "0.2"))
+  BASELINE = ENV.fetch("BASELINE", File.expand_path("../tmp/bench_baseline.json", __dir__))
+  CDTEXT = ENV.fetch("CDTEXT", File.expand_path("../bin/cdtext.exe", __dir__))
+  THRESHOLD = Float(ENV.fetch("THRESHOLD", "0.05")) # Slowdowns smaller than this fraction are ignored.
+  MIN_Z = 3.0 # How many standard errors apart the medians have to be for a difference to be significant.
+  SAMPLE_TIME = 0.001 # Each sample of a Ruby scenario times a batch of calls that takes about this many seconds.
+
+  WORDS = %w[
+    lorem ipsum dolor sit amet consectetur adipiscing elit sed do eiusmod tempor incididunt ut labore et dolore magna
+    aliqua enim ad minim veniam quis nostrud exercitation ullamco laboris nisi aliquip ex ea commodo consequat
+  ].freeze
+
+  CJK_WORDS = %w[
+    日本語 テキスト の 文章 です 中文 文本 段落 한국어 텍스트 입니다 🎉 😀 👍🏽 🏳️‍🌈 ✨ 🐾
+  ].freeze
+
+  # Each category generates one piece of a document at a time, until the document reaches SIZE.
+  CATEGORIES = {
+    "prose" => ->(r) {
+      sentence = Array.new(r.rand(8..20)) { WORDS.sample(random: r) }.join(" ").capitalize
+      sentence = sentence.sub(/\b(\w+) (\w+)\b/, r.rand < 0.5 ? '[b]\1[/b] \2' : '[i]\1 \2[/i]') if r.rand < 0.3
+      "#{sentence}.#{r.rand < 0.2 ? "\n\n" : ' '}"
+    },
+    "links" => ->(r) {
+      n = r.rand(1..99_999)
+      [
+        "[[tag_#{n}]] ", "[[tag_#{n}|alias #{n}]] ", "{{search_#{n} rating:s}} ", "post ##{n} ", "forum ##{n} ",
+        "https://example.com/path/#{n}?q=#{n} ", "\"link #{n}\":/posts/#{n} ", "\"external\":[https://example.net/#{n}] ",
+        "[url=https://example.org/#{n}]named #{n}[/url] ", "<https://example.com/#{n}> ", "#{WORDS.sample(random: r)} ",
+      ].sample(random: r)
+    },
+    "tables" => ->(r) {
+      cols = r.rand(2..5)
+      header = "[tr]#{Array.new(cols) { |i| "[th]Column #{i}[/th]" }.join}[/tr]"
+      rows = Array.new(r.rand(3..10)) { "[tr]#{Array.new(cols) { "[td]#{WORDS.sample(random: r)} #{r.rand(100)}[/td]" }.join}[/tr]" }
+      "[table]\n[thead]\n#{header}\n[/thead]\n[tbody]\n#{rows.join("\n")}\n[/tbody]\n[/table]\n\n"
+    },
+    "nesting" => ->(r) {
+      depth = r.rand(5..30)
+      tags = Array.new(depth) { %w[b i u s sup sub spoiler].sample(random: r) }
+      inline = "#{tags.map { |t| "[#{t}]" }.join}#{WORDS.sample(random: r)}#{tags.reverse.map { |t| "[/#{t}]" }.join}"
+      quotes = r.rand(1..6)
+      "#{"[quote]\n" * quotes}#{inline}\n#{"[/quote]\n" * quotes}\n"
+    },
+    "lists" => ->(r) {
+      Array.new(r.rand(3..12)) { "#{'*' * r.rand(1..4)} #{Array.new(r.rand(2..8)) { WORDS.sample(random: r) }.join(' ')}\n" }.join + "\n"
+    },
+    "code" => ->(r) {
+      if r.rand < 0.5
+        "[code]\ndef method_#{r.rand(1000)}(a, b)\n  [b]not bold[/b] a < b && b > a # \"quoted\"\nend\n[/code]\n\n"
+      else
+        "Call `method_#{r.rand(1000)}(#{WORDS.sample(random: r)})` with `[b]` and `<tags>` inline. "
+      end
+    },
+    "utf8" => ->(r) {
+      text = Array.new(r.rand(5..15)) { CJK_WORDS.sample(random: r) }.join(r.rand < 0.5 ? "" : " ")
+      r.rand < 0.2 ? "[b]#{text}[/b]。\n\n" : "#{text}。"
+    },
+    "short" => ->(r) {
+      # Short comments and reasons, as they're rendered in lists (usually in inline mode). Each is one document.
+      "[[tag_#{r.rand(1000)}]] #{Array.new(r.rand(3..12)) { WORDS.sample(random: r) }.join(' ')} (post ##{r.rand(99_999)})"
+    },
+  }.freeze
+
+  OPTIONS = {
+    "default" => {},
+    "inline"  => { inline: true },
+    "qtags"   => { qtags: true },
+    "color"   => { allow_color: true },
+    "domain"  => { base_url: "https://example.com", domain: "example.com", internal_domains: ["example.com"] },
+    "excerpt" => { max_visible_chars: 200 },
+  }.freeze
+
+  def scenarios
+    selected(CATEGORIES, "CATEGORIES").keys.product(selected(OPTIONS, "OPTIONS").to_a)
+  end
+
+  def selected(all, env)
+    names = ENV[env]&.split(",") || all.keys
+    unknown = names - all.keys
+    abort "unknown #{env.downcase}: #{unknown.join(', ')} (expected #{all.keys.join(', ')})" if unknown.any?
+    all.slice(*names)
+  end
+
+  def document(category)
+    random = Random.new(category.sum)
+    generator = CATEGORIES.fetch(category)
+    return generator.call(random) if category == "short"
+
+    document = +""
+    document << generator.call(random) while document.bytesize < SIZE
+    document.freeze
+  end
+
+  # The Ruby objects allocated per call (the C++ parser's own allocations are reported by `bin/cdtext.exe --bench`).
+  def allocations(dtext, options, calls: 20)
+    DText.parse(dtext, **options)
+    before = GC.stat(:total_allocated_objects)
+    calls.times { DText.parse(dtext, **options) }
+    (GC.stat(:total_allocated_objects) - before) / calls.to_f
+  end
+
+  def measure(dtext, options)
+    report = Benchmark.ips(quiet: true) do |x|
+      x.config(time: TIME, warmup: WARMUP)
+      x.report { DText.parse(dtext, **options) }
+    end
+
+    report.entries.first
+  end
+
+  # Returns one row of results per category and option combination.
+  def run
+    puts format("%-8s %-8s %8s %14s %8s %10s %12s", "category", "options", "bytes", "i/s", "±", "MB/s", "allocs/call")
+
+    scenarios.map do |category, (name, options)|
+      dtext = document(category)
+      entry = measure(dtext, options)
+
+      row = {
+        category: category,
+        options: name,
+        bytes: dtext.bytesize,
+        ips: entry.ips,
+        ips_sd: entry.ips_sd,
+        bytes_per_second: entry.ips * dtext.bytesize,
+        allocations: allocations(dtext, options),
+      }
+
+      puts format("%-8s %-8s %8d %14.1f %7.1f%% %10.2f %12.1f", category, name, row[:bytes], row[:ips], 100.0 * row[:ips_sd] / row[:ips], row[:bytes_per_second] / 1_000_000.0, row[:allocations])
+      row
+    end
+  end
+
+  def median(values)
+    sorted = values.sort
+    (sorted[(sorted.size - 1) / 2] + sorted[sorted.size / 2]) / 2.0
+  end
+
+  # The median time per call of DText.parse, and its median absolute deviation, from samples of batches of calls.
+  def sample_ruby(dtext, options)
+    batch = 1
+    batch *= 2 while (batch < 1_000_000) && Benchmark.realtime { batch.times { DText.parse(dtext, **options) } } < SAMPLE_TIME
+
+    samples = []
+    deadline = Process.clock_gettime(Process::CLOCK_MONOTONIC) + TIME
+
+    while samples.size < 5 || Process.clock_gettime(Process::CLOCK_MONOTONIC) < deadline
+      samples << (Benchmark.realtime { batch.times { DText.parse(dtext, **options) } } / batch)
+    end
+
+    m = median(samples)
+    { median: m, mad: median(samples.map { |sample| (sample - m).abs }), samples: samples.size }
+  end
+
+  def cdtext_flags(options)
+    options.flat_map do |key, value|
+      case key
+      in :inline | :qtags then ["--#{key}"]
+      in :allow_color then ["--allow-color"]
+      in :base_url | :domain | :max_visible_chars then ["--#{key.to_s.tr('_', '-')}=#{value}"]
+      in :internal_domains then value.map { |domain| "--internal-domain=#{domain}" }
+      end
+    end
+  end
+
+  # The same as sample_ruby, but for the parser alone, timed by bin/cdtext.exe (each sample is one parse).
+  def sample_native(dtext, options)
+    abort "#{CDTEXT} doesn't exist; build it with `bin/rake compile` (or set CDTEXT)" unless File.executable?(CDTEXT)
+
+    Tempfile.create(["bench", ".dtext"]) do |file|
+      file.write(dtext)
+      file.close
+
+      output, status = Open3.capture2(CDTEXT, "--bench", "--bench-time=#{TIME}", "--json", *cdtext_flags(options), file.path)
+      abort "#{CDTEXT} failed" unless status.success?
+      JSON.parse(output, symbolize_names: true).slice(:median, :mad, :samples)
+    end
+  end
+
+  # Measure every scenario, both through Ruby and natively.
+  def sample_all
+    scenarios.each_with_object({}) do |(category, (name, options)), results|
+      dtext = document(category)
+
+      %w[ruby native].each do |kind|
+        key = "#{kind}/#{category}/#{name}"
+        results[key] = kind == "ruby" ? sample_ruby(dtext, options) : sample_native(dtext, options)
+        warn format("%-24s %12.3f us ± %.3f (%d samples)", key, results[key][:median] * 1e6, results[key][:mad] * 1e6, results[key][:samples])
+      end
+    end
+  end
+
+  def commit
+    sha = `git rev-parse --short HEAD 2>/dev/null`.strip
+    dirty = !`git status --porcelain --untracked-files=no 2>/dev/null`.strip.empty?
+    sha.empty? ? nil : "#{sha}#{'-dirty' if dirty}"
+  end
+
+  def record(path = BASELINE)
+    baseline = {
+      commit: commit,
+      recorded_at: Time.now.utc.iso8601,
+      ruby: RUBY_DESCRIPTION,
+      size: SIZE,
+      scenarios: sample_all,
+    }
+
+    FileUtils.mkdir_p(File.dirname(path))
+    File.write(path, JSON.pretty_generate(baseline))
+    puts "Recorded #{baseline[:scenarios].size} scenarios at #{baseline[:commit] || 'an unknown commit'} to #{path}"
+  end
+
+  # The number of standard errors between two medians. The standard error of a median is about 1.2533 * sigma / sqrt(n),
+  # and sigma is estimated from the MAD as 1.4826 * MAD, which is robust to the outliers that timings always have.
+  def z_score(before, after)
+    standard_error = ->(s) { 1.2533 * 1.4826 * s[:mad] / Math.sqrt(s[:samples]) }
+    difference = after[:median] - before[:median]
+    combined = Math.sqrt(standard_error.(before)**2 + standard_error.(after)**2)
+    combined.zero? ? (difference.zero? ? 0.0 : Float::INFINITY * difference) : difference / combined
+  end
+
+  # Run the scenarios again and compare them to the baseline. Fails if any scenario is significantly slower (more than
+  # MIN_Z standard errors apart) by more than THRESHOLD.
+  def compare(path = BASELINE)
+    abort "No baseline at #{path}; record one with `bin/rake bench:record`" unless File.exist?(path)
+
+    baseline = JSON.parse(File.read(path), symbolize_names: true)
+    abort "The baseline was recorded with SIZE=#{baseline[:size]}, not #{SIZE}" if baseline[:size] != SIZE
+
+    results = sample_all
+    regressions = []
+
+    puts format("Comparing to %s (%s)\n\n", baseline[:commit] || "an unknown commit", baseline[:recorded_at])
+    puts format("%-24s %12s %12s %9s %7s", "scenario", "before (us)", "after (us)", "change", "z")
+
+    results.each do |key, after|
+      before = baseline[:scenarios][key.to_sym]
+      next puts format("%-24s %12s %12.3f %9s %7s", key, "-", after[:median] * 1e6, "new", "") if before.nil?
+
+      change = (after[:median] / before[:median]) - 1
+      z = z_score(before, after)
+
+      status = if z > MIN_Z && change > THRESHOLD
+        regressions << key
+        "SLOWER"
+      elsif z < -MIN_Z && change < -THRESHOLD
+        "faster"
+      else
+        ""
+      end
+
+      puts format("%-24s %12.3f %12.3f %+8.1f%% %7.1f %s", key, before[:median] * 1e6, after[:median] * 1e6, change * 100, z, status)
+    end
+
+    return if regressions.empty?
+
+    abort "\n#{regressions.size} scenario#{'s' unless regressions.size == 1} got more than #{(THRESHOLD * 100).round(1)}% slower: #{regressions.join(', ')}"
+  end
+end
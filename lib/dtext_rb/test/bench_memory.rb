@@ -0,0 +1,89 @@
+# frozen_string_literal: true
+
+# Measures the memory used to parse each category of the bench_dtext.rb corpus, to catch changes that allocate more
+# per document even when they don't show up as a slowdown.
+#
+# Natively, bin/cdtext.exe counts the parser's calls to operator new, the bytes allocated, the most heap held at once
+# during a parse and the process's max RSS. Through Ruby, each category is parsed in a forked process (so that the
+# high-water mark of its RSS is its own), which reports the objects allocated per call, the size of the result (with
+# ObjectSpace.memsize_of) and how much the RSS grew over PASSES calls.
+#
+#   bin/rake bench:memory
+#   CATEGORIES=tables,nesting PASSES=200 bin/rake bench:memory
+
+require_relative "bench_dtext"
+require "objspace"
+require "tmpdir"
+
+class MemoryBench
+  PASSES = Integer(ENV.fetch("PASSES", "100"))
+
+  def categories
+    DTextBench.new.selected(DTextBench::CATEGORIES, "CATEGORIES").keys
+  end
+
+  def native(dtext)
+    cdtext = DTextBench::CDTEXT
+    abort "#{cdtext} doesn't exist; build it with `bin/rake compile` (or set CDTEXT)" unless File.executable?(cdtext)
+
+    Dir.mktmpdir do |dir|
+      file = File.join(dir, "bench.dtext")
+      File.write(file, dtext)
+
+      output, status = Open3.capture2(cdtext, "--bench=#{PASSES}", "--json", file)
+      abort "#{cdtext} failed" unless status.success?
+      JSON.parse(output, symbolize_names: true).slice(:allocations, :allocated_bytes, :peak_bytes, :max_rss)
+    end
+  end
+
+  # The high-water mark and the current size of the RSS, in bytes (Linux only; nil elsewhere).
+  def self.rss(field)
+    status = File.read("/proc/self/status") rescue nil
+    status && status[/^#{field}:\s+(\d+) kB/, 1].to_i * 1024
+  end
+
+  def ruby(dtext)
+    reader, writer = IO.pipe
+
+    pid = fork do
+      reader.close
+      DText.parse(dtext)
+      GC.start
+      rss = MemoryBench.rss("VmRSS")
+
+      before = GC.stat(:total_allocated_objects)
+      results = Array.new(PASSES) { DText.parse(dtext) }
+      objects = (GC.stat(:total_allocated_objects) - before) / PASSES.to_f
+
+      memsize = ObjectSpace.memsize_of(results.first) + results.first.sum { |key, value| ObjectSpace.memsize_of(key) + ObjectSpace.memsize_of(value) }
+      growth = rss && MemoryBench.rss("VmHWM") - rss
+
+      writer.write(JSON.generate(objects: objects, memsize: memsize, rss_growth: growth))
+      writer.close
+      exit!(0)
+    end
+
+    writer.close
+    result = JSON.parse(reader.read, symbolize_names: true)
+    Process.wait(pid)
+    result
+  ensure
+    reader&.close
+  end
+
+  def run
+    puts format("%-8s %8s | %10s %10s %10s %9s | %10s %10s %11s", "category", "bytes", "allocs/doc", "KB/doc", "peak KB", "RSS MB", "objs/call", "result KB", "RSS grew MB")
+
+    categories.each do |category|
+      dtext = DTextBench.new.document(category)
+      native = native(dtext)
+      ruby = ruby(dtext)
+      growth = ruby[:rss_growth] ? format("%11.1f", ruby[:rss_growth] / 1e6) : format("%11s", "n/a")
+
+      puts format("%-8s %8d | %10.1f %10.1f %10.1f %9.1f | %10.1f %10.1f %s", category, dtext.bytesize, native[:allocations], native[:allocated_bytes] / 1e3,
+        native[:peak_bytes] / 1e3, native[:max_rss] / 1e6, ruby[:objects], ruby[:memsize] / 1e3, growth)
+    end
+  end
+end
+
+MemoryBench.new.run
@@ -0,0 +1,153 @@
+# frozen_string_literal: true
+
+# Measures how parse time scales with input size for adversarial inputs, one family of scanner rules at a time.
+#
+# Each family is a short unit that gets repeated until the input reaches a given size. The scaling exponent is the
+# slope of log(time) against log(size); 1.0 is linear, 2.0 is quadratic. The run fails if any family scales worse than
+# MAX_EXPONENT, except for the families in KNOWN_SUPERLINEAR, which are reported but don't fail the run.
+#
+# Timings are noisy, so the inputs are large (with small ones, the fixed cost of a call flattens the slope), each time is
+# the fastest of REPETITIONS runs taken in turns across the sizes (noise only ever makes a run slower, and a slow spell
+# then hits every size rather than one), and a family that fails is measured again up to RETRIES times before it's
+# reported. A superlinear rule is slow every time, so this only filters out noise. The sizes double so that every
+# output ends at the same point in its buffer's growth.
+#
+# Extra units can be dropped into test/files/pathological/*.dtext (one unit per file, named after the file).
+#
+#   bin/rake bench:pathological
+#   MAX_EXPONENT=1.2 SIZES=262144,1048576,4194304 REPETITIONS=10 RETRIES=0 bin/rake bench:pathological
+
+require "dtext"
+require "fiddle"
+
+class PathologicalBench
+  MAX_EXPONENT = Float(ENV.fetch("MAX_EXPONENT", "1.1"))
+  SIZES = ENV.fetch("SIZES", "262144,524288,1048576,2097152").split(",").map(&:to_i)
+  REPETITIONS = Integer(ENV.fetch("REPETITIONS", "5")) # Take the fastest of this many runs of each input.
+  RETRIES = Integer(ENV.fetch("RETRIES", "2"))         # Measure a family that fails again up to this many times.
+
+  FAMILIES = {
+    "plain_text"               => { unit: "lorem ipsum dolor " },
+    "creator_link"             => { unit: "[[" },
+    "creator_target"           => { unit: "[[a b " },
+    "aliased_creator_link"     => { unit: "[[a|b " },
+    "post_search_link"         => { unit: "{{a " },
+    "basic_textile_link"       => { unit: '"a":' },
+    "bracketed_textile_link"   => { unit: '"a":[/' },
+    "markdown_link"            => { unit: "[a" },
+    "backwards_markdown_link"  => { unit: "[http://a](" },
+    "html_link"                => { unit: '<a href="/a">' },
+    "named_bbcode_link"        => { unit: "[url=/a]b" },
+    "unnamed_bbcode_link"      => { unit: "[url]/a " },
+    "delimited_url"            => { unit: "<http://a" },
+    "bare_url"                 => { unit: "http://a.b/" },
+    "long_url"                 => { prefix: "http://a.b/", unit: "a/" },
+    "aliased_section"          => { unit: "[section=" },
+    "delimited_qtag"           => { unit: "<#a", options: { qtags: true } },
+    "bare_qtag"                => { unit: " #a", options: { qtags: true } },
+    "table_attributes"         => { prefix: "[table]", unit: '[td align="a' },
+    "nested_inline"            => { unit: "[b][i]" },
+    "list_items"               => { unit: "* a\n" },
+    "header"                   => { unit: "h1. a\n" },
+  }.freeze
+
+  # Families that are currently superlinear. Remove a family from this list once its rule is fixed so that regressions
+  # fail the run.
+  KNOWN_SUPERLINEAR = %w[].freeze
+
+  def families
+    extra = Dir[File.join(__dir__, "files/pathological/*.dtext")].to_h do |file|
+      [File.basename(file, ".dtext"), { unit: File.read(file) }]
+    end
+
+    FAMILIES.merge(extra)
+  end
+
+  def input(family, size)
+    prefix = family.fetch(:prefix, "")
+    unit = family[:unit]
+    prefix + (unit * ((size - prefix.bytesize) / unit.bytesize).clamp(1..))
+  end
+
+  # Stop glibc from handing freed memory back to the kernel, so that the output buffers of a big parse don't have to be
+  # page faulted in again on every run. That costs more per byte the bigger the buffer is (on VMs especially), which
+  # made families with a large output, like nested tags, look superlinear. Does nothing with other allocators.
+  def keep_freed_memory
+    mallopt = Fiddle::Function.new(Fiddle::Handle::DEFAULT["mallopt"], [Fiddle::TYPE_INT, Fiddle::TYPE_INT], Fiddle::TYPE_INT)
+    mallopt.call(-1, 1 << 30) # M_TRIM_THRESHOLD
+    mallopt.call(-3, 32 << 20) # M_MMAP_THRESHOLD (the most it can be)
+  rescue Fiddle::DLError
+    # Not glibc.
+  end
+
+  def time(input, options)
+    GC.start
+    start = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+
+    begin
+      DText.parse(input, **options)
+    rescue DText::Error
+      # Errors still count, since the time spent before failing is what we're measuring.
+    end
+
+    Process.clock_gettime(Process::CLOCK_MONOTONIC) - start
+  end
+
+  # Returns [size, fastest time] for each of SIZES.
+  def measure(family)
+    inputs = SIZES.map { |size| input(family, size) }
+    options = family.fetch(:options, {})
+
+    times = REPETITIONS.times.map do
+      inputs.map { |input| time(input, options) }
+    end
+
+    inputs.map(&:bytesize).zip(times.transpose.map(&:min))
+  end
+
+  # Least squares fit of log(time) = exponent * log(size) + c.
+  def exponent(samples)
+    xs = samples.map { |size, _| Math.log(size) }
+    ys = samples.map { |_, time| Math.log(time) }
+    mean_x = xs.sum / xs.size
+    mean_y = ys.sum / ys.size
+
+    numerator = xs.zip(ys).sum { |x, y| (x - mean_x) * (y - mean_y) }
+    denominator = xs.sum { |x| (x - mean_x)**2 }
+    numerator / denominator
+  end
+
+  def run
+    failures = []
+    keep_freed_memory
+
+    puts format("%-26s %12s %12s %9s", "family", "MB/s (small)", "MB/s (large)", "exponent")
+
+    families.each do |name, family|
+      samples = measure(family)
+      slope = exponent(samples)
+
+      RETRIES.times do
+        break if slope <= MAX_EXPONENT
+        samples, slope = [[samples, slope], measure(family).then { |s| [s, exponent(s)] }].min_by(&:last)
+      end
+
+      small, large = samples.minmax_by(&:first).map { |size, time| size / time / 1_000_000.0 }
+
+      status = if slope <= MAX_EXPONENT
+        ""
+      elsif KNOWN_SUPERLINEAR.include?(name)
+        "(known)"
+      else
+        failures << name
+        "FAIL"
+      end
+
+      puts format("%-26s %12.2f %12.2f %9.2f %s", name, small, large, slope, status)
+    end
+
+    return if failures.empty?
+
+    abort "\n#{failures.size} famil#{failures.size == 1 ? 'y' : 'ies'} scaled worse than n^#{MAX_EXPONENT}: #{failures.join(', ')}"
+  end
+end
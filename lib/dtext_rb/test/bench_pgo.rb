@@ -0,0 +1,54 @@
+# frozen_string_literal: true
+
+# Measures what a DTEXT_PGO=1 build (see extconf.rb) gains: builds the extension normally and measures DText.parse on
+# each scenario of bench_dtext.rb, then builds it again with DTEXT_PGO=1 and measures it again, and reports the
+# throughput before and after. Each build is measured in its own process, since an extension can't be unloaded. The PGO
+# build is left in place; `bin/rake clean compile` goes back to a normal one.
+#
+#   bin/rake bench:pgo
+#   CATEGORIES=prose,links OPTIONS=default TIME=2 bin/rake bench:pgo
+
+require_relative "bench_dtext"
+require "open3"
+
+class PGOBench
+  RAKE = File.expand_path("../bin/rake", __dir__)
+
+  # The bytes per second of DText.parse on each scenario, with the extension that's currently built.
+  def self.measure
+    bench = DTextBench.new
+
+    bench.scenarios.to_h do |category, (name, options)|
+      dtext = bench.document(category)
+      ["#{category}/#{name}", dtext.bytesize / bench.sample_ruby(dtext, options)[:median]]
+    end
+  end
+
+  def build(pgo)
+    warn "Building the extension#{' with DTEXT_PGO=1' if pgo}..."
+    _, status = Open3.capture2e({ "DTEXT_PGO" => pgo ? "1" : nil }, RAKE, "clean", "compile")
+    abort "#{RAKE} clean compile failed" unless status.success?
+  end
+
+  def measure
+    output, status = Open3.capture2(Gem.ruby, "-I#{File.expand_path('../lib', __dir__)}", "-r#{__FILE__}", "-e", "puts JSON.generate(PGOBench.measure)")
+    abort "measuring failed" unless status.success?
+    JSON.parse(output)
+  end
+
+  def run
+    build(false)
+    before = measure
+    build(true)
+    after = measure
+
+    puts format("%-20s %12s %12s %9s", "scenario", "before MB/s", "after MB/s", "change")
+
+    before.each do |key, bytes_per_second|
+      puts format("%-20s %12.2f %12.2f %+8.1f%%", key, bytes_per_second / 1_000_000.0, after[key] / 1_000_000.0, (after[key] / bytes_per_second - 1) * 100)
+    end
+
+    mean = before.keys.map { |key| Math.log(after[key] / before[key]) }.sum / before.size
+    puts format("\n%-20s %+35.1f%%", "geometric mean", (Math.exp(mean) - 1) * 100)
+  end
+end
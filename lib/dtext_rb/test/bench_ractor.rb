@@ -0,0 +1,71 @@
+# frozen_string_literal: true
+
+# Measures how parsing scales across Ractors.
+#
+# A corpus of DOCUMENTS generated documents is parsed once on the main Ractor, then split evenly between 1, 2, 4, ...
+# up to RACTORS Ractors, which parse their share in parallel. Reports documents per second and the speedup over one
+# Ractor for each count, and fails if any Ractor's output differs from the main Ractor's.
+#
+#   bin/rake bench:ractor
+#   RACTORS=16 DOCUMENTS=20000 bin/rake bench:ractor
+
+require "dtext"
+require "etc"
+
+Warning[:experimental] = false
+
+class RactorBench
+  RACTORS = Integer(ENV.fetch("RACTORS", Etc.nprocessors.to_s))
+  DOCUMENTS = Integer(ENV.fetch("DOCUMENTS", "5000"))
+
+  PARAGRAPHS = [
+    "[b]Bold[/b], [i]italic[/i] and [u]underlined[/u] text with a [[wiki link]] and a {{tag_search}}.",
+    "* list item one\n* list item two with post #1234\n** nested item",
+    "[quote]\nname said:\nquoted text with \"a link\":https://example.com/path?q=1\n[/quote]",
+    "h4. Section header\n\nSome text under the header with [spoiler]a spoiler[/spoiler].",
+    "[table]\n[tr][th]Name[/th][th]Value[/th][/tr]\n[tr][td]a[/td][td]b[/td][/tr]\n[/table]",
+    "[code]\ncode block {\n  with [b]no markup[/b]\n}\n[/code]",
+  ].freeze
+
+  def corpus
+    @corpus ||= Ractor.make_shareable(Array.new(DOCUMENTS) do |i|
+      Array.new(4 + (i % 8)) { |j| "#{PARAGRAPHS[(i + j) % PARAGRAPHS.size]} (#{i}.#{j})" }.join("\n\n")
+    end)
+  end
+
+  def measure
+    start = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+    result = yield
+    [result, Process.clock_gettime(Process::CLOCK_MONOTONIC) - start]
+  end
+
+  def run
+    expected = corpus.map { |dtext| DText.parse(dtext)[:dtext] }
+    counts = [1, 2, 4, 8, 16, 32, 64].select { |n| n <= RACTORS } | [RACTORS]
+    baseline = nil
+    mismatches = 0
+
+    puts format("%-8s %14s %8s", "ractors", "documents/s", "speedup")
+
+    counts.each do |count|
+      slices = corpus.each_slice((corpus.size / count.to_f).ceil).to_a
+
+      outputs, elapsed = measure do
+        ractors = slices.map do |slice|
+          Ractor.new(slice) { |documents| documents.map { |dtext| DText.parse(dtext)[:dtext] } }
+        end
+
+        ractors.flat_map(&:take)
+      end
+
+      mismatches += outputs.zip(expected).count { |output, html| output != html }
+      rate = corpus.size / elapsed
+      baseline ||= rate
+      puts format("%-8d %14.0f %7.2fx", count, rate, rate / baseline)
+    end
+
+    abort "\n#{mismatches} documents were parsed differently in a Ractor" if mismatches > 0
+  end
+end
+
+RactorBench.new.run
@@ -0,0 +1,106 @@
+# frozen_string_literal: true
+
+# Measures the shared render cache with several processes rendering the same set of short strings at once.
+#
+# Each process renders strings drawn from a corpus of CORPUS distinct strings, with a skewed distribution (a few strings
+# are rendered very often, most rarely), for DURATION seconds. This is run without a cache, with the in-process render
+# cache and with the shared render cache, and the total renders per second of all the processes is reported. Every
+# cached result is checked against an uncached parse; the run fails if any of them differ.
+#
+#   bin/rake bench:shared_render_cache
+#   PROCESSES=8 CORPUS=100000 DURATION=5 bin/rake bench:shared_render_cache
+
+require "dtext"
+require "tmpdir"
+
+class SharedRenderCacheBench
+  PROCESSES = Integer(ENV.fetch("PROCESSES", "4"))
+  CORPUS = Integer(ENV.fetch("CORPUS", "20000"))
+  DURATION = Float(ENV.fetch("DURATION", "2"))
+  MAX_BYTES = Integer(ENV.fetch("MAX_BYTES", (64 * 1024 * 1024).to_s))
+
+  def corpus
+    @corpus ||= Array.new(CORPUS) do |i|
+      "[b]#{i}[/b] changed the tags of post ##{i * 7} from [[tag_#{i % 97}]] to [[tag_#{i % 89}]]: \"reason\":/forum_topics/#{i}"
+    end
+  end
+
+  # A rough Zipf distribution: the string at index i is picked about 1/(i+1) as often as the first one.
+  def sample(random)
+    (CORPUS**random.rand).to_i - 1
+  end
+
+  def expected
+    @expected ||= corpus.map { |dtext| DText.parse(dtext) }
+  end
+
+  def worker(seed)
+    random = Random.new(seed)
+    renders = 0
+    mismatches = 0
+    deadline = Process.clock_gettime(Process::CLOCK_MONOTONIC) + DURATION
+
+    while Process.clock_gettime(Process::CLOCK_MONOTONIC) < deadline
+      100.times do
+        i = sample(random)
+        mismatches += 1 if DText.parse(corpus[i]) != expected[i]
+        renders += 1
+      end
+    end
+
+    [renders, mismatches]
+  end
+
+  def run_processes
+    workers = PROCESSES.times.map do |n|
+      reader, writer = IO.pipe
+
+      pid = fork do
+        reader.close
+        yield if block_given?
+        writer.write(Marshal.dump(worker(n)))
+        exit!(0)
+      end
+
+      writer.close
+      [pid, reader]
+    end
+
+    workers.map do |pid, reader|
+      result = Marshal.load(reader.read) # rubocop:disable Security/MarshalLoad
+      Process.wait(pid)
+      result
+    end.transpose.map(&:sum)
+  end
+
+  def report(name, renders, mismatches)
+    puts format("%-24s %12.0f renders/s %8d mismatches", name, renders / DURATION, mismatches)
+    mismatches
+  end
+
+  def run
+    expected
+    mismatches = 0
+
+    Dir.mktmpdir do |dir|
+      mismatches += report("uncached", *run_processes)
+
+      mismatches += report("in-process cache", *run_processes { DText.render_cache_max_bytes = MAX_BYTES })
+
+      # Opened in each worker, so they start out cold and warm it up for each other.
+      path = File.join(dir, "dtext.cache")
+      mismatches += report("shared cache (cold)", *run_processes { DText.open_shared_render_cache(path, max_bytes: MAX_BYTES) })
+
+      # Opened before forking, as with a preloading server, with the cache left warm by the last run.
+      DText.open_shared_render_cache(path, max_bytes: MAX_BYTES)
+      mismatches += report("shared cache (warm)", *run_processes)
+      puts "shared cache: #{DText.shared_render_cache_stats.slice(:entries, :bytes, :max_bytes).inspect}"
+    ensure
+      DText.close_shared_render_cache
+    end
+
+    abort "\n#{mismatches} cached renders differed from the uncached output" if mismatches > 0
+  end
+end
+
+SharedRenderCacheBench.new.run
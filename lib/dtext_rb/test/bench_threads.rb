@@ -0,0 +1,106 @@
+# frozen_string_literal: true
+
+# Measures how parsing scales with the number of threads, to catch contention (in the allocator, from false sharing,
+# or on shared state in the parser) that would cap it.
+#
+# The corpus of bench_dtext.rb (one document per category) is parsed over and over for TIME seconds on 1, 2, 4, 8 and
+# THREADS threads at once, in three ways: natively with bin/cdtext.exe (one parser per thread), in Ractors, and in Ruby
+# threads (which DText.parse can't run in parallel, since it holds the GVL). For each thread count, reports the combined
+# throughput, the scaling efficiency (throughput / (threads * throughput on one thread)) and the p99 latency per
+# document.
+#
+#   bin/rake bench:threads
+#   THREADS=32 TIME=5 MODES=native,ractor bin/rake bench:threads
+
+require_relative "bench_dtext"
+require "etc"
+require "tmpdir"
+
+Warning[:experimental] = false
+
+class ThreadsBench
+  THREADS = Integer(ENV.fetch("THREADS", Etc.nprocessors.to_s))
+  TIME = Float(ENV.fetch("TIME", "2"))
+  MODES = ENV.fetch("MODES", "native,ractor,thread").split(",")
+
+  def corpus
+    @corpus ||= Ractor.make_shareable(DTextBench::CATEGORIES.keys.map { |category| DTextBench.new.document(category) })
+  end
+
+  def thread_counts
+    ([1, 2, 4, 8].select { |n| n <= THREADS } | [THREADS]).sort
+  end
+
+  def percentile(sorted, p)
+    sorted[[(p * sorted.size).to_i, sorted.size - 1].min]
+  end
+
+  # Parse the corpus over and over until the deadline. Returns the bytes parsed and the latency of each parse.
+  def self.parse_until(corpus, deadline)
+    bytes = 0
+    latencies = []
+
+    while Process.clock_gettime(Process::CLOCK_MONOTONIC) < deadline
+      corpus.each do |dtext|
+        start = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+        DText.parse(dtext)
+        latencies << (Process.clock_gettime(Process::CLOCK_MONOTONIC) - start)
+        bytes += dtext.bytesize
+      end
+    end
+
+    [bytes, latencies]
+  end
+
+  def run_ruby(mode, threads)
+    deadline = Process.clock_gettime(Process::CLOCK_MONOTONIC) + TIME
+    start = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+
+    workers = threads.times.map do
+      if mode == "ractor"
+        Ractor.new(corpus, deadline) { |corpus, deadline| ThreadsBench.parse_until(corpus, deadline) }
+      else
+        Thread.new { ThreadsBench.parse_until(corpus, deadline) }
+      end
+    end
+
+    results = workers.map { |worker| mode == "ractor" ? worker.take : worker.value }
+    elapsed = Process.clock_gettime(Process::CLOCK_MONOTONIC) - start
+    latencies = results.flat_map(&:last).sort
+
+    { throughput: results.sum(&:first) / elapsed, p99: percentile(latencies, 0.99) }
+  end
+
+  def run_native(threads)
+    cdtext = DTextBench::CDTEXT
+    abort "#{cdtext} doesn't exist; build it with `bin/rake compile` (or set CDTEXT)" unless File.executable?(cdtext)
+
+    Dir.mktmpdir do |dir|
+      files = corpus.each_with_index.map do |dtext, i|
+        File.join(dir, "#{i}.dtext").tap { |file| File.write(file, dtext) }
+      end
+
+      output, status = Open3.capture2(cdtext, "--bench", "--bench-time=#{TIME}", "--bench-threads=#{threads}", "--json", *files)
+      abort "#{cdtext} failed" unless status.success?
+      JSON.parse(output, symbolize_names: true).slice(:throughput, :p99)
+    end
+  end
+
+  def run
+    puts format("%-8s %8s %12s %11s %12s", "mode", "threads", "MB/s", "efficiency", "p99 (us)")
+
+    MODES.each do |mode|
+      single = nil
+
+      thread_counts.each do |threads|
+        result = mode == "native" ? run_native(threads) : run_ruby(mode, threads)
+        single ||= result[:throughput]
+        efficiency = result[:throughput] / (threads * single)
+
+        puts format("%-8s %8d %12.2f %10.0f%% %12.1f", mode, threads, result[:throughput] / 1_000_000.0, efficiency * 100, result[:p99] * 1e6)
+      end
+    end
+  end
+end
+
+ThreadsBench.new.run
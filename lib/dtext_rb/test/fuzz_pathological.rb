@@ -0,0 +1,105 @@
+# frozen_string_literal: true
+
+# Searches for inputs that are expensive to parse with bin/fuzz_dtext.exe (see ext/dtext/fuzz_dtext.cpp) and adds the
+# superlinear units it finds to test/files/pathological/, where bench_pathological.rb picks them up.
+#
+# The fuzzer's dictionary is built from the string literals in the grammar in dtext.cpp.rl, so that it inserts whole
+# tags and keywords (`[[`, `{{`, `[section=`, `post #`, ...) instead of waiting to stumble on them a byte at a time.
+# Units that overlap a family that's already known to be superlinear, or a unit found before, are skipped. New units
+# make bench:pathological fail until the rule is fixed or the unit is added to KNOWN_SUPERLINEAR, like any other
+# superlinear family.
+#
+#   bin/rake fuzz
+#   FUZZ_TIME=600 SEED=1 bin/rake fuzz
+#   bin/rake fuzz:libfuzzer                  # with clang; then minimize its corpus with:
+#   CORPUS=tmp/fuzz_corpus bin/rake fuzz
+
+require_relative "bench_pathological"
+require "digest"
+require "fileutils"
+require "json"
+require "open3"
+require "strscan"
+
+class PathologicalFuzzer
+  FUZZER = ENV.fetch("FUZZER", File.expand_path("../bin/fuzz_dtext.exe", __dir__))
+  GRAMMAR = File.expand_path("../ext/dtext/dtext.cpp.rl", __dir__)
+  DICTIONARY = File.expand_path("../tmp/dtext.dict", __dir__)
+  IGNORED = File.expand_path("../tmp/pathological.dict", __dir__)
+  OUTPUT_DIR = File.join(__dir__, "files/pathological")
+  FUZZ_TIME = Integer(ENV.fetch("FUZZ_TIME", "60"))
+
+  # Constructs that span several literals in the grammar.
+  EXTRA_TOKENS = ['"a":', '"a":[', "[[a]]", "{{a}}", "[section=a]", "post #1", "http://a.b/", '<a href="', "\n\n"].freeze
+
+  # The string literals in the Ragel machine, like `'[['` or `'post #'i`, skipping comments, character classes and the
+  # C++ code in actions.
+  def grammar_tokens
+    scanner = StringScanner.new(File.read(GRAMMAR, encoding: "UTF-8")[/^%%\{(.*?)^\}%%/m, 1])
+    tokens = []
+    depth = 0
+
+    until scanner.eos?
+      if (literal = scanner.scan(/'(?:[^'\\\n]|\\.)*'|"(?:[^"\\\n]|\\.)*"/))
+        tokens << literal[1...-1].gsub(/\\(.)/) { { "n" => "\n", "t" => "\t", "r" => "\r", "0" => "\0" }.fetch($1, $1) } if depth == 0
+      elsif scanner.scan(/\{/)
+        depth += 1
+      elsif scanner.scan(/\}/)
+        depth -= 1
+      elsif depth == 0 && scanner.scan(/#.*|\[(?:[^\]\\]|\\.)*\]/)
+        # Skip comments and character classes.
+      else
+        scanner.getch
+      end
+    end
+
+    tokens
+  end
+
+  # Quote a token in the libFuzzer/AFL dictionary format.
+  def escape(token)
+    '"' + token.b.gsub(/["\\]|[^\x20-\x7e]/n) { |c| c =~ /["\\]/ ? "\\#{c}" : format("\\x%02x", c.ord) } + '"'
+  end
+
+  def write_dictionary
+    tokens = (grammar_tokens + EXTRA_TOKENS).uniq.reject { |token| token.empty? || token.include?("\0") }
+
+    FileUtils.mkdir_p(File.dirname(DICTIONARY))
+    File.write(DICTIONARY, tokens.map.with_index { |token, i| "token_#{i}=#{escape(token)}\n" }.join)
+  end
+
+  # The units of the known superlinear families and of the units found before, which the fuzzer skips.
+  def write_ignored
+    units = PathologicalBench.new.families.filter_map do |name, family|
+      family[:unit] if PathologicalBench::KNOWN_SUPERLINEAR.include?(name) || !PathologicalBench::FAMILIES.key?(name)
+    end
+
+    File.write(IGNORED, units.map.with_index { |unit, i| "unit_#{i}=#{escape(unit)}\n" }.join)
+  end
+
+  def fuzz
+    abort "#{FUZZER} doesn't exist; build it with `bin/rake fuzz`" unless File.executable?(FUZZER)
+
+    args = ["-dict=#{DICTIONARY}", "-ignore=#{IGNORED}", "-max_total_time=#{FUZZ_TIME}"]
+    args << "-seed=#{ENV["SEED"]}" if ENV["SEED"]
+    args += Dir[File.join(ENV["CORPUS"], "*")] if ENV["CORPUS"]
+
+    output, status = Open3.capture2(FUZZER, *args)
+    abort "#{FUZZER} failed" unless status.success?
+
+    output.lines.map { |line| JSON.parse(line, symbolize_names: true) }
+  end
+
+  def run
+    write_dictionary
+    write_ignored
+    FileUtils.mkdir_p(OUTPUT_DIR)
+
+    fuzz.each do |found|
+      file = File.join(OUTPUT_DIR, "fuzz_#{Digest::SHA1.hexdigest(found[:unit])[0, 8]}.dtext")
+      File.write(file, found[:unit])
+
+      puts format("%-24s %8.1f basic blocks/byte  n^%.2f  => %s", found[:unit].inspect, found[:cost_per_byte], found[:exponent], File.basename(file))
+    end
+  end
+end
@@ -0,0 +1,45 @@
+# frozen_string_literal: true
+
+# Writes ext/dtext/pgo_corpus.ndjson, the training corpus for DTEXT_PGO=1 builds (see extconf.rb): every input that
+# test_dtext.rb parses, followed by one document per category of bench_dtext.rb (at SIZE=4096, since the profile only
+# needs the mix of markup, not the volume). It's committed, so that PGO builds don't need the tests to run first; run
+# this again after adding tests or benchmark categories, so that the profile covers them:
+#
+#   bin/rake pgo:corpus
+
+ENV["SIZE"] ||= "4096"
+
+require_relative "bench_dtext"
+require "json"
+require "minitest"
+
+class PGOCorpus
+  PATH = File.expand_path("../ext/dtext/pgo_corpus.ndjson", __dir__)
+  MAX_BYTES = 16 * 1024
+
+  # Records the input of every DText.parse made by the tests.
+  module Recorder
+    def parse(str, ...)
+      PGOCorpus.inputs << str if str.is_a?(String) && Ractor.current == Ractor.main
+      super
+    end
+  end
+
+  def self.inputs
+    @inputs ||= []
+  end
+
+  # The corpus can only hold documents that cdtext can read from NDJSON (the tests of invalid input are left out). The
+  # huge inputs of the tests of limits and threads are left out too, since they're the same markup repeated.
+  def self.write
+    documents = inputs.uniq.sort + DTextBench::CATEGORIES.keys.map { |category| DTextBench.new.document(category) }
+    documents = documents.uniq.select { |dtext| dtext.bytesize <= MAX_BYTES && dtext.valid_encoding? && !dtext.include?("\0") }
+
+    File.write(PATH, documents.map { |dtext| "#{JSON.generate(dtext)}\n" }.join)
+    puts "Wrote #{documents.size} documents (#{documents.sum(&:bytesize)} bytes) to #{PATH}"
+  end
+end
+
+DText.singleton_class.prepend(PGOCorpus::Recorder)
+Minitest.after_run { PGOCorpus.write }
+require_relative "test_dtext"
@@ -4,6 +4,7 @@ require "dtext"
 require "cgi"
 require "minitest/autorun"
 require "nokogiri"
+require "tmpdir"
 
 class DTextTest < Minitest::Test
   def parse(*args, **options)
@@ -360,6 +361,7 @@ class DTextTest < Minitest::Test
 
   def test_anchors
     assert_parse('<p><a id="test"></a></p>', "[#test]")
+    assert_parse('<p><a id="a"></a>(b]</p>', "[#a](b]")
     assert_parse_extra(creators: [], dtext: '<p><a class="dtext-link dtext-internal-anchor-link" href="#test">test</a></p>', input: "[[#test]]")
   end
 
@@ -986,6 +988,7 @@ class DTextTest < Minitest::Test
     assert_parse('<p><a class="dtext-link dtext-post-search-link" href="/posts?tags=tag">tag</a>}</p>', "{{tag}}}")
     assert_parse('<p>{{<a class="dtext-link dtext-post-search-link" href="/posts?tags=tag">tag</a>}}</p>', "{{{{tag}}}}")
     assert_parse('<p>{{tag1,<a class="dtext-link dtext-post-search-link" href="/posts?tags=tag2">tag2</a></p>', "{{tag1,{{tag2}}")
+    assert_parse('<p>{{a|b <a class="dtext-link dtext-post-search-link" href="/posts?tags=c">d</a></p>', "{{a|b {{c|d}}")
 
     assert_parse('<p>I like <a class="dtext-link dtext-post-search-link" href="/posts?tags=cat">cats</a>.</p>', "I like {{cat}}s.")
     assert_parse('<p>a <a class="dtext-link dtext-post-search-link" href="/posts?tags=cat">cat</a>\'s paw</p>', "a {{cat}}'s paw")
@@ -1477,6 +1480,18 @@ class DTextTest < Minitest::Test
     assert_parse(html, dtext)
   end
 
+  def test_links_start_at_the_last_opening_delimiter
+    assert_parse('<p>[[a <a rel="nofollow" class="dtext-link dtext-creator-link" href="/creators/show_or_new?name=b">b</a></p>', "[[a [[b]]")
+    assert_parse('<p>[[a|b <a rel="nofollow" class="dtext-link dtext-creator-link" href="/creators/show_or_new?name=c">d</a></p>', "[[a|b [[c|d]]")
+    assert_inline_parse('[a <a class="dtext-link" href="/x">c</a>', "[a [c](/x)")
+    assert_inline_parse('[/a <a class="dtext-link" href="/c">d</a>', "[/a [/c](d)")
+    assert_inline_parse('&lt;a href=&quot;/x&quot;&gt;a <a class="dtext-link" href="/y">b</a>', '<a href="/x">a <a href="/y">b</a>')
+    assert_parse('<p>[url=/a]b <a class="dtext-link" href="/c">d</a></p>', "[url=/a]b [url=/c]d[/url]")
+    assert_parse('<p>&lt;http://a <a rel="external nofollow noreferrer" class="dtext-link dtext-external-link" href="http://b">http://b</a></p>', "<http://a <http://b>")
+    assert_parse('<p>&quot;a&quot;:[/x&quot;y]</p>', '"a":[/x"y]')
+    assert_parse('<p>[section=a [section=b]</p>', "[section=a [section=b]")
+  end
+
   def test_nodtext
     assert_parse('<p>[b]not bold[/b]</p><p> <strong>bold</strong></p>', "[nodtext][b]not bold[/b][/nodtext] [b]bold[/b]")
     assert_parse('<p>[b]not bold[/b]</p><p><strong>hello</strong></p>', "[nodtext][b]not bold[/b][/nodtext]\n\n[b]hello[/b]")
@@ -1586,4 +1601,375 @@ class DTextTest < Minitest::Test
       parse_dtext(%("url":/page\xF4">x\xFA<b>xss\xFA</b>))
     end
   end
+
+  def test_long_urls
+    url = "https://danbooru.donmai.us/#{'a/' * 100_000}"
+    assert_parse(%{<p><a class="dtext-link" href="#{url}">#{url}</a></p>}, url, domain: "danbooru.donmai.us")
+    assert_parse(%{<p><a rel="external nofollow noreferrer" class="dtext-link dtext-external-link" href="#{url}">#{url}</a></p>}, url, internal_domains: ["danbooru.donmai.us"])
+  end
+
+  def test_limits
+    assert_parse("<p>foo</p>", "foo", max_output_bytes: 10, max_dstack_depth: 1, timeout: 1)
+    assert_raises(DText::LimitExceeded) { parse_dtext("[[foo]] " * 10, max_output_bytes: 500) }
+    assert_raises(DText::LimitExceeded) { parse_dtext("[quote]" * 10, max_dstack_depth: 5) }
+    assert_raises(DText::LimitExceeded) { parse_dtext("[b]" * 10, max_dstack_depth: 5) }
+    assert_raises(DText::LimitExceeded) { parse_dtext("[[[[" * 20_000, timeout: 0.000001) }
+    assert_raises(DText::LimitExceeded) { parse_dtext("[url]#{'a' * 1_000_000}", timeout: 0.000001) }
+    assert_raises(DText::LimitExceeded) { parse_dtext("[url]#{'a' * 1_000_000}", timeout: 0.000001, cache_blocks: true) }
+    assert_raises(DText::LimitExceeded) { DText::Stream.new(timeout: 0.000001) << "[url]#{'a' * 1_000_000}" }
+
+    # With a timeout, the input is scanned in windows; tokens that straddle a window still parse the same.
+    dtext = "[b]foo[/b] [[bar|baz]] \"quux\":[/posts?tags=#{'a' * 5000}] [code]#{'x' * 5000}[/code]\n\n" * 10
+    assert_equal(parse_dtext(dtext), parse_dtext(dtext, timeout: 60))
+    assert_equal(parse_dtext(dtext), parse_dtext(dtext, timeout: 60, cache_blocks: true))
+    assert_raises(DText::Error) { parse_dtext("[[foo]] " * 10, max_output_bytes: 500) }
+  end
+
+  def test_stream
+    dtext = <<~DTEXT.gsub("\n", "\r\n") * 3
+      h4#intro. Hello [b]world[/b] é☃😀
+
+      [quote]
+      "quoted link":/posts?tags=touhou and [[kirisame marisa|marisa]] {{touhou rating:s}}
+      [/quote]
+
+      * post #1234 and topic #5 /p2
+      ** https://danbooru.donmai.us/posts/1 <https://example.com/a_(b)>
+
+      [table]
+      [tr][td align="center" colspan="2"]cell[/td][/tr]
+      [/table]
+
+      [code]x < y[/code] [nodtext][b][/nodtext] `inline` [spoiler]hidden[/spoiler]
+      [section=Title]body[/section] [[foo#bar]] [i]unclosed
+    DTEXT
+
+    expected = DText.parse(dtext, domain: "danbooru.donmai.us")
+
+    [1, 2, 3, 7, 64, dtext.bytesize].each do |chunk_size|
+      stream = DText::Stream.new(domain: "danbooru.donmai.us")
+      html = dtext.b.chars.each_slice(chunk_size).map { |chunk| stream.write(chunk.join.force_encoding("UTF-8")) }.join
+      result = stream.close
+
+      assert_equal(expected[:dtext], html + result[:dtext], "chunk_size: #{chunk_size}")
+      assert_equal(expected.except(:dtext), result.except(:dtext), "chunk_size: #{chunk_size}")
+    end
+
+    chunks = DText.parse_io(StringIO.new(dtext), chunk_size: 5, domain: "danbooru.donmai.us").to_a
+    assert_operator(chunks.size, :>, 1)
+    assert_equal(expected[:dtext], chunks.join)
+
+    stream = DText::Stream.new
+    assert_raises(DText::Error) { stream.write("\xFF") }
+    assert_raises(DText::Error) { stream.write("foo") }
+    assert_raises(DText::Error) { DText::Stream.new.tap { |s| s.write("\xE2\x98") }.close }
+    assert_raises(DText::LimitExceeded) { DText::Stream.new(max_output_bytes: 500) << "[[foo]] " * 10 }
+  end
+
+  def test_each_event
+    events = DText.each_event(%{h4. Title\n\n[b]hi[/b] &amp; [[Foo Bar|foo]] {{touhou}} "ext":https://example.com #qtag\nbye\n\n[table][tr][td align="left"]x[/td][/tr][/table]}, qtags: true).to_a
+
+    assert_equal([
+      [:open, :block_h4, {}],
+      [:text, "Title"],
+      [:close, :block_h4],
+      [:open, :block_p, {}],
+      [:open, :inline_b, {}],
+      [:text, "hi"],
+      [:close, :inline_b],
+      [:text, " & "],
+      [:link, :creator, "foo_bar", "foo"],
+      [:text, " "],
+      [:link, :post_search, "touhou", "touhou"],
+      [:text, " "],
+      [:link, :external, "https://example.com", "ext"],
+      [:text, " "],
+      [:qtag, "qtag"],
+      [:text, "\nbye"],
+      [:close, :block_p],
+      [:open, :block_table, {}],
+      [:open, :block_tr, {}],
+      [:open, :block_td, { "align" => "left" }],
+      [:text, "x"],
+      [:close, :block_td],
+      [:close, :block_tr],
+      [:close, :block_table],
+    ], events)
+
+    assert_equal([[:link, :id, "/posts/1", "post #1"]], DText.each_event("post #1 thumb #1").select { |type, *| type == :link }.uniq)
+    assert_equal([[:open, :block_p, {}]], DText.each_event("[b]x[/b]").first(1))
+    assert_raises(ZeroDivisionError) { DText.each_event("[b]x[/b]") { 1 / 0 } }
+  end
+
+  def test_compile
+    dtext = <<~DTEXT
+      h4. Title
+
+      [quote]"link":/posts and "ext":https://danbooru.donmai.us/posts/1 and [[foo]] and {{touhou}}[/quote]
+
+      * thumb #1234 https://danbooru.donmai.us/creators/bar "//example.com":[//example.com]
+      [section=Summary][b]bold[/b] [/td] #qtag [color=red]red[/color][/section]
+    DTEXT
+
+    ir = DText.compile(dtext, qtags: true, allow_color: true)
+
+    [{}, { inline: true }, { base_url: "https://example.com" }, { domain: "danbooru.donmai.us" }, { internal_domains: ["danbooru.donmai.us"] }].each do |options|
+      assert_equal(DText.parse(dtext, qtags: true, allow_color: true, **options), DText.render(ir, **options), options.inspect)
+    end
+
+    assert_equal(Encoding::BINARY, ir.encoding)
+    assert_raises(DText::StaleIR) { DText.render(ir.sub("DTIR#{DText::IR_VERSION.chr}".b, "DTIR\x00".b)) }
+    assert_raises(DText::Error) { DText.render("foo") }
+    assert_raises(DText::Error) { DText.render(ir[0...-1]) }
+  end
+
+  def test_to_plain_text
+    dtext = %{h4. Title
+
+[b]hi[/b]  &amp;	[[Foo Bar|foo]] {{touhou}} "ext":https://example.com #qtag
+bye
+
+* one
+* two
+
+[quote]quoted[/quote][spoiler]secret[/spoiler] post #1}
+
+    assert_equal("Title hi & foo touhou ext #qtag bye one two quoted post #1", DText.to_plain_text(dtext, qtags: true))
+    assert_equal("Title hi & foo touhou ext #qtag bye one two quoted secret post #1", DText.to_plain_text(dtext, qtags: true, spoilers: true))
+    assert_equal("a c", DText.to_plain_text("a [spoiler]b[/spoiler] c"))
+    assert_equal("`a` & #b", DText.to_plain_text("&grave;a&grave; &amp; &num;b"))
+    assert_equal("", DText.to_plain_text("  \n\n "))
+    assert_nil(DText.to_plain_text(nil))
+    assert_equal(Encoding::UTF_8, DText.to_plain_text("café").encoding)
+  end
+
+  def test_max_visible_chars
+    assert_equal({ dtext: "<p><strong>hel…</strong></p>", truncated: true }, DText.parse("[b]hello[/b] world", max_visible_chars: 3).slice(:dtext, :truncated))
+    assert_equal({ dtext: "<p><strong>hello…</strong></p>", truncated: true }, DText.parse("[b]hello[/b] world", max_visible_chars: 5).slice(:dtext, :truncated))
+    assert_equal({ dtext: "<p><strong>hello</strong> world</p>", truncated: false }, DText.parse("[b]hello[/b] world", max_visible_chars: 11).slice(:dtext, :truncated))
+    assert_equal("<p>café…</p>", DText.parse("café au lait", max_visible_chars: 4)[:dtext])
+    assert_equal("<p>a<br>…</p>", DText.parse("a\nb", max_visible_chars: 2)[:dtext])
+    assert_equal("<p>a&amp;…</p>", DText.parse("a&amp;b", max_visible_chars: 2)[:dtext])
+
+    # Links are kept whole, or left out if there's no room left.
+    assert_equal({ dtext: '<p>a <a rel="nofollow" class="dtext-link dtext-creator-link" href="/creators/show_or_new?name=foo_bar">foo bar</a>…</p>', creators: ["foo bar"] }, DText.parse("a [[foo bar]] b", max_visible_chars: 3).slice(:dtext, :creators))
+    assert_equal({ dtext: "<p>a …</p>", post_ids: [] }, DText.parse("a thumb #1", max_visible_chars: 2).slice(:dtext, :post_ids))
+
+    # Open blocks are closed, and the document after the cutoff isn't parsed.
+    assert_equal("<blockquote><ul><li>one…</li></ul></blockquote>", DText.parse("[quote]\n* one\n* two\n[/quote]", max_visible_chars: 3)[:dtext])
+    assert_equal("<p>a…</p>", DText.parse("a #{'[b]' * 10_000}", max_visible_chars: 1, max_dstack_depth: 10)[:dtext])
+    assert_equal("hel…", DText.parse("h1. hello", max_visible_chars: 3, inline: true)[:dtext])
+    assert_equal('<p><span class="inline-code">ab…</span></p>', DText.parse("`abc`", max_visible_chars: 2)[:dtext])
+  end
+
+  def test_cache_blocks
+    DText.clear_block_cache
+    dtext = "h4. Title\r\n\r\n[quote]\n\na [[foo]] #qtag\n\n[/quote]\n\n* one\n* two\n\n\n`code\n\ncode` post #1\r\r\n\nlast"
+
+    [dtext, dtext.sub("Title", "Title!"), dtext.sub("last", "[b]last"), "#{dtext}\n\nmore", ""].each do |input|
+      [{}, { inline: true, qtags: true }].each do |options|
+        assert_equal(DText.parse(input, **options), DText.parse(input, **options, cache_blocks: true), input.inspect)
+      end
+    end
+
+    assert_operator(DText.block_cache_stats[:hits], :>, 0)
+    assert_raises(DText::LimitExceeded) { DText.parse(dtext, max_output_bytes: 100, cache_blocks: true) }
+
+    DText.clear_block_cache
+    assert_equal(0, DText.block_cache_stats[:entries])
+
+    # Plain paragraphs are cached one at a time (except the last one), and documents that start with the same paragraphs
+    # don't evict each other's blocks.
+    header = "Paragraph one.\n\nParagraph two."
+    [header + "\n\nParagraph three.", header + "\n\n[b]Something else[/b]"].cycle.take(4).each do |input|
+      assert_equal(DText.parse(input), DText.parse(input, cache_blocks: true), input.inspect)
+    end
+
+    assert_equal({ entries: 3, hits: 5, misses: 7 }, DText.block_cache_stats.slice(:entries, :hits, :misses))
+  end
+
+  def test_threads
+    paragraphs = Array.new(8_000) { |i| "h4. Title #{i}\r\n\r\n[b]bold[/b] [[creator #{i % 100}]] post ##{i} #qtag\n* one\n* two" }
+
+    # Split at the start of a block, and split inside a quote (where the segment after the split can't be used).
+    [paragraphs.join("\n\n"), "[quote]\n\n#{paragraphs.join("\n\n")}\n\n[/quote]"].each do |dtext|
+      assert_operator(dtext.bytesize, :>, 512 * 1024)
+      assert_equal(DText.parse(dtext, qtags: true), DText.parse(dtext, qtags: true, threads: 4))
+    end
+
+    assert_raises(DText::LimitExceeded) { DText.parse(paragraphs.join("\n\n"), max_output_bytes: 1_000_000, threads: 4) }
+
+    # Segments that start with a plain paragraph are used as is, rather than parsed again by the thread before them.
+    prose = Array.new(20_000) { |i| "Paragraph #{i} with some [b]bold[/b] text and a link to post ##{i}." }.join("\n\n")
+    DText.clear_parallel_stats
+    assert_equal(DText.parse(prose), DText.parse(prose, threads: 4))
+    assert_equal({ segments: 3, reused: 3 }, DText.parallel_stats)
+  end
+
+  def test_render_cache
+    dtext = "[b]deleted[/b]: [[foo]] post #1 #qtag \"link\":/posts"
+    options = [{}, { inline: true }, { qtags: true }, { base_url: "https://example.com" }, {}]
+    uncached = options.map { |o| DText.parse(dtext, **o) }
+
+    DText.render_cache_max_bytes = 1024 * 1024
+    stats = DText.render_cache_stats
+
+    options.zip(uncached).each do |o, expected|
+      assert_equal(expected, DText.parse(dtext, **o), o.inspect)
+      assert_equal(expected, DText.parse(dtext, **o), o.inspect)
+    end
+
+    assert_equal(stats[:hits] + 6, DText.render_cache_stats[:hits])
+    assert_equal(stats[:misses] + 4, DText.render_cache_stats[:misses])
+    assert_raises(DText::LimitExceeded) { DText.parse(dtext, max_output_bytes: 10) }
+
+    DText.clear_render_cache
+    assert_equal(0, DText.render_cache_stats[:entries])
+  ensure
+    DText.render_cache_max_bytes = 0
+  end
+
+  def test_shared_render_cache
+    dtext = "[b]deleted[/b]: [[foo]] post #1 #qtag \"link\":/posts"
+    expected = DText.parse(dtext, qtags: true)
+
+    Dir.mktmpdir do |dir|
+      path = File.join(dir, "dtext.cache")
+      DText.open_shared_render_cache(path, max_bytes: 1024 * 1024)
+      stats = DText.shared_render_cache_stats
+
+      # The output rendered in another process is seen by this one.
+      pid = fork { DText.parse(dtext, qtags: true); exit!(0) }
+      Process.wait(pid)
+      assert_equal(expected, DText.parse(dtext, qtags: true))
+      assert_equal(stats[:hits] + 1, DText.shared_render_cache_stats[:hits])
+      assert_equal(stats[:misses], DText.shared_render_cache_stats[:misses])
+      assert_equal(1, DText.shared_render_cache_stats[:entries])
+      assert_raises(DText::LimitExceeded) { DText.parse(dtext, qtags: true, max_output_bytes: 10) }
+
+      # A file written by another version is replaced with an empty one.
+      DText.c_open_shared_render_cache(path, 1024 * 1024, "0.0.0")
+      assert_equal(0, DText.shared_render_cache_stats[:entries])
+      assert_equal(expected, DText.parse(dtext, qtags: true))
+      assert_equal(1, DText.shared_render_cache_stats[:entries])
+
+      DText.clear_shared_render_cache
+      assert_equal(0, DText.shared_render_cache_stats[:entries])
+
+      # Slots left locked by a writer that crashed are taken over once the lock is old enough, but not before. Each
+      # slot is 40 bytes after a 48-byte header, with its seq first; the seq of a locked slot is the time it was locked
+      # at, shifted left one bit and with the low bit set.
+      lock_slots = ->(locked_at) do
+        File.open(path, "r+b") do |file|
+          (1024 * 1024 / 1024).times { |i| file.pwrite([locked_at << 1 | 1].pack("Q"), 48 + i * 40) }
+        end
+      end
+
+      lock_slots.call(Time.now.to_i)
+      DText.parse(dtext, qtags: true)
+      assert_equal(0, DText.shared_render_cache_stats[:entries])
+
+      lock_slots.call(Time.now.to_i - 60)
+      DText.parse(dtext, qtags: true)
+      assert_equal(1, DText.shared_render_cache_stats[:entries])
+      assert_equal(expected, DText.parse(dtext, qtags: true))
+    ensure
+      DText.close_shared_render_cache
+    end
+  end
+
+  def test_ractor
+    dtext = "[b]deleted[/b]: [[foo]] post #1 #qtag \"link\":/posts"
+    expected = DText.parse(dtext, qtags: true)
+    experimental, Warning[:experimental] = Warning[:experimental], false
+
+    ractors = 2.times.map do
+      Ractor.new(dtext) { |input| Ractor.make_shareable(DText.parse(input, qtags: true)) }
+    end
+
+    ractors.each { |ractor| assert_equal(expected, ractor.take) }
+    assert_predicate(expected[:dtext], :frozen?)
+  ensure
+    Warning[:experimental] = experimental
+  end
+
+  def test_stats
+    DText.clear_stats
+    3.times { DText.parse("[b]hello[/b]") }
+    DText.parse("a" * 2000, inline: true, qtags: true)
+    assert_raises(DText::LimitExceeded) { DText.parse("[b]hello[/b]", max_output_bytes: 5) }
+    assert_raises(DText::Error) { DText.parse("a\0b") }
+
+    stats = DText.stats
+    assert_equal(6, stats[:parses])
+    assert_equal(2, stats[:errors])
+    assert_equal(12 * 4 + 2000 + 3, stats[:bytes_in])
+    assert_equal("<p><strong>hello</strong></p>".size * 3 + 2000, stats[:bytes_out])
+    assert_equal({ "output too large" => 1, "input contains null byte" => 1 }, stats[:errors_by_message])
+    assert_equal(6, stats[:latency][:count])
+    assert_operator(stats[:latency][:p50], :>, 0)
+    assert_operator(stats[:latency][:p50], :<=, stats[:latency][:p99])
+    assert_operator(stats[:latency][:p99], :<=, stats[:latency][:max])
+
+    small, large = stats[:series].sort_by { |series| series[:max_bytes] }
+    assert_equal([1024, [], 5, 2], small.values_at(:max_bytes, :options, :parses, :errors))
+    assert_equal([16_384, [:inline, :qtags], 1, 0], large.values_at(:max_bytes, :options, :parses, :errors))
+
+    DText.clear_stats
+    assert_equal(0, DText.stats[:parses])
+    assert_equal([], DText.stats[:series])
+  end
+
+  def test_slow_samples
+    DText.slow_samples
+    DText.capture_slow_samples(expansion: 4, max_input_bytes: 8)
+    DText.parse("plain text")
+    DText.parse("[[foo]]", qtags: true)
+    assert_raises(DText::LimitExceeded) { DText.parse("[[foo]] [[bar]]", max_output_bytes: 100) }
+
+    samples = DText.slow_samples
+    assert_equal(["[[foo]]", "[[foo]] "], samples.map { |sample| sample[:dtext] })
+    assert_equal([false, true], samples.map { |sample| sample[:truncated] })
+    assert_equal([nil, "output too large"], samples.map { |sample| sample[:error] })
+    assert_equal(15, samples[1][:bytes_in])
+    assert_equal(100, samples[1][:options][:max_output_bytes])
+    assert_equal([], DText.slow_samples)
+
+    # The input is cut at a character boundary.
+    assert_raises(DText::LimitExceeded) { DText.parse("[[fooooé]] [[bar]]", max_output_bytes: 100) }
+    assert_equal(["[[foooo"], DText.slow_samples.map { |sample| sample[:dtext] })
+
+    dropped = DText.stats[:slow_samples][:dropped]
+    100.times { DText.parse("[[foo]]") }
+    assert_equal(64, DText.slow_samples.size)
+    assert_equal(dropped + 36, DText.stats[:slow_samples][:dropped])
+
+    DText.capture_slow_samples
+    assert_equal(DText.parse("[[foo]]", qtags: true), DText.parse(samples[0][:dtext], **samples[0][:options]))
+  ensure
+    DText.capture_slow_samples
+    DText.slow_samples
+  end
+
+  def test_profile
+    unless DText.respond_to?(:profile_snapshot)
+      assert_raises(NotImplementedError) { DText.profile_snapshot }
+      return
+    end
+
+    DText.profile_reset
+    DText.parse("[b]a[/b] [[foo]]")
+    profile = DText.profile_snapshot
+
+    assert_equal(1, profile["inline open_b"][:hits])
+    assert_equal(3, profile["inline open_b"][:bytes])
+    assert_equal(7, profile["inline basic_creator_link"][:bytes])
+
+    DText.profile_reset
+    assert_equal({}, DText.profile_snapshot)
+  end
+
+  def test_stale_creator_anchor
+    assert_parse('<p>[[m#<a rel="nofollow" class="dtext-link dtext-creator-link" href="/creators/show_or_new?name=%2F">1/</a></p>', "[[m#1[[/]]")
+  end
 end
@@ -0,0 +1,116 @@
+// Tests for the C API in ext/dtext/libdtext.h, run by ctest (see CMakeLists.txt). The parser itself is tested through
+// Ruby in test_dtext.rb; these only check that the API converts the options and results correctly.
+
+#include "libdtext.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int failures = 0;
+
+#define CHECK(condition) \
+  do { \
+    if (!(condition)) { \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+      failures++; \
+    } \
+  } while (0)
+
+static dtext_status parse(const char* dtext, const dtext_options* options, dtext_result* result) {
+  return dtext_parse(dtext, strlen(dtext), options, result);
+}
+
+static void test_parse(void) {
+  dtext_result result;
+
+  CHECK(parse("hello [b]world[/b]", NULL, &result) == DTEXT_OK);
+  CHECK(strcmp(result.html, "<p>hello <strong>world</strong></p>") == 0);
+  CHECK(result.html_length == strlen(result.html));
+  CHECK(result.error == NULL);
+  CHECK(!result.truncated);
+
+  dtext_result_free(&result);
+  CHECK(result.html == NULL);
+  dtext_result_free(&result);
+}
+
+static void test_metadata(void) {
+  dtext_options options;
+  dtext_result result;
+
+  dtext_options_init(&options);
+  options.f_qtags = true;
+
+  CHECK(parse("[[foo]] thumb #1 thumb #2 #bar", &options, &result) == DTEXT_OK);
+  CHECK(result.creators_count == 1 && strcmp(result.creators[0], "foo") == 0);
+  CHECK(result.post_ids_count == 2 && result.post_ids[0] == 1 && result.post_ids[1] == 2);
+  CHECK(result.qtags_count == 1 && strcmp(result.qtags[0], "bar") == 0);
+
+  dtext_result_free(&result);
+}
+
+static void test_options(void) {
+  const char* internal_domains[] = { "danbooru.donmai.us" };
+  dtext_options options;
+  dtext_result result;
+
+  dtext_options_init(&options);
+  options.f_inline = true;
+  options.internal_domains = internal_domains;
+  options.internal_domains_count = 1;
+
+  CHECK(parse("https://danbooru.donmai.us/posts/1234", &options, &result) == DTEXT_OK);
+  CHECK(strstr(result.html, "post #1234") != NULL);
+  CHECK(strstr(result.html, "<p>") == NULL);
+  dtext_result_free(&result);
+
+  dtext_options_init(&options);
+  options.max_visible_chars = 5;
+
+  CHECK(parse("hello world", &options, &result) == DTEXT_OK);
+  CHECK(result.truncated);
+  dtext_result_free(&result);
+
+  // Callers built against an older, smaller dtext_options get the defaults for the fields they don't have.
+  dtext_options_init(&options);
+  options.f_inline = true;
+  options.size = offsetof(dtext_options, f_inline);
+
+  CHECK(parse("hello", &options, &result) == DTEXT_OK);
+  CHECK(strcmp(result.html, "<p>hello</p>") == 0);
+  dtext_result_free(&result);
+}
+
+static void test_errors(void) {
+  dtext_options options;
+  dtext_result result;
+
+  CHECK(dtext_parse("a\0b", 3, NULL, &result) == DTEXT_INVALID_INPUT);
+  CHECK(result.html == NULL && strcmp(result.error, "input contains null byte") == 0);
+  dtext_result_free(&result);
+
+  CHECK(parse("\xff", NULL, &result) == DTEXT_INVALID_INPUT);
+  CHECK(strcmp(result.error, "input contains invalid UTF-8") == 0);
+  dtext_result_free(&result);
+
+  dtext_options_init(&options);
+  options.max_output_bytes = 10;
+
+  CHECK(parse("[b]hello world[/b]", &options, &result) == DTEXT_LIMIT_EXCEEDED);
+  CHECK(result.html == NULL && result.error != NULL);
+  dtext_result_free(&result);
+
+  CHECK(dtext_validate("ok", 2) == NULL);
+  CHECK(dtext_parse("", 0, NULL, NULL) == DTEXT_INVALID_INPUT);
+}
+
+int main(void) {
+  test_parse();
+  test_metadata();
+  test_options();
+  test_errors();
+
+  printf("libdtext %s: %s\n", dtext_version(), failures ? "FAILED" : "ok");
+  return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}